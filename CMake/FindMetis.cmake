@@ -4,11 +4,20 @@
 #  METIS_FOUND - System has metis
 #  METIS_INCLUDE_DIR - The metis include directory
 #  METIS_LIBRARIES - The libraries needed to use metis
+#  METIS_IDXTYPEWIDTH - Width in bits of the METIS idx_t type (32 or 64)
 
 FIND_PATH(METIS_INCLUDE_DIR NAMES metis.h)
 
 FIND_LIBRARY(METIS_LIBRARIES NAMES metis)
 
+# The width of idx_t determines the largest graph that can be partitioned
+IF(METIS_INCLUDE_DIR AND EXISTS "${METIS_INCLUDE_DIR}/metis.h")
+  FILE(STRINGS "${METIS_INCLUDE_DIR}/metis.h" METIS_IDXTYPEWIDTH_LINE
+    REGEX "^#define[ \t]+IDXTYPEWIDTH[ \t]+[0-9]+")
+  STRING(REGEX REPLACE ".*IDXTYPEWIDTH[ \t]+([0-9]+).*" "\\1"
+    METIS_IDXTYPEWIDTH "${METIS_IDXTYPEWIDTH_LINE}")
+ENDIF()
+
 INCLUDE(FindPackageHandleStandardArgs)
 
 FIND_PACKAGE_HANDLE_STANDARD_ARGS(Metis DEFAULT_MSG METIS_LIBRARIES METIS_INCLUDE_DIR)
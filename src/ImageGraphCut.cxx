@@ -1,12 +1,31 @@
 #include <iostream>
 #include "ImageGraphCut.h"
+#include "ImageGraphFile.h"
 #include "METISTools.h"
+#include "MultiResolutionPartition.h"
+#include "ProcessUsage.h"
+#include "StreamingGraphBuilder.h"
 #include "itkImageFileReader.h"
 #include "itkImageFileWriter.h"
 #include "itkConnectedComponentImageFilter.h"
 #include "itkRelabelComponentImageFilter.h"
 #include "itkImageRegionConstIterator.h"
-#include "itkBinaryThresholdImageFilter.h"
+#include "itkImageSource.h"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <exception>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <sstream>
+#include <stdexcept>
+#include <thread>
 
 using namespace std;
 using namespace itk;
@@ -15,44 +34,387 @@ using namespace itk;
  * GLOBAL TYPE DEFINITIONS
  * *************************************************************************** */
 typedef itk::Image< short, 3 > ImageType;
-typedef ImageToGraphFilter< ImageType > GraphFilter;
-typedef GraphFilter::WeightFunctorType BaseWeightFunctor;
+typedef ImageFileReader<ImageType> ReaderType;
 typedef vnl_vector<float> Vec;
 
 /* ***************************************************************************
  * WEIGHT TABLE CODE
  * *************************************************************************** */
-class MyWeightFunctor : public BaseWeightFunctor
+
+/**
+ * Weights of the graph of an image. By default, the nonzero pixels are the
+ * vertices, and all vertices and edges have unit weight. The rules of a hint
+ * file are instead compiled into dense tables over the intensities of the
+ * image, so that every weight is a single lookup, as fast as unit weights.
+ */
+class MyWeightFunctor : public StaticGraphWeightFunctor<MyWeightFunctor, ImageType, idxtype>
 {
 public:
 
-  /** Read table from file */
-  bool ReadTable(const char *file) { return false; };
+  /** 
+   * Compile the rules of a hint file into tables for the intensities lo to
+   * hi, which every pixel must fall into. Random weights are drawn once for
+   * every intensity or pair of intensities, using the given seed. Throws if
+   * the file cannot be read or has an invalid rule.
+   */
+  void ReadTable(const char *file, short lo, short hi, unsigned int seed);
+
+  /** Whether the weights come from a hint file */
+  bool HasTable() const { return m_VertexTable.size() > 0; }
 
   /** Check inclusion */
-  virtual bool IsPixelAVertex(short i1)
+  bool IsPixelAVertex(short i1) const
   {
-    return i1 != 0;
+    return m_VertexTable.size() ? m_VertexTable[i1 - m_Low] > 0 : i1 != 0;
   }
   
   /** Compute edge weight */
-  virtual int GetEdgeWeight(short i1, short i2)
+  idxtype GetEdgeWeight(short i1, short i2) const
   {
-    return 1;
+    return m_EdgeTable.size() ? m_EdgeTable[(i1 - m_Low) * m_Range + (i2 - m_Low)] : 1;
   }
 
   /** Compute vertex weight */
-  virtual int GetVertexWeight(short i1)
+  idxtype GetVertexWeight(short i1) const
+  {
+    return m_VertexTable.size() ? m_VertexTable[i1 - m_Low] : 1;
+  }
+
+  /** The largest weight of any edge */
+  idxtype GetMaximumEdgeWeight() const
+  {
+    return m_EdgeTable.size() ? *std::max_element(m_EdgeTable.begin(), m_EdgeTable.end()) : 1;
+  }
+
+protected:
+  short m_Low = 0;
+  size_t m_Range = 0;
+  std::vector<idxtype> m_VertexTable, m_EdgeTable;
+};
+
+void MyWeightFunctor::ReadTable(const char *file, short lo, short hi, unsigned int seed)
+{
+  // The edge table holds every pair of intensities
+  const size_t max_range = 4096;
+  if(hi < lo || (size_t) (hi - lo + 1) > max_range)
+    throw std::invalid_argument("Hint files need the image intensities to span at most 4096 values");
+
+  std::ifstream in(file);
+  if(!in)
+    throw std::runtime_error(std::string("Cannot read hint file ") + file);
+
+  // Without rules, the tables hold the default weights
+  m_Low = lo;
+  m_Range = hi - lo + 1;
+  m_VertexTable.assign(m_Range, 1);
+  if(lo <= 0 && hi >= 0)
+    m_VertexTable[-lo] = 0;
+  m_EdgeTable.assign(m_Range * m_Range, 1);
+
+  std::mt19937 rng(seed);
+  size_t line_no = 0;
+  for(std::string line; std::getline(in, line); )
   {
-    return 1;
+    line_no++;
+    std::istringstream iss(line);
+    std::string type;
+    if(!(iss >> type) || type[0] == '#')
+      continue;
+
+    std::ostringstream where;
+    where << "hint file " << file << ", line " << line_no << ": ";
+
+    // Read the intensities, which are all the intensities for a wildcard.
+    // Intensities that do not occur in the image match nothing.
+    unsigned int n_int = (type == "V") ? 1 : (type == "E") ? 2 : 0;
+    if(n_int == 0)
+      throw std::invalid_argument(where.str() + "unknown rule " + type);
+    long first[2], last[2];
+    for(unsigned int k = 0; k < n_int; k++)
+    {
+      std::string token;
+      if(!(iss >> token))
+        throw std::invalid_argument(where.str() + "missing intensity");
+      if(token == "*")
+      {
+        first[k] = lo;
+        last[k] = hi;
+      }
+      else
+      {
+        char *end;
+        first[k] = last[k] = strtol(token.c_str(), &end, 10);
+        if(*end)
+          throw std::invalid_argument(where.str() + "invalid intensity " + token);
+      }
+      first[k] = std::max(first[k], (long) lo);
+      last[k] = std::min(last[k], (long) hi);
+    }
+
+    // Read the weight, which is either fixed or a distribution
+    std::string spec;
+    double a = 0, b = 0;
+    if(!(iss >> spec))
+      throw std::invalid_argument(where.str() + "missing weight");
+    if(spec == "U" || spec == "N")
+    {
+      if(!(iss >> a >> b) || (spec == "U" && b < a) || (spec == "N" && b < 0))
+        throw std::invalid_argument(where.str() + "invalid weight distribution");
+    }
+    else
+    {
+      char *end;
+      a = strtod(spec.c_str(), &end);
+      if(*end || a != (long) a || a < (n_int == 1 ? 0 : 1))
+        throw std::invalid_argument(where.str() + "invalid weight " + spec);
+    }
+
+    // Random weights are rounded, and at least one
+    auto weight = [&]() -> idxtype {
+      double w = a;
+      if(spec == "U")
+        w = std::uniform_real_distribution<double>(a, b)(rng);
+      else if(spec == "N")
+        w = std::normal_distribution<double>(a, b)(rng);
+      else
+        return (idxtype) a;
+      return (idxtype) std::max(1.0, std::floor(w + 0.5));
+    };
+
+    // Later rules replace earlier ones. Edges are symmetric, so each pair
+    // of intensities gets one weight.
+    if(n_int == 1)
+    {
+      for(long i = first[0]; i <= last[0]; i++)
+        m_VertexTable[i - lo] = weight();
+    }
+    else
+    {
+      for(long i = first[0]; i <= last[0]; i++)
+      {
+        for(long j = first[1]; j <= last[1]; j++)
+        {
+          // A pair that both ranges hold is only drawn once
+          if(i > j && j >= first[0] && i <= last[1])
+            continue;
+          idxtype w = weight();
+          m_EdgeTable[(i - lo) * m_Range + (j - lo)] = w;
+          m_EdgeTable[(j - lo) * m_Range + (i - lo)] = w;
+        }
+      }
+    }
   }
+}
+
+typedef ImageToGraphFilter< ImageType, idxtype, idxtype, MyWeightFunctor > GraphFilter;
+
+/** Compile the hint file p.fnHint, if there is one, for the intensities of an image */
+void InitializeWeights(const ImageGraphCutParameters &p, ImageType *img, MyWeightFunctor &fnWeight)
+{
+  if(p.fnHint.empty())
+    return;
+
+  const short *buffer = img->GetBufferPointer();
+  size_t n_pixels = img->GetBufferedRegion().GetNumberOfPixels();
+  if(n_pixels == 0)
+    return;
+  auto range = std::minmax_element(buffer, buffer + n_pixels);
+  unsigned int seed = p.use_random_seed ? p.random_seed : std::random_device()();
+  cout << "compiling hint file " << p.fnHint << " for intensities "
+       << *range.first << " to " << *range.second << endl;
+  fnWeight.ReadTable(p.fnHint.c_str(), *range.first, *range.second, seed);
+}
+
+/**
+ * The image whose nonzero pixels are the ones that may be vertices, from
+ * which the connected components are found: the image itself, unless the
+ * weights come from a hint file.
+ */
+ImageType::Pointer GetVertexMask(ImageType *img, const MyWeightFunctor &fnWeight)
+{
+  if(!fnWeight.HasTable())
+    return img;
+
+  ImageType::Pointer mask = ImageType::New();
+  mask->CopyInformation(img);
+  mask->SetRegions(img->GetBufferedRegion());
+  mask->Allocate();
+  const short *buffer = img->GetBufferPointer();
+  short *mask_buffer = mask->GetBufferPointer();
+  for(size_t i = 0; i < img->GetBufferedRegion().GetNumberOfPixels(); i++)
+    mask_buffer[i] = fnWeight.IsPixelAVertex(buffer[i]) ? 1 : 0;
+  return mask;
+}
+
+typedef GraphFilter::EdgeWeightImageType EdgeImageType;
+typedef GraphFilter::EdgeWeightKernelType EdgeKernel;
+
+/**
+ * Changes to the edge weights of the functor: the companion image whose
+ * intensity differences scale them, and the plane along which cuts are cheap
+ */
+struct EdgeWeightModifiers
+{
+  EdgeImageType::Pointer image;
+  EdgeKernel kernel;
+  VoxelCutPlane plane;
 };
 
+/**
+ * Check the relative weights of the parts in p.xWeights, which METIS and the
+ * boundary refinement scale to the weight of the graph. They must not be
+ * negative, and must add up to a positive number.
+ */
+void CheckPartWeights(const ImageGraphCutParameters &p)
+{
+  double sum = 0.0;
+  for(unsigned int i = 0; i < p.xWeights.size(); i++)
+  {
+    if(!(p.xWeights[i] >= 0))
+      throw std::invalid_argument("The weights of the parts must not be negative");
+    sum += p.xWeights[i];
+  }
+  if(p.xWeights.size() && !(sum > 0))
+    throw std::invalid_argument("The weights of the parts must add up to a positive number");
+}
+
+/** The cut plane given by p.iPlaneDim, p.iPlaneSlice and p.iPlaneStrength */
+VoxelCutPlane GetCutPlane(const ImageGraphCutParameters &p)
+{
+  VoxelCutPlane plane;
+  if(p.iPlaneDim < 0)
+    return plane;
+  if(p.iPlaneDim > 2)
+    throw std::invalid_argument("The dimension of the cut plane must be 0, 1 or 2");
+  if(p.iPlaneStrength < 1)
+    throw std::invalid_argument("The strength of the cut plane must be at least one");
+  plane.Dimension = p.iPlaneDim;
+  plane.Slice = p.iPlaneSlice;
+  plane.Strength = p.iPlaneStrength;
+  return plane;
+}
+
+/** Read the companion image p.fnEdgeImage of img, or return null if there is none */
+EdgeImageType::Pointer ReadEdgeImage(const ImageGraphCutParameters &p, const ImageType *img)
+{
+  if(p.fnEdgeImage.empty())
+    return nullptr;
+
+  cout << "reading edge weight image" << endl;
+  typedef ImageFileReader<EdgeImageType> EdgeReaderType;
+  EdgeReaderType::Pointer fltReader = EdgeReaderType::New();
+  fltReader->SetFileName(p.fnEdgeImage.c_str());
+  fltReader->Update();
+  EdgeImageType::Pointer image = fltReader->GetOutput();
+  if(image->GetBufferedRegion().GetSize() != img->GetBufferedRegion().GetSize())
+    throw std::invalid_argument("Edge weight image does not match the input image size");
+  return image;
+}
+
+/**
+ * Tabulate the kernel of p.edge_function for the companion image. Unless
+ * p.edge_sigma is positive, sigma is the root mean square of the intensity
+ * differences along the edges between the pixels of the vertex mask, in the
+ * neighborhood given by p.connectivity.
+ */
+void InitializeEdgeWeights(const ImageGraphCutParameters &p, EdgeImageType *image,
+                           const ImageType *vertex_mask, EdgeWeightModifiers &edges)
+{
+  EdgeKernel::FunctionType function;
+  if(p.edge_function == "gauss")
+    function = EdgeKernel::Gaussian;
+  else if(p.edge_function == "exp")
+    function = EdgeKernel::Exponential;
+  else if(p.edge_function == "inv")
+    function = EdgeKernel::Inverse;
+  else
+    throw std::invalid_argument("Unknown edge weight function " + p.edge_function);
+  if(p.edge_scale < 1)
+    throw std::invalid_argument("The edge weight scale must be at least one");
+  if(p.edge_scale > std::numeric_limits<idxtype>::max())
+    throw std::invalid_argument("The edge weight scale does not fit into the graph index type");
+
+  double sigma = p.edge_sigma;
+  if(sigma <= 0)
+  {
+    // Visit every edge of the stencil once, from the voxel that comes first
+    // in raster order
+    const ImageType::SizeType &size = image->GetBufferedRegion().GetSize();
+    const long n[3] = { (long) size[0], (long) size[1], (long) size[2] };
+    CheckVoxelConnectivity(p.connectivity);
+    std::vector<unsigned int> forward;
+    for(unsigned int k = 0; k < (unsigned int) p.connectivity; k++)
+    {
+      const int *o = VoxelNeighborOffsets[k];
+      if(o[2] > 0 || (o[2] == 0 && (o[1] > 0 || (o[1] == 0 && o[0] > 0))))
+        forward.push_back(k);
+    }
+
+    const float *buffer = image->GetBufferPointer();
+    const short *mask = vertex_mask->GetBufferPointer();
+    double sum_sq = 0.0;
+    size_t n_edges = 0;
+    for(long z = 0, i = 0; z < n[2]; z++)
+      for(long y = 0; y < n[1]; y++)
+        for(long x = 0; x < n[0]; x++, i++)
+        {
+          if(!mask[i])
+            continue;
+          const long pos[3] = { x, y, z };
+          for(unsigned int k : forward)
+          {
+            const int *o = VoxelNeighborOffsets[k];
+            bool inside = true;
+            for(unsigned int d = 0; d < 3; d++)
+              inside = inside && pos[d] + o[d] >= 0 && pos[d] + o[d] < n[d];
+            long j = i + o[0] + n[0] * (o[1] + n[1] * o[2]);
+            if(inside && mask[j])
+            {
+              double diff = buffer[j] - buffer[i];
+              sum_sq += diff * diff;
+              n_edges++;
+            }
+          }
+        }
+    sigma = n_edges ? std::sqrt(sum_sq / n_edges) : 0.0;
+    if(!(sigma > 0))
+      sigma = 1.0;
+  }
+
+  cout << "edge weights " << p.edge_scale << " * " << p.edge_function
+       << "(difference / " << sigma << ")" << endl;
+  edges.image = image;
+  edges.kernel.Initialize(function, sigma, p.edge_scale);
+}
+
+/**
+ * Make sure that the edge weights fit into idxtype. The weight of an edge is
+ * the product of the weight of the functor, the neighbor weight of the
+ * connectivity, the weight of the companion image and the factor of the cut
+ * plane, so the product of their maxima is checked.
+ */
+void CheckEdgeWeightRange(const MyWeightFunctor &fnWeight, const EdgeWeightModifiers &edges,
+                          unsigned int connectivity)
+{
+  double max_weight = (double) fnWeight.GetMaximumEdgeWeight()
+    * GetVoxelNeighborWeight(connectivity, 0)
+    * edges.kernel.GetMaximumWeight()
+    * (edges.plane.IsEnabled() ? edges.plane.Strength : 1);
+  if(max_weight > (double) std::numeric_limits<idxtype>::max())
+  {
+    std::ostringstream oss;
+    oss << "Edge weights of up to " << max_weight << " do not fit into the "
+        << 8 * sizeof(idxtype) << "-bit graph index type. Reduce the hint weights, "
+        << "the edge weight scale or the cut plane strength.";
+    throw std::invalid_argument(oss.str());
+  }
+}
+
 /* ***************************************************************************
  * GRAPH VERIFICATION
  * *************************************************************************** */
 template<class T, class S>
-void VerifyGraph(int n, T *ai, T *a, S *wv, S *we)
+void VerifyGraph(T n, T *ai, T *a, S *wv, S *we)
 {
   for(T i=0; i < n; i++)
   {
@@ -82,11 +444,24 @@ void VerifyGraph(int n, T *ai, T *a, S *wv, S *we)
   }
 }
 
-Vec OptimizeMETISPartition(GraphFilter *fltGraph, const Vec &xWeights)
+/**
+ * Optimize the part weights with the OnePlusOneEvolutionaryOptimizer. METIS
+ * runs with the final settings during the optimization, so the partition of 
+ * the best weights is returned along with them and need not be recomputed.
+ */
+template <class TGraph>
+Vec OptimizeMETISPartition(TGraph *graph, const Vec &xWeights,
+                           const ImageGraphCutParameters &p,
+                           std::vector<idxtype> &partition, idxtype &edgecut,
+                           std::ostream &out)
 {
   // Create a METIS problem based on the graph and weights
   MetisPartitionProblem::Pointer mp = MetisPartitionProblem::New();
-  mp->SetProblem(fltGraph, xWeights.size() - 1);
+  mp->SetProblem(graph, xWeights.size() - 1);
+  mp->SetTolerance(p.tolerance);
+  mp->SetNumberOfTries(p.nMetisIter);
+  mp->SetUseRecursiveAlgorithm(false);
+  mp->SetLog(&out);
 
   // Get the starting solution
   MetisPartitionProblem::ParametersType x( xWeights.size() - 1 );
@@ -106,191 +481,2091 @@ Vec OptimizeMETISPartition(GraphFilter *fltGraph, const Vec &xWeights)
   opt->SetNormalVariateGenerator(generator);
   opt->StartOptimization();
 
-  x = opt->GetCurrentPosition();
-  Vec xResult(xWeights.size(), 0.0);
-  xResult[xWeights.size() - 1] = 1.0;
-  for(unsigned int i = 0; i < xWeights.size() - 1; i++)
+  // Make sure there is a best partition even if the optimizer made no calls
+  if(mp->GetBestPartition().empty())
+    mp->GetValue(x);
+
+  out << "      Cost cache: " << mp->GetNumberOfCacheHits() << " of "
+      << mp->GetNumberOfEvaluations() << " evaluations reused" << endl;
+
+  partition.swap(mp->GetBestPartition());
+  edgecut = mp->GetBestEdgeCut();
+  return mp->GetBestWeights();
+}
+
+/* ***************************************************************************
+ * PROFILING
+ * *************************************************************************** */
+
+/** The resources used between two readings */
+ImageGraphCutStageProfile MakeStageProfile(const std::string &name,
+                                           const ProcessUsage &start, const ProcessUsage &end)
+{
+  ImageGraphCutStageProfile stage;
+  stage.name = name;
+  stage.wall_seconds = end.WallSeconds - start.WallSeconds;
+  stage.cpu_seconds = end.CPUSeconds - start.CPUSeconds;
+  stage.peak_rss_bytes = end.PeakResidentBytes;
+  return stage;
+}
+
+/**
+ * A stage of a run, which is added to the profile when it is stopped or
+ * goes out of scope. Nothing is measured without a profile.
+ */
+class ProfileStage
+{
+public:
+  ProfileStage(ImageGraphCutProfile *profile, const char *name)
+    : m_Profile(profile), m_Name(name)
   {
-    xResult[i] = x[i];
-    xResult[xWeights.size() - 1] -= x[i];
+    if(m_Profile)
+      m_Start = GetProcessUsage();
   }
-  
-  return xResult;
-}
 
+  ~ProfileStage() { Stop(); }
 
-int image_graph_cut(const ImageGraphCutParameters &p)
+  void Stop()
+  {
+    if(m_Profile)
+      m_Profile->stages.push_back(MakeStageProfile(m_Name, m_Start, GetProcessUsage()));
+    m_Profile = nullptr;
+  }
+
+private:
+  ImageGraphCutProfile *m_Profile;
+  const char *m_Name;
+  ProcessUsage m_Start;
+};
+
+/** Seconds elapsed since a time point */
+double SecondsSince(std::chrono::steady_clock::time_point t_start)
 {
-  // Set random seed
-  if(p.use_random_seed)
-    srand(p.random_seed);
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() - t_start).count();
+}
 
-  // Write partition information
-  cout << "will generate " << p.nParts << " partitions" << endl;
-  float xWeightSum = 0.0f;
-  for(unsigned int iPart = 0;iPart < p.nParts;iPart++)
+/** Quote a string for JSON */
+std::string JSONString(const std::string &str)
+{
+  std::ostringstream oss;
+  oss << '"';
+  for(char c : str)
   {
-    cout << "   part " << iPart << "\t weight " << p.xWeights[iPart] << endl;
-    xWeightSum += p.xWeights[iPart];
+    if(c == '"' || c == '\\')
+      oss << '\\' << c;
+    else if((unsigned char) c < 0x20)
+      oss << "\\u" << std::hex << std::setw(4) << std::setfill('0') << (int) c << std::dec;
+    else
+      oss << c;
   }
-  cout << "   total of weights : " << xWeightSum << endl;
-  if(p.iPlaneDim >= 0)
+  oss << '"';
+  return oss.str();
+}
+
+/** Write the JSON fields of a stage */
+std::ostream &operator << (std::ostream &out, const ImageGraphCutStageProfile &stage)
+{
+  return out << "{ \"name\": " << JSONString(stage.name)
+             << ", \"wall_seconds\": " << stage.wall_seconds
+             << ", \"cpu_seconds\": " << stage.cpu_seconds
+             << ", \"peak_rss_bytes\": " << stage.peak_rss_bytes << " }";
+}
+
+/** Save the profile of a run as a JSON file */
+void WriteProfileFile(const std::string &filename, const ImageGraphCutParameters &p,
+                      const ImageGraphCutProfile &profile)
+{
+  std::ofstream out(filename);
+  out << std::setprecision(9);
+  out << "{" << endl;
+  out << "  \"input\": " << JSONString(p.fnInput) << "," << endl;
+  out << "  \"output\": " << JSONString(p.fnOutput) << "," << endl;
+  out << "  \"n_parts\": " << p.nParts << "," << endl;
+  out << "  \"n_threads\": " << p.n_threads << "," << endl;
+  out << "  \"total\": " << profile.total << "," << endl;
+  out << "  \"stages\": [";
+  for(size_t i = 0; i < profile.stages.size(); i++)
+    out << (i ? "," : "") << endl << "    " << profile.stages[i];
+  out << endl << "  ]," << endl;
+  out << "  \"components\": [";
+  for(size_t i = 0; i < profile.components.size(); i++)
   {
-    cout << "will insert cut plane at slice " << p.iPlaneSlice
-         << " in dimension " << p.iPlaneDim
-         << " with strength " << p.iPlaneStrength << endl;
+    const ImageGraphCutComponentProfile &c = profile.components[i];
+    out << (i ? "," : "") << endl
+        << "    { \"label\": " << c.label << ", \"n_parts\": " << c.n_parts
+        << ", \"voxels\": " << c.voxels << ", \"vertices\": " << c.vertices
+        << ", \"edges\": " << c.edges << ", \"runs\": " << c.runs
+        << ", \"graph_bytes\": " << c.graph_bytes << ", \"edge_cut\": " << c.edge_cut
+        << ", \"partition_seconds\": " << c.partition_seconds
+        << ", \"optimize_seconds\": " << c.optimize_seconds
+        << ", \"metis_seconds\": " << c.metis_seconds
+        << ", \"write_seconds\": " << c.write_seconds << " }";
   }
-  cout << endl;
+  out << endl << "  ]" << endl;
+  out << "}" << endl;
+  if(!out)
+    throw std::runtime_error("Cannot write profile " + filename);
+}
 
-  // Read the input image image
-  cout << "reading input image" << endl;
+/* ***************************************************************************
+ * COMPONENT SCHEDULING
+ * *************************************************************************** */
 
-  typedef ImageFileReader<ImageType> ReaderType;
-  ReaderType::Pointer fltReader = ReaderType::New();
-  fltReader->SetFileName(p.fnInput.c_str());
-  fltReader->Update();
-  ImageType::Pointer img = fltReader->GetOutput();
+/** A subgraph holding the vertices of one connected component */
+typedef VoxelGraph<idxtype> ComponentGraph;
 
-         // Extract connected components
-  typedef itk::ConnectedComponentImageFilter<ImageType, ImageType> ConnFilter;
-  ConnFilter::Pointer conn_filter = ConnFilter::New();
-  conn_filter->SetInput(img);
-  conn_filter->Update();
-  conn_filter->SetFullyConnected(false);
+/** A connected component to be partitioned */
+struct ComponentTask
+{
+  short label;
+  unsigned int n_parts;
+  ComponentGraph *graph;
+  size_t memory;
+  unsigned int max_part = 0;
+};
 
-  typedef itk::RelabelComponentImageFilter<ImageType, ImageType> RelabelFilter;
-  RelabelFilter::Pointer relabel_filter = RelabelFilter::New();
-  relabel_filter->SetInput(conn_filter->GetOutput());
-  relabel_filter->Update();
-  ImageType::Pointer comp_map_image = relabel_filter->GetOutput();
+/**
+ * Rough estimate of the additional memory needed to partition a component,
+ * which is dominated by the METIS workspace, a few times the graph size.
+ */
+size_t EstimateComponentMemory(const ComponentGraph &graph)
+{
+  return 3 * graph.GetMemorySize();
+}
 
-         // Get a list of connected components and their size
-  unsigned int hist_size = p.max_comp + 1;
-  std::vector<unsigned int> comp_histogram(hist_size, 0);
-  unsigned int n_total = 0;
-  for(itk::ImageRegionConstIterator<ImageType> it(comp_map_image, comp_map_image->GetBufferedRegion());
-       !it.IsAtEnd(); ++it)
+/**
+ * Build a single graph over the whole image and split it into one subgraph
+ * per component that needs to be partitioned, i.e., one whose index in
+ * comp_block is not negative. Since the vertices of a run are contiguous
+ * voxels, every run belongs to a single component, so one lookup in the
+ * component map per run is enough to split the graph. The voxels are linked
+ * to their 6, 18 or 26 neighbors, as given by connectivity, and the edge
+ * weights are changed by the companion image and cut plane in edges, if given.
+ */
+void BuildComponentGraphs(ImageType *img, ImageType *comp_map_image,
+                          const std::vector<int> &comp_block,
+                          std::vector<ComponentGraph> &comp_graphs,
+                          MyWeightFunctor *fnWeight, unsigned int connectivity,
+                          const EdgeWeightModifiers *edges = nullptr)
+{
+  // Build the graph of the whole image
+  GraphFilter::Pointer fltGraph = GraphFilter::New();
+  fltGraph->SetInput(img);
+  fltGraph->SetWeightFunctor(fnWeight);
+  if(edges && edges->image)
+    fltGraph->SetEdgeWeightImage(edges->image, &edges->kernel);
+  if(edges)
+    fltGraph->SetCutPlane(edges->plane);
+  fltGraph->SetConnectivity(connectivity);
+  fltGraph->ParallelBuildOn();
+  fltGraph->Update();
+
+  // Assign each run of vertices to the subgraph of its component
+  const short *comp_buffer = comp_map_image->GetBufferPointer();
+  const GraphFilter::VertexRun *runs = fltGraph->GetVertexRuns();
+  std::vector<int> run_block(fltGraph->GetNumberOfVertexRuns());
+  for(size_t iRun = 0; iRun < run_block.size(); iRun++)
   {
-    short val = it.Value();
-    if(val > 0 && val < hist_size)
+    short comp = comp_buffer[runs[iRun].BufferOffset];
+    run_block[iRun] = (comp > 0 && comp < (int) comp_block.size()) ? comp_block[comp] : -1;
+  }
+
+  SplitVoxelGraph(fltGraph.GetPointer(), run_block, comp_graphs);
+}
+
+/**
+ * Run tasks, e.g., one for each component, on a pool of n_threads threads.
+ * Tasks start in the order of decreasing memory estimate, held in their
+ * memory field, and a task only starts when its estimate fits within the
+ * memory budget together with the running tasks (or when no other task is
+ * running). A zero budget means no limit. The first exception thrown by a
+ * task is rethrown once all threads finish.
+ */
+template <class TTask>
+void RunTasks(std::vector<TTask> &tasks, int n_threads, double mem_budget,
+              std::function<void(TTask &)> fn)
+{
+  std::vector<TTask *> queue;
+  for(auto &task : tasks)
+    queue.push_back(&task);
+  std::stable_sort(queue.begin(), queue.end(), [](TTask *a, TTask *b) {
+    return a->memory > b->memory;
+  });
+
+  std::mutex mutex;
+  std::condition_variable cv;
+  size_t next = 0, n_running = 0;
+  double mem_running = 0;
+  std::exception_ptr error;
+
+  auto worker = [&]() {
+    while(true)
     {
-      comp_histogram[val]++;
-      n_total++;
+      TTask *task;
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        cv.wait(lock, [&]() {
+          return next >= queue.size() || error || n_running == 0 || mem_budget <= 0 ||
+                 mem_running + queue[next]->memory <= mem_budget;
+        });
+        if(next >= queue.size() || error)
+          return;
+        task = queue[next++];
+        n_running++;
+        mem_running += task->memory;
+      }
+
+      try
+      {
+        fn(*task);
+      }
+      catch(...)
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        if(!error)
+          error = std::current_exception();
+      }
+
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        n_running--;
+        mem_running -= task->memory;
+      }
+      cv.notify_all();
     }
+  };
+
+  // The calling thread is one of the workers
+  std::vector<std::thread> threads;
+  for(int i = 1; i < std::min<int>(n_threads, (int) queue.size()); i++)
+    threads.emplace_back(worker);
+  worker();
+  for(auto &t : threads)
+    t.join();
+
+  if(error)
+    std::rethrow_exception(error);
+}
+
+/**
+ * Partition a graph with METIS, optimizing the part weights first if asked.
+ * The weights used are returned in compWeights. Returns the edge cut. The
+ * time taken is added to the optimization or METIS time of the profile.
+ */
+idxtype PartitionGraph(const ImageGraphCutParameters &p,
+                       ComponentGraph *graph,
+                       Vec &compWeights,
+                       std::vector<idxtype> &partition,
+                       std::ostream &out,
+                       ImageGraphCutComponentProfile *profile = nullptr)
+{
+  auto t_start = std::chrono::steady_clock::now();
+  idxtype cut;
+  if(p.flagOptimize && p.opt_population > 1)
+  {
+    // Search the weights in parallel. The search runs METIS with the same
+    // settings as below, so its best partition is the final one.
+    MetisWeightSearchParameters sp;
+    sp.PopulationSize = p.opt_population;
+    sp.MaximumEvaluations = p.opt_max_evals;
+    sp.MaximumSeconds = p.opt_max_seconds;
+    sp.Seed = p.use_random_seed ? p.random_seed : 0;
+    sp.Tolerance = p.tolerance;
+    sp.NumberOfTries = p.nMetisIter;
+    sp.UseRecursiveAlgorithm = false;
+
+    MetisWeightSearchResult sr = SearchMETISPartitionWeights(
+      GetMetisGraphView(graph),
+      std::vector<float>(compWeights.begin(), compWeights.end()), sp);
+    compWeights.copy_in(sr.Weights.data());
+    partition.swap(sr.Partition);
+    cut = sr.EdgeCut;
+    out << "      Optimized weights: " << compWeights << endl;
+    out << "      Weight search: " << sr.Evaluations << " METIS runs in "
+        << sr.Generations << " generations, " << sr.Seconds << " s" << endl;
+  }
+  else if(p.flagOptimize)
+  {
+    // Run the experimental optimization, which returns the partition of
+    // the best set of weights
+    compWeights = OptimizeMETISPartition(graph, compWeights, p, partition, cut, out);
+    out << "      Optimized weights: " << compWeights << endl;
+  }
+  else
+  {
+    // Run METIS once, using the specified weights
+    partition.resize(graph->GetNumberOfVertices());
+    cut = RunMETISPartition(
+      graph, compWeights.size(), compWeights.data_block(), partition.data(),
+      p.tolerance, p.nMetisIter, false);
   }
 
-         // Compute the total number of pixels and proportion of each component
-  std::map<short, unsigned int> comp_parts;
-  for(unsigned int i = 1; i < hist_size; i++)
+  if(profile)
+    (p.flagOptimize ? profile->optimize_seconds : profile->metis_seconds) += SecondsSince(t_start);
+  return cut;
+}
+
+/* ***************************************************************************
+ * INCREMENTAL REPARTITIONING
+ * *************************************************************************** */
+
+/**
+ * Flag the voxels next to an edit of the mask, i.e., the neighbors, in the
+ * neighborhood of the graph given by connectivity, of the voxels that had a
+ * label in the previous result but are no longer part of a component. Voxels
+ * that were added to the mask are recognized later by their missing previous
+ * label.
+ */
+std::vector<unsigned char> FindEditedVoxels(ImageType *comp_map_image, ImageType *imgPrev,
+                                            unsigned int connectivity)
+{
+  const ImageType::SizeType &size = comp_map_image->GetBufferedRegion().GetSize();
+  const long nx = size[0], ny = size[1], nz = size[2];
+  const short *comp = comp_map_image->GetBufferPointer();
+  const short *prev = imgPrev->GetBufferPointer();
+  std::vector<unsigned char> edited(nx * ny * nz, 0);
+  size_t i = 0;
+  for(long z = 0; z < nz; z++)
   {
-    double frac = comp_histogram[i] * 1.0 / n_total;
-    if(frac >= p.min_comp_frac)
+    for(long y = 0; y < ny; y++)
     {
-      int n_parts = std::max(1, (int)(0.5 + p.nParts * frac));
-      comp_parts[i] = n_parts;
-      std::cout << "Keeping component " << i << " fraction " << frac << " parts " << n_parts << endl;
+      for(long x = 0; x < nx; x++, i++)
+      {
+        if(prev[i] == 0 || comp[i] != 0)
+          continue;
+        edited[i] = 1;
+        for(unsigned int k = 0; k < connectivity; k++)
+        {
+          const int *o = VoxelNeighborOffsets[k];
+          if(x + o[0] >= 0 && x + o[0] < nx && y + o[1] >= 0 && y + o[1] < ny &&
+             z + o[2] >= 0 && z + o[2] < nz)
+            edited[i + o[0] + nx * (o[1] + ny * o[2])] = 1;
+        }
+      }
     }
   }
+  return edited;
+}
 
-  cout << "   image has dimensions " << img->GetBufferedRegion().GetSize()
-       << ", nPixels = " << img->GetBufferedRegion().GetNumberOfPixels()
-       << ", nComp = " << comp_parts.size() << endl;
+/**
+ * Seed the partition of a component with the labels of the previous result.
+ * The previous labels of the component are numbered in increasing order,
+ * which recovers the zero-based parts of the previous run. Voxels that were
+ * added to the mask take the part of the nearest labeled voxel. The vertices
+ * within p.incremental_radius edges of an edit are flagged in movable, and
+ * only they are refined afterwards. Returns false if the previous labels do
+ * not fit the component, which then needs to be partitioned from scratch.
+ */
+bool SeedFromPrevious(const ImageGraphCutParameters &p,
+                      ComponentGraph *graph,
+                      const short *prev,
+                      const unsigned char *edited,
+                      unsigned int n_parts,
+                      std::vector<idxtype> &partition,
+                      std::vector<unsigned char> &movable,
+                      std::ostream &out)
+{
+  const size_t nVertices = graph->GetNumberOfVertices();
+  const ComponentGraph::VertexRun *runs = graph->GetVertexRuns();
+  const idxtype *xadj = graph->GetAdjacencyIndex(), *adj = graph->GetAdjacency();
 
-  // Create output image
-  ImageType::Pointer imgOut = ImageType::New();
-  imgOut->SetRegions(img->GetBufferedRegion());
-  imgOut->CopyInformation(img);
-  imgOut->Allocate();
-  imgOut->FillBuffer(0);
+  // Number the previous labels found in the component
+  std::map<short, idxtype> local;
+  for(size_t r = 0; r < graph->GetNumberOfVertexRuns(); r++)
+    for(size_t v = runs[r].FirstVertex; v < runs[r+1].FirstVertex; v++)
+      if(short label = prev[runs[r].BufferOffset + v - runs[r].FirstVertex])
+        local[label] = 0;
+  if(local.size() != n_parts)
+  {
+    out << "      Previous result has " << local.size() << " parts here, repartitioning" << endl;
+    return false;
+  }
+  idxtype next_part = 0;
+  for(auto &it : local)
+    it.second = next_part++;
 
-  // Repeat for each component
-  unsigned int part_idx = 1;
-  for(auto comp : comp_parts)
+  // Assign the previous parts and flag the edited vertices
+  partition.assign(nVertices, -1);
+  movable.assign(nVertices, 0);
+  std::vector<size_t> front;
+  size_t n_edited = 0;
+  for(size_t r = 0; r < graph->GetNumberOfVertexRuns(); r++)
   {
-    typedef itk::BinaryThresholdImageFilter<ImageType, ImageType> ThreshFilter;
-    ThreshFilter::Pointer fltThresh = ThreshFilter::New();
-    fltThresh->SetLowerThreshold(comp.first);
-    fltThresh->SetUpperThreshold(comp.first);
-    fltThresh->SetInsideValue(1);
-    fltThresh->SetOutsideValue(0);
-    fltThresh->SetInput(comp_map_image);
-    fltThresh->Update();
+    for(size_t v = runs[r].FirstVertex; v < runs[r+1].FirstVertex; v++)
+    {
+      size_t offset = runs[r].BufferOffset + v - runs[r].FirstVertex;
+      if(prev[offset])
+        partition[v] = local[prev[offset]];
+      if(!prev[offset] || edited[offset])
+      {
+        movable[v] = 1;
+        front.push_back(v);
+        n_edited++;
+      }
+    }
+  }
 
-           // This is the image that we will partition now
-    ImageType::Pointer comp_image = fltThresh->GetOutput();
+  // Grow the parts into the added voxels, one layer of edges at a time
+  std::vector<size_t> grow, next;
+  for(size_t v = 0; v < nVertices; v++)
+  {
+    if(partition[v] < 0)
+      continue;
+    for(idxtype e = xadj[v]; e < xadj[v+1]; e++)
+      if(partition[adj[e]] < 0)
+        { grow.push_back(v); break; }
+  }
+  while(!grow.empty())
+  {
+    next.clear();
+    for(size_t v : grow)
+      for(idxtype e = xadj[v]; e < xadj[v+1]; e++)
+        if(partition[adj[e]] < 0)
+        {
+          partition[adj[e]] = partition[v];
+          next.push_back(adj[e]);
+        }
+    grow.swap(next);
+  }
+  if(std::find(partition.begin(), partition.end(), -1) != partition.end())
+  {
+    out << "      Added voxels are not connected to the previous result, repartitioning" << endl;
+    return false;
+  }
 
-           // Use the relative weights only if number of components matches
-    auto compWeights = (p.xWeights.size() == comp.second)
-                         ? p.xWeights
-                         : vnl_vector<float>(comp.second, 1.0/comp.second);
+  // Extend the region around the edits
+  for(int hop = 0; hop < p.incremental_radius && !front.empty(); hop++)
+  {
+    next.clear();
+    for(size_t v : front)
+      for(idxtype e = xadj[v]; e < xadj[v+1]; e++)
+        if(!movable[adj[e]])
+        {
+          movable[adj[e]] = 1;
+          next.push_back(adj[e]);
+        }
+    front.swap(next);
+  }
 
-    cout << "   Breaking component " << comp.first << " into " << comp.second << " parts. " << endl;
-    cout << "      Initial weights: " << compWeights << endl;
-    cout << "      Starting part is: " << part_idx << endl;
+  size_t n_movable = std::count(movable.begin(), movable.end(), 1);
+  out << "      Seeded from previous result: " << n_edited << " edited voxels, "
+      << n_movable << " of " << nVertices << " voxels refined" << endl;
+  return true;
+}
 
-    unsigned int max_part=1;
-    if(comp.second > 1)
-    {
-      // Create the weight functor
-      MyWeightFunctor fnWeight;
 
-      // Create the graph filter
-      typedef ImageToGraphFilter<ImageType,idxtype> GraphFilter;
-      GraphFilter::Pointer fltGraph = GraphFilter::New();
-      fltGraph->SetInput(comp_image);
-      fltGraph->SetWeightFunctor(&fnWeight);
-      fltGraph->Update();
+/**
+ * Partition the subgraph of a single connected component of an image of the
+ * given size. The zero-based part of every vertex is returned in partition,
+ * which stays empty if the component has a single part. Returns the largest
+ * part assigned, but at least 1, which is how part labels have always been
+ * spaced between components. If the previous result is given, with its
+ * edited voxels, only the region around the edits is refined. The graph
+ * size, cut and timings are recorded in the profile, if one is given.
+ */
+unsigned int PartitionComponent(const ImageGraphCutParameters &p,
+                                ComponentGraph *graph,
+                                short label,
+                                unsigned int n_parts,
+                                const short *prev,
+                                const unsigned char *edited,
+                                const size_t size[3],
+                                std::vector<idxtype> &iPartition,
+                                std::ostream &out,
+                                ImageGraphCutComponentProfile *profile = nullptr)
+{
+  auto t_start = std::chrono::steady_clock::now();
 
-      // If asked to optimize, compute the best set of weights
-      if(p.flagOptimize)
-      {
-        // Run the experimental optimization
-        compWeights = OptimizeMETISPartition(fltGraph, compWeights);
-        cout << "      Optimized weights: " << compWeights << endl;
-      }
+  // Use the relative weights only if number of components matches
+  auto compWeights = (p.xWeights.size() == n_parts)
+                       ? p.xWeights
+                       : vnl_vector<float>(n_parts, 1.0/n_parts);
 
-      // Run METIS once, using the specified weights
-      int *iPartition = new int[fltGraph->GetNumberOfVertices()];
-      int xCut = RunMETISPartition<ImageType>(
-        fltGraph, compWeights.size(), compWeights.data_block(), iPartition,
-        p.tolerance, p.nMetisIter, false);
-      cout << "      Cut value: " << xCut << endl;
+  out << "   Breaking component " << label << " into " << n_parts << " parts. " << endl;
+  out << "      Initial weights: " << compWeights << endl;
 
-      // Apply partition to output image
-      for(unsigned int iVertex = 0; iVertex < fltGraph->GetNumberOfVertices(); iVertex++)
-      {
-        GraphFilter::IndexType idx = fltGraph->GetVertexImageIndex(iVertex);
-        imgOut->SetPixel(idx, iPartition[iVertex] + part_idx);
-        max_part = std::max(max_part, (unsigned int ) iPartition[iVertex]);
-      }
+  unsigned int max_part = 1;
+  if(n_parts > 1)
+  {
+    std::vector<unsigned char> movable;
+    idxtype xCut;
+    if(prev && SeedFromPrevious(p, graph, prev, edited, n_parts, iPartition, movable, out))
+    {
+      // Refine the boundaries near the edits, leaving the rest unchanged
+      size_t nMoves = RefinePartitionBoundary(
+        *graph, iPartition.data(), n_parts, compWeights.data_block(),
+        p.tolerance, p.refine_passes, movable.data());
+      PartitionQuality qf = EvaluatePartition(*graph, iPartition.data(), n_parts, compWeights.data_block());
+      out << "      Incremental:  cut " << qf.EdgeCut << ", imbalance " << qf.Imbalance
+          << " after " << nMoves << " boundary moves" << endl;
+      xCut = (idxtype) qf.EdgeCut;
+    }
+    else if(p.coarsen_factor > 1)
+    {
+      // Partition the graph of k x k x k blocks and project it onto the voxels
+      ComponentGraph coarse;
+      std::vector<idxtype> fineToCoarse, coarsePartition;
+      CoarsenVoxelGraph(*graph, size, p.coarsen_factor, coarse, fineToCoarse);
+      out << "      Coarse graph: " << coarse.GetNumberOfVertices() << " blocks, "
+          << graph->GetNumberOfVertices() << " voxels" << endl;
+
+      PartitionGraph(p, &coarse, compWeights, coarsePartition, out, profile);
+      PartitionQuality qc = EvaluatePartition(coarse, coarsePartition.data(), n_parts, compWeights.data_block());
+      out << "      Coarse level: cut " << qc.EdgeCut << ", imbalance " << qc.Imbalance << endl;
 
-      // Delete the partition
-      delete [] iPartition;
+      iPartition.resize(graph->GetNumberOfVertices());
+      ProjectPartition(fineToCoarse, coarsePartition.data(), iPartition.data());
+      coarse.Clear();
+      PartitionQuality qp = EvaluatePartition(*graph, iPartition.data(), n_parts, compWeights.data_block());
+      out << "      Projected:    cut " << qp.EdgeCut << ", imbalance " << qp.Imbalance << endl;
+
+      // Refine the boundaries between the parts on the voxel graph
+      size_t nMoves = RefinePartitionBoundary(
+        *graph, iPartition.data(), n_parts, compWeights.data_block(), p.tolerance, p.refine_passes);
+      PartitionQuality qf = EvaluatePartition(*graph, iPartition.data(), n_parts, compWeights.data_block());
+      out << "      Fine level:   cut " << qf.EdgeCut << ", imbalance " << qf.Imbalance
+          << " after " << nMoves << " boundary moves" << endl;
+      xCut = (idxtype) qf.EdgeCut;
     }
     else
     {
-      typedef itk::ImageRegionIterator<ImageType> IterType;
-      IterType it_src(comp_image, comp_image->GetBufferedRegion());
-      IterType it_dst(imgOut, imgOut->GetBufferedRegion());
-      for(; !it_src.IsAtEnd(); ++it_src, ++it_dst)
-        if(it_src.Value() > 0)
-          it_dst.Set(part_idx);
+      xCut = PartitionGraph(p, graph, compWeights, iPartition, out, profile);
     }
+    out << "      Cut value: " << xCut << endl;
 
-    // Update the starting part
-    part_idx += max_part + 1;
-  }
+    for(idxtype part : iPartition)
+      max_part = std::max(max_part, (unsigned int) part);
 
-  // Write the image
-  cout << "writing output image" << endl;
+    if(profile)
+    {
+      profile->vertices = graph->GetNumberOfVertices();
+      profile->edges = graph->GetNumberOfEdges() / 2;
+      profile->runs = graph->GetNumberOfVertexRuns();
+      profile->graph_bytes = graph->GetMemorySize();
+      profile->edge_cut = xCut;
+    }
+  }
 
-  typedef ImageFileWriter<ImageType> WriterType;
-  WriterType::Pointer fltWriter = WriterType::New();
-  fltWriter->SetInput(imgOut);
-  fltWriter->SetFileName(p.fnOutput.c_str());
-  fltWriter->Update();
+  if(profile)
+    profile->partition_seconds = SecondsSince(t_start);
+  return max_part;
+}
 
-  // Done!
-  return 0;
+/** Write the partition of a component into its voxels, one run at a time */
+void ApplyPartition(ComponentGraph *graph, const idxtype *partition, short *outBuffer)
+{
+  const ComponentGraph::VertexRun *runs = graph->GetVertexRuns();
+  for(size_t iRun = 0; iRun < graph->GetNumberOfVertexRuns(); iRun++)
+  {
+    short *outPixel = outBuffer + runs[iRun].BufferOffset;
+    for(size_t iVertex = runs[iRun].FirstVertex; iVertex < runs[iRun+1].FirstVertex; iVertex++)
+      *outPixel++ = partition[iVertex];
+  }
 }
 
+/** Print the parameters of the partition */
+void PrintParameters(const ImageGraphCutParameters &p)
+{
+  cout << "will generate " << p.nParts << " partitions" << endl;
+  cout << "   using " << 8 * sizeof(idxtype) << "-bit graph indices" << endl;
+  float xWeightSum = 0.0f;
+  for(unsigned int iPart = 0;iPart < p.nParts;iPart++)
+  {
+    cout << "   part " << iPart << "\t weight " << p.xWeights[iPart] << endl;
+    xWeightSum += p.xWeights[iPart];
+  }
+  cout << "   total of weights : " << xWeightSum << endl;
+  if(p.iPlaneDim >= 0)
+  {
+    cout << "will insert cut plane at slice " << p.iPlaneSlice
+         << " in dimension " << p.iPlaneDim
+         << " with strength " << p.iPlaneStrength << endl;
+  }
+  if(p.connectivity != 6)
+    cout << "will link each voxel to " << p.connectivity << " neighbors" << endl;
+  cout << endl;
+}
+
+/**
+ * Decide which of the components 1 to p.max_comp are kept, given the number
+ * of voxels of each one, and into how many parts each one is broken. Labels
+ * without voxels, e.g., past the last component of the image or of a graph
+ * file, are never kept, even if p.min_comp_frac is zero.
+ */
+std::map<short, unsigned int> SelectComponents(const ImageGraphCutParameters &p,
+                                               const std::vector<size_t> &comp_histogram)
+{
+  size_t n_total = 0;
+  for(unsigned int i = 1; i < comp_histogram.size(); i++)
+    n_total += comp_histogram[i];
+
+  std::map<short, unsigned int> comp_parts;
+  for(unsigned int i = 1; i < comp_histogram.size(); i++)
+  {
+    if(comp_histogram[i] == 0)
+      continue;
+    double frac = comp_histogram[i] * 1.0 / n_total;
+    if(frac >= p.min_comp_frac)
+    {
+      int n_parts = std::max(1, (int)(0.5 + p.nParts * frac));
+      comp_parts[i] = n_parts;
+      std::cout << "Keeping component " << i << " fraction " << frac << " parts " << n_parts << endl;
+    }
+  }
+  return comp_parts;
+}
+
+/**
+ * Number the subgraphs of the components that have more than one part, or of
+ * all the components 1 to hist_size - 1 if all is set, in which case label i
+ * maps to subgraph i - 1. The result maps each component label to its
+ * subgraph, or to -1.
+ */
+std::vector<int> AssignComponentBlocks(const std::map<short, unsigned int> &comp_parts,
+                                       unsigned int hist_size, unsigned int &n_blocks,
+                                       bool all = false)
+{
+  std::vector<int> comp_block(hist_size, -1);
+  n_blocks = 0;
+  if(all)
+  {
+    for(unsigned int i = 1; i < hist_size; i++)
+      comp_block[i] = n_blocks++;
+    return comp_block;
+  }
+  for(auto comp : comp_parts)
+    if(comp.second > 1)
+      comp_block[comp.first] = n_blocks++;
+  return comp_block;
+}
+
+/**
+ * Assign the part labels in the order of the components, exactly as if the
+ * components were processed one after another. Returns the first part of
+ * every component label, or zero for the components that are not kept.
+ */
+std::vector<short> ComputePartOffsets(const std::map<short, unsigned int> &comp_parts,
+                                      const std::vector<ComponentTask> &tasks,
+                                      unsigned int hist_size)
+{
+  std::vector<short> part_offset(hist_size, 0);
+  unsigned int part_idx = 1;
+  for(auto comp : comp_parts)
+  {
+    auto it = std::find_if(tasks.begin(), tasks.end(),
+                           [&](const ComponentTask &t) { return t.label == comp.first; });
+    cout << "   Component " << comp.first << " starts at part " << part_idx << endl;
+    part_offset[comp.first] = part_idx;
+    part_idx += it->max_part + 1;
+  }
+  return part_offset;
+}
+
+/** Create a task for every kept component, with the subgraphs of comp_block */
+std::vector<ComponentTask> CreateComponentTasks(const std::map<short, unsigned int> &comp_parts,
+                                                const std::vector<int> &comp_block,
+                                                std::vector<ComponentGraph> &comp_graphs)
+{
+  std::vector<ComponentTask> tasks;
+  for(auto comp : comp_parts)
+  {
+    ComponentTask task;
+    task.label = comp.first;
+    task.n_parts = comp.second;
+    task.graph = comp.second > 1 ? &comp_graphs[comp_block[comp.first]] : nullptr;
+    task.memory = task.graph ? EstimateComponentMemory(*task.graph) : 0;
+    tasks.push_back(task);
+  }
+  return tasks;
+}
+
+/** Get the geometry of an image, as stored in graph files */
+ImageGraphGeometry GetImageGraphGeometry(const ImageType *img)
+{
+  ImageGraphGeometry geometry;
+  const ImageType::RegionType &region = img->GetLargestPossibleRegion();
+  for(unsigned int d = 0; d < 3; d++)
+  {
+    geometry.Size[d] = region.GetSize(d);
+    geometry.Spacing[d] = img->GetSpacing()[d];
+    geometry.Origin[d] = img->GetOrigin()[d];
+    for(unsigned int k = 0; k < 3; k++)
+      geometry.Direction[3 * d + k] = img->GetDirection()(d, k);
+  }
+  return geometry;
+}
+
+/**
+ * Collect the components 1 to hist_size - 1, with the graphs assigned by
+ * AssignComponentBlocks with all set, along with the number of voxels and
+ * the first voxel of each component. Trailing labels that the image does not
+ * have are left out.
+ */
+std::vector<ImageGraphComponent> MakeImageGraphComponents(const std::vector<size_t> &comp_histogram,
+                                                          const std::vector<size_t> &comp_first,
+                                                          std::vector<ComponentGraph> &comp_graphs)
+{
+  size_t n_comp = comp_histogram.size() - 1;
+  while(n_comp > 0 && comp_histogram[n_comp] == 0)
+    n_comp--;
+
+  std::vector<ImageGraphComponent> components(n_comp);
+  for(size_t i = 1; i <= n_comp; i++)
+  {
+    components[i-1].Voxels = comp_histogram[i];
+    components[i-1].FirstVoxel = comp_first[i];
+    components[i-1].Graph = comp_graphs[i-1];
+  }
+  return components;
+}
+
+/** Save the components collected by MakeImageGraphComponents to a graph file */
+void SaveComponentGraphs(const std::string &filename, const ImageGraphGeometry &geometry,
+                         const std::vector<size_t> &comp_histogram,
+                         const std::vector<size_t> &comp_first,
+                         std::vector<ComponentGraph> &comp_graphs)
+{
+  std::vector<ImageGraphComponent> components =
+    MakeImageGraphComponents(comp_histogram, comp_first, comp_graphs);
+  cout << "saving graphs of " << components.size() << " components to " << filename << endl;
+  WriteImageGraphFile(filename, geometry, components);
+}
+
+/**
+ * Label the 18-connected components of the nonzero pixels of an image in the
+ * order of their first voxel, see LabelVoxelComponents18()
+ */
+ImageType::Pointer LabelComponents18(ImageType *img)
+{
+  const ImageType::RegionType &region = img->GetBufferedRegion();
+  const size_t size[3] = { region.GetSize(0), region.GetSize(1), region.GetSize(2) };
+
+  ImageType::Pointer labels = ImageType::New();
+  labels->CopyInformation(img);
+  labels->SetRegions(region);
+  labels->Allocate();
+  LabelVoxelComponents18(img->GetBufferPointer(), size, labels->GetBufferPointer());
+  return labels;
+}
+
+/**
+ * Label the connected components of an image, with 6, 18 or 26 neighbors,
+ * by decreasing size, and count the voxels of the components 1 to
+ * hist_size - 1, along with the offset of the first voxel of each one.
+ * Returns the image of component labels.
+ */
+ImageType::Pointer FindComponents(ImageType *img, unsigned int connectivity,
+                                  unsigned int hist_size,
+                                  std::vector<size_t> &comp_histogram,
+                                  std::vector<size_t> &comp_first,
+                                  ImageGraphCutProfile *profile = nullptr)
+{
+  CheckVoxelConnectivity(connectivity);
+  ProfileStage stage_conn(profile, "connected components");
+  ImageType::Pointer comp_raw;
+  if(connectivity == 18)
+  {
+    comp_raw = LabelComponents18(img);
+  }
+  else
+  {
+    typedef itk::ConnectedComponentImageFilter<ImageType, ImageType> ConnFilter;
+    ConnFilter::Pointer conn_filter = ConnFilter::New();
+    conn_filter->SetInput(img);
+    conn_filter->SetFullyConnected(connectivity == 26);
+    conn_filter->Update();
+    comp_raw = conn_filter->GetOutput();
+  }
+  stage_conn.Stop();
+
+  ProfileStage stage_relabel(profile, "relabel");
+  typedef itk::RelabelComponentImageFilter<ImageType, ImageType> RelabelFilter;
+  RelabelFilter::Pointer relabel_filter = RelabelFilter::New();
+  relabel_filter->SetInput(comp_raw);
+  relabel_filter->Update();
+  ImageType::Pointer comp_map_image = relabel_filter->GetOutput();
+
+  comp_histogram.assign(hist_size, 0);
+  comp_first.assign(hist_size, 0);
+  const short *comp_voxel = comp_map_image->GetBufferPointer();
+  for(size_t i = 0; i < comp_map_image->GetBufferedRegion().GetNumberOfPixels(); i++)
+  {
+    short val = comp_voxel[i];
+    if(val > 0 && (unsigned int) val < hist_size && comp_histogram[val]++ == 0)
+      comp_first[val] = i;
+  }
+  return comp_map_image;
+}
+
+/**
+ * Partition an image held in memory and write the part labels into imgOut,
+ * which must have the same buffered region as img. This is the pipeline that
+ * all the front ends share, and it does no file I/O. If imgPrev holds the
+ * result of an earlier run on a slightly different mask, the components are
+ * repartitioned incrementally from it. The stages are recorded in the
+ * profile, if one is given.
+ */
+void PartitionImage(const ImageGraphCutParameters &p, ImageType *img, ImageType *imgOut,
+                    ImageType *imgPrev = nullptr, EdgeImageType *imgEdge = nullptr,
+                    ImageGraphCutProfile *profile = nullptr)
+{
+  if(p.fnEdgeImage.size() && !imgEdge)
+    throw std::invalid_argument("Edge weight images are only supported with image files");
+
+  // Set random seed
+  if(p.use_random_seed)
+    srand(p.random_seed);
+
+  // Write partition information
+  PrintParameters(p);
+
+  // Compile the weights of the hint file, if any
+  MyWeightFunctor fnWeight;
+  ProfileStage stage_hint(p.fnHint.size() ? profile : nullptr, "compile hints");
+  InitializeWeights(p, img, fnWeight);
+  ImageType::Pointer vertex_mask = GetVertexMask(img, fnWeight);
+  stage_hint.Stop();
+
+  // Tabulate the weights of the intensity differences in the companion image
+  EdgeWeightModifiers edges;
+  edges.plane = GetCutPlane(p);
+  if(imgEdge)
+    InitializeEdgeWeights(p, imgEdge, vertex_mask, edges);
+  CheckEdgeWeightRange(fnWeight, edges, p.connectivity);
+
+         // Extract connected components and their size
+  unsigned int hist_size = p.max_comp + 1;
+  std::vector<size_t> comp_histogram, comp_first;
+  ImageType::Pointer comp_map_image =
+    FindComponents(vertex_mask, p.connectivity, hist_size, comp_histogram, comp_first, profile);
+  vertex_mask = nullptr;
+
+         // Compute the total number of pixels and proportion of each component
+  ProfileStage stage_select(profile, "select components");
+  std::map<short, unsigned int> comp_parts = SelectComponents(p, comp_histogram);
+  stage_select.Stop();
+
+  cout << "   image has dimensions " << img->GetBufferedRegion().GetSize()
+       << ", nPixels = " << img->GetBufferedRegion().GetNumberOfPixels()
+       << ", nComp = " << comp_parts.size() << endl;
+
+  // Clear the output image
+  imgOut->FillBuffer(0);
+
+  // Find the edits since the previous result
+  std::vector<unsigned char> edited;
+  const short *prev = nullptr;
+  if(imgPrev)
+  {
+    ProfileStage stage_edits(profile, "find edits");
+    if(imgPrev->GetBufferedRegion().GetSize() != img->GetBufferedRegion().GetSize())
+      throw std::invalid_argument("Previous label image does not match the input image size");
+    edited = FindEditedVoxels(comp_map_image, imgPrev, p.connectivity);
+    prev = imgPrev->GetBufferPointer();
+  }
+
+  // Build the graph once and split it into the subgraphs of the components
+  // that have more than one part, or of all components if they are saved
+  unsigned int n_blocks;
+  std::vector<int> comp_block =
+    AssignComponentBlocks(comp_parts, hist_size, n_blocks, p.fnSaveGraph.size() > 0);
+
+  cout << "building graph" << endl;
+  ProfileStage stage_build(profile, "build graph");
+  std::vector<ComponentGraph> comp_graphs(n_blocks);
+  BuildComponentGraphs(img, comp_map_image, comp_block, comp_graphs, &fnWeight,
+                       p.connectivity, &edges);
+  stage_build.Stop();
+
+  if(p.fnSaveGraph.size())
+  {
+    ProfileStage stage_save(profile, "save graph");
+    SaveComponentGraphs(p.fnSaveGraph, GetImageGraphGeometry(img),
+                        comp_histogram, comp_first, comp_graphs);
+  }
+
+  // Schedule the components, largest first
+  std::vector<ComponentTask> tasks = CreateComponentTasks(comp_parts, comp_block, comp_graphs);
+
+  // Partition the components concurrently. Each one writes its zero-based
+  // partition labels into its own voxels of the output image. The part 
+  // numbering below does not depend on the order in which components finish,
+  // although METIS builds whose random generator is shared between threads
+  // may return different partitions than a serial run.
+  const ImageType::SizeType &img_size = img->GetBufferedRegion().GetSize();
+  const size_t size[3] = { img_size[0], img_size[1], img_size[2] };
+  std::mutex mutex_log;
+  std::vector<ImageGraphCutComponentProfile> comp_profiles(profile ? tasks.size() : 0);
+  ProfileStage stage_partition(profile, "partition");
+  RunTasks<ComponentTask>(tasks, p.n_threads, p.mem_budget_gb * (1ul << 30), [&](ComponentTask &task) {
+    ImageGraphCutComponentProfile *comp_profile = profile ? &comp_profiles[&task - tasks.data()] : nullptr;
+    std::ostringstream log;
+    std::vector<idxtype> partition;
+    task.max_part = PartitionComponent(
+      p, task.graph, task.label, task.n_parts, prev, edited.data(), size, partition, log, comp_profile);
+    if(task.graph)
+    {
+      auto t_write = std::chrono::steady_clock::now();
+      ApplyPartition(task.graph, partition.data(), imgOut->GetBufferPointer());
+      task.graph->Clear();
+      if(comp_profile)
+        comp_profile->write_seconds = SecondsSince(t_write);
+    }
+    std::lock_guard<std::mutex> guard(mutex_log);
+    cout << log.str() << flush;
+  });
+  stage_partition.Stop();
+
+  for(size_t i = 0; i < comp_profiles.size(); i++)
+  {
+    comp_profiles[i].label = tasks[i].label;
+    comp_profiles[i].n_parts = tasks[i].n_parts;
+    comp_profiles[i].voxels = comp_histogram[tasks[i].label];
+    profile->components.push_back(comp_profiles[i]);
+  }
+
+  // Shift the labels of each component by its first part
+  ProfileStage stage_labels(profile, "label write-back");
+  std::vector<short> part_offset = ComputePartOffsets(comp_parts, tasks, hist_size);
+  const short *comp_buffer = comp_map_image->GetBufferPointer();
+  short *out_buffer = imgOut->GetBufferPointer();
+  for(size_t i = 0; i < img->GetBufferedRegion().GetNumberOfPixels(); i++)
+  {
+    short comp = comp_buffer[i];
+    if(comp > 0 && (unsigned int) comp < hist_size && part_offset[comp] > 0)
+      out_buffer[i] += part_offset[comp];
+  }
+}
+
+/* ***************************************************************************
+ * STREAMING PIPELINE
+ * *************************************************************************** */
+
+typedef StreamingGraphBuilder<ImageType, idxtype, idxtype, MyWeightFunctor> StreamingBuilder;
+
+/**
+ * An image source whose output is computed by a callback for whatever
+ * region is requested downstream, enlarged to whole slices. Connected to a
+ * writer with several stream divisions, it generates the output one slab at
+ * a time, unless the ImageIO of the file cannot write in pieces.
+ */
+class SlabImageSource : public ImageSource<ImageType>
+{
+public:
+  typedef SlabImageSource Self;
+  typedef ImageSource<ImageType> Superclass;
+  typedef SmartPointer<Self> Pointer;
+  typedef std::function<void(const ImageType::RegionType &, short *)> GeneratorType;
+
+  itkTypeMacro(SlabImageSource, ImageSource);
+
+  itkNewMacro(Self);
+
+  /** Set the image whose size, origin, spacing and direction the output has */
+  void SetReferenceImage(const ImageType *image) { m_ReferenceImage = image; this->Modified(); }
+
+  /** Set the callback that fills a region of the output */
+  void SetGenerator(GeneratorType generator) { m_Generator = generator; this->Modified(); }
+
+protected:
+  void GenerateOutputInformation() override
+  {
+    this->GetOutput()->CopyInformation(m_ReferenceImage);
+  }
+
+  void EnlargeOutputRequestedRegion(DataObject *data) override
+  {
+    ImageType *output = static_cast<ImageType *>(data);
+    ImageType::RegionType region = output->GetRequestedRegion();
+    const ImageType::RegionType &largest = output->GetLargestPossibleRegion();
+    for(unsigned int d = 0; d < 2; d++)
+    {
+      region.SetIndex(d, largest.GetIndex(d));
+      region.SetSize(d, largest.GetSize(d));
+    }
+    output->SetRequestedRegion(region);
+  }
+
+  void GenerateData() override
+  {
+    ImageType *output = this->GetOutput();
+    output->SetBufferedRegion(output->GetRequestedRegion());
+    output->Allocate();
+    m_Generator(output->GetBufferedRegion(), output->GetBufferPointer());
+  }
+
+  const ImageType *m_ReferenceImage = nullptr;
+  GeneratorType m_Generator;
+};
+
+/**
+ * Partition an image file without holding the image in memory. The image is
+ * read in slabs of p.stream_slab slices, the graphs of the components are 
+ * kept in a memory-mapped scratch file, and the part labels are computed and
+ * written one slab at a time. The labels are the same as with PartitionImage.
+ */
+void PartitionImageFileStreaming(const ImageGraphCutParameters &p)
+{
+  // Set random seed
+  if(p.use_random_seed)
+    srand(p.random_seed);
+
+  // Write partition information
+  PrintParameters(p);
+
+  MyWeightFunctor fnWeight;
+  EdgeWeightModifiers edges;
+  edges.plane = GetCutPlane(p);
+  CheckEdgeWeightRange(fnWeight, edges, p.connectivity);
+
+  StreamingBuilder builder;
+  builder.SetFileName(p.fnInput);
+  builder.SetSlabThickness(p.stream_slab);
+  builder.SetWeightFunctor(&fnWeight);
+  builder.SetCutPlane(edges.plane);
+  builder.SetConnectivity(p.connectivity);
+  builder.SetScratchFileName(p.fnScratch.size() ? p.fnScratch : p.fnOutput + ".scratch");
+  builder.UpdateOutputInformation();
+
+  // Label the connected components, as in PartitionImage
+  cout << "finding connected components in slabs of "
+       << builder.GetSlabThickness() << " slices" << endl;
+  builder.FindComponents();
+
+  unsigned int hist_size = p.max_comp + 1;
+  std::vector<size_t> comp_histogram(hist_size, 0), comp_first(hist_size, 0);
+  for(unsigned int i = 1; i < hist_size && i <= builder.GetNumberOfComponents(); i++)
+  {
+    comp_histogram[i] = builder.GetComponent(i).Voxels;
+    comp_first[i] = builder.GetComponent(i).FirstVoxel;
+  }
+  std::map<short, unsigned int> comp_parts = SelectComponents(p, comp_histogram);
+
+  const ImageType::RegionType &region = builder.GetRegion();
+  cout << "   image has dimensions " << region.GetSize()
+       << ", nPixels = " << region.GetNumberOfPixels()
+       << ", nComp = " << comp_parts.size() << endl;
+
+  // Build the subgraphs of the components in the scratch file, which also
+  // holds their partitions. Components with a single part, or that are not
+  // kept, only get subgraphs when they are saved, and their partitions stay
+  // zero.
+  unsigned int n_blocks;
+  std::vector<int> comp_block =
+    AssignComponentBlocks(comp_parts, hist_size, n_blocks, p.fnSaveGraph.size() > 0);
+
+  cout << "building graph" << endl;
+  std::vector<ComponentGraph> comp_graphs(n_blocks);
+  std::vector<idxtype *> comp_partitions;
+  builder.BuildComponentGraphs(comp_block, comp_graphs, comp_partitions);
+
+  if(p.fnSaveGraph.size())
+  {
+    ImageGraphGeometry geometry = GetImageGraphGeometry(builder.GetInformation());
+    SaveComponentGraphs(p.fnSaveGraph, geometry, comp_histogram, comp_first, comp_graphs);
+  }
+
+  // Partition the components. The graphs are kept, since their runs place
+  // the partitions in the output.
+  std::vector<ComponentTask> tasks = CreateComponentTasks(comp_parts, comp_block, comp_graphs);
+  const size_t size[3] = { region.GetSize(0), region.GetSize(1), region.GetSize(2) };
+  std::mutex mutex_log;
+  RunTasks<ComponentTask>(tasks, p.n_threads, p.mem_budget_gb * (1ul << 30), [&](ComponentTask &task) {
+    std::ostringstream log;
+    std::vector<idxtype> partition;
+    task.max_part = PartitionComponent(
+      p, task.graph, task.label, task.n_parts, nullptr, nullptr, size, partition, log);
+    if(task.graph)
+      std::copy(partition.begin(), partition.end(), comp_partitions[comp_block[task.label]]);
+    std::lock_guard<std::mutex> guard(mutex_log);
+    cout << log.str() << flush;
+  });
+
+  std::vector<short> part_offset = ComputePartOffsets(comp_parts, tasks, hist_size);
+
+  // Label the slabs requested by the writer
+  const size_t slice_size = size[0] * size[1];
+  std::vector<size_t> comp;
+  SlabImageSource::Pointer source = SlabImageSource::New();
+  source->SetReferenceImage(builder.GetInformation());
+  source->SetGenerator([&](const ImageType::RegionType &r, short *out_buffer) {
+    long z0 = r.GetIndex(2) - region.GetIndex(2), z1 = z0 + (long) r.GetSize(2);
+    size_t first = z0 * slice_size, last = z1 * slice_size;
+    comp.resize(last - first);
+    builder.GetComponentSlab(z0, z1, comp.data());
+    std::fill(out_buffer, out_buffer + comp.size(), 0);
+
+    // Write the partitions of the runs that start in the slab
+    for(size_t b = 0; b < n_blocks; b++)
+    {
+      const VoxelRun *runs = comp_graphs[b].GetVertexRuns();
+      const VoxelRun *runs_end = runs + comp_graphs[b].GetNumberOfVertexRuns();
+      const VoxelRun *it = std::lower_bound(runs, runs_end, first,
+        [](const VoxelRun &run, size_t offset) { return run.BufferOffset < offset; });
+      for(; it < runs_end && it->BufferOffset < last; ++it)
+      {
+        short *out_pixel = out_buffer + (it->BufferOffset - first);
+        for(size_t v = it->FirstVertex; v < (it+1)->FirstVertex; v++)
+          *out_pixel++ = comp_partitions[b][v];
+      }
+    }
+
+    // Shift the labels of each component by its first part
+    for(size_t i = 0; i < comp.size(); i++)
+      if(comp[i] > 0 && comp[i] < hist_size && part_offset[comp[i]] > 0)
+        out_buffer[i] += part_offset[comp[i]];
+  });
+
+  cout << "writing output image" << endl;
+
+  typedef ImageFileWriter<ImageType> WriterType;
+  WriterType::Pointer fltWriter = WriterType::New();
+  fltWriter->SetInput(source->GetOutput());
+  fltWriter->SetFileName(p.fnOutput.c_str());
+  fltWriter->SetNumberOfStreamDivisions(
+    (size[2] + builder.GetSlabThickness() - 1) / builder.GetSlabThickness());
+  fltWriter->Update();
+}
+
+/* ***************************************************************************
+ * GRAPH FILES
+ * *************************************************************************** */
+
+/** Create an image with the geometry stored in a graph file */
+ImageType::Pointer CreateImage(const ImageGraphGeometry &geometry)
+{
+  ImageType::Pointer image = ImageType::New();
+  ImageType::RegionType region;
+  ImageType::SpacingType spacing;
+  ImageType::PointType origin;
+  ImageType::DirectionType direction;
+  for(unsigned int d = 0; d < 3; d++)
+  {
+    region.SetSize(d, geometry.Size[d]);
+    spacing[d] = geometry.Spacing[d];
+    origin[d] = geometry.Origin[d];
+    for(unsigned int k = 0; k < 3; k++)
+      direction(d, k) = geometry.Direction[3 * d + k];
+  }
+  image->SetRegions(region);
+  image->SetSpacing(spacing);
+  image->SetOrigin(origin);
+  image->SetDirection(direction);
+  image->Allocate();
+  return image;
+}
+
+/** Write an image to a file */
+template <class TImage>
+void WriteImageFile(TImage *image, const std::string &filename)
+{
+  typedef ImageFileWriter<TImage> WriterType;
+  typename WriterType::Pointer fltWriter = WriterType::New();
+  fltWriter->SetInput(image);
+  fltWriter->SetFileName(filename.c_str());
+  fltWriter->Update();
+}
+
+/**
+ * Get the components 1 to p.max_comp of the input, with the graphs of all of
+ * them: from a graph file, or by building them from the input image, in which
+ * case they are also saved if p.fnSaveGraph is set.
+ */
+void LoadComponentGraphs(const ImageGraphCutParameters &p, ImageGraphGeometry &geometry,
+                         std::vector<ImageGraphComponent> &components)
+{
+  if(IsImageGraphFile(p.fnInput))
+  {
+    if(p.fnHint.size() || p.fnEdgeImage.size() || p.iPlaneDim >= 0 || p.connectivity != 6)
+      throw std::invalid_argument("The edges and weights of a graph file cannot be changed");
+    cout << "mapping graph file" << endl;
+    ReadImageGraphFile(p.fnInput, geometry, components);
+    if(components.size() < (size_t) p.max_comp)
+      cout << "   graph file holds only " << components.size() << " components" << endl;
+    return;
+  }
+
+  cout << "reading input image" << endl;
+  ReaderType::Pointer fltReader = ReaderType::New();
+  fltReader->SetFileName(p.fnInput.c_str());
+  fltReader->Update();
+  ImageType::Pointer img = fltReader->GetOutput();
+  geometry = GetImageGraphGeometry(img);
+
+  MyWeightFunctor fnWeight;
+  InitializeWeights(p, img, fnWeight);
+  ImageType::Pointer vertex_mask = GetVertexMask(img, fnWeight);
+
+  EdgeWeightModifiers edges;
+  edges.plane = GetCutPlane(p);
+  if(p.fnEdgeImage.size())
+    InitializeEdgeWeights(p, ReadEdgeImage(p, img), vertex_mask, edges);
+  CheckEdgeWeightRange(fnWeight, edges, p.connectivity);
+
+  unsigned int hist_size = p.max_comp + 1;
+  std::vector<size_t> comp_histogram, comp_first;
+  ImageType::Pointer comp_map_image =
+    FindComponents(vertex_mask, p.connectivity, hist_size, comp_histogram, comp_first);
+  vertex_mask = nullptr;
+
+  cout << "building graph" << endl;
+  unsigned int n_blocks;
+  std::vector<int> comp_block =
+    AssignComponentBlocks(std::map<short, unsigned int>(), hist_size, n_blocks, true);
+  std::vector<ComponentGraph> comp_graphs(n_blocks);
+  BuildComponentGraphs(img, comp_map_image, comp_block, comp_graphs, &fnWeight,
+                       p.connectivity, &edges);
+  components = MakeImageGraphComponents(comp_histogram, comp_first, comp_graphs);
+
+  if(p.fnSaveGraph.size())
+  {
+    cout << "saving graphs of " << components.size() << " components to " << p.fnSaveGraph << endl;
+    WriteImageGraphFile(p.fnSaveGraph, geometry, components);
+  }
+}
+
+/**
+ * Shift the zero-based part labels of the kept components by their first
+ * part. The voxels of a component are the vertices of its graph, and a
+ * component without a graph is a single voxel. Labels past the end of the
+ * component list have no voxels and are skipped.
+ */
+void ShiftComponentLabels(const std::map<short, unsigned int> &comp_parts,
+                          const std::vector<short> &part_offset,
+                          std::vector<ImageGraphComponent> &components, short *out_buffer)
+{
+  for(auto comp : comp_parts)
+  {
+    if(comp.first < 1 || (size_t) comp.first > components.size())
+      continue;
+    ComponentGraph &graph = components[comp.first - 1].Graph;
+    short offset = part_offset[comp.first];
+    if(graph.GetNumberOfVertices() == 0)
+    {
+      out_buffer[components[comp.first - 1].FirstVoxel] = offset;
+      continue;
+    }
+
+    const VoxelRun *runs = graph.GetVertexRuns();
+    for(size_t iRun = 0; iRun < graph.GetNumberOfVertexRuns(); iRun++)
+    {
+      short *outPixel = out_buffer + runs[iRun].BufferOffset;
+      for(size_t iVertex = runs[iRun].FirstVertex; iVertex < runs[iRun+1].FirstVertex; iVertex++)
+        *outPixel++ += offset;
+    }
+  }
+}
+
+/** A component to be partitioned for one of several part counts */
+struct CountTask : public ComponentTask
+{
+  CountTask(const ComponentTask &task, size_t k) : ComponentTask(task), count(k) {}
+
+  size_t count;
+  std::vector<idxtype> partition;
+  PartitionQuality quality = { 0.0, 1.0 };
+};
+
+/**
+ * Partition the components for each of the given part counts, reusing their
+ * graphs. The components are selected for each count as in PartitionImage,
+ * and the components of all the counts are partitioned concurrently, largest
+ * first. The labels of each count are then passed to output, in an image that
+ * is reused for the next count. Returns the edge cut and the imbalance of
+ * each count, summed and maximized over its components.
+ */
+std::vector<ImageGraphCutSweepResult> PartitionComponentsForCounts(
+  const ImageGraphCutParameters &p, const std::vector<int> &counts,
+  const ImageGraphGeometry &geometry, std::vector<ImageGraphComponent> &components,
+  std::function<void(size_t, ImageType *)> output)
+{
+  // Only the labels of the components that exist are considered, since a
+  // graph file or a sparse image may hold fewer than p.max_comp of them
+  unsigned int hist_size = std::min<size_t>(p.max_comp, components.size()) + 1;
+  std::vector<size_t> comp_histogram(hist_size, 0);
+  for(unsigned int i = 1; i < hist_size; i++)
+    comp_histogram[i] = components[i-1].Voxels;
+
+  // The graph of component i is stored at index i - 1
+  unsigned int n_blocks;
+  std::vector<int> comp_block =
+    AssignComponentBlocks(std::map<short, unsigned int>(), hist_size, n_blocks, true);
+  std::vector<ComponentGraph> comp_graphs(n_blocks);
+  for(unsigned int b = 0; b < n_blocks; b++)
+    comp_graphs[b] = components[b].Graph;
+
+  // Select the components for each count. The weights only apply to the
+  // counts that they were given for.
+  std::vector<ImageGraphCutParameters> count_params(counts.size(), p);
+  std::vector<std::map<short, unsigned int>> count_comp_parts(counts.size());
+  std::vector<CountTask> tasks;
+  for(size_t k = 0; k < counts.size(); k++)
+  {
+    ImageGraphCutParameters &pk = count_params[k];
+    pk.nParts = counts[k];
+    if(pk.xWeights.size() != (size_t) pk.nParts)
+    {
+      pk.xWeights.set_size(pk.nParts);
+      pk.xWeights.fill(1.0 / pk.nParts);
+    }
+    if(counts.size() > 1)
+      cout << "part count " << pk.nParts << endl;
+    count_comp_parts[k] = SelectComponents(pk, comp_histogram);
+    for(const ComponentTask &task : CreateComponentTasks(count_comp_parts[k], comp_block, comp_graphs))
+      tasks.push_back(CountTask(task, k));
+  }
+
+  cout << "   image has dimensions " << geometry.Size[0] << " x " << geometry.Size[1]
+       << " x " << geometry.Size[2] << ", nComp = " << components.size() << endl;
+
+  const size_t size[3] = { geometry.Size[0], geometry.Size[1], geometry.Size[2] };
+  std::mutex mutex_log;
+  RunTasks<CountTask>(tasks, p.n_threads, p.mem_budget_gb * (1ul << 30), [&](CountTask &task) {
+    const ImageGraphCutParameters &pk = count_params[task.count];
+    std::ostringstream log;
+    task.max_part = PartitionComponent(
+      pk, task.graph, task.label, task.n_parts, nullptr, nullptr, size, task.partition, log);
+    if(task.graph)
+    {
+      Vec target = (pk.xWeights.size() == task.n_parts) ? pk.xWeights : Vec(task.n_parts, 1.0 / task.n_parts);
+      task.quality = EvaluatePartition(*task.graph, task.partition.data(), task.n_parts, target.data_block());
+    }
+    std::lock_guard<std::mutex> guard(mutex_log);
+    cout << log.str() << flush;
+  });
+
+  // Label the voxels for each count
+  ImageType::Pointer imgOut = CreateImage(geometry);
+  std::vector<ImageGraphCutSweepResult> results(counts.size());
+  for(size_t k = 0; k < counts.size(); k++)
+  {
+    ImageGraphCutSweepResult &result = results[k];
+    result.n_parts = counts[k];
+    imgOut->FillBuffer(0);
+    std::vector<ComponentTask> count_tasks;
+    for(CountTask &task : tasks)
+    {
+      if(task.count != k)
+        continue;
+      if(task.graph)
+      {
+        ApplyPartition(task.graph, task.partition.data(), imgOut->GetBufferPointer());
+        result.edge_cut += task.quality.EdgeCut;
+        result.imbalance = std::max(result.imbalance, task.quality.Imbalance);
+      }
+      std::vector<idxtype>().swap(task.partition);
+      count_tasks.push_back(task);
+    }
+
+    std::vector<short> part_offset = ComputePartOffsets(count_comp_parts[k], count_tasks, hist_size);
+    ShiftComponentLabels(count_comp_parts[k], part_offset, components, imgOut->GetBufferPointer());
+    output(k, imgOut);
+  }
+
+  return results;
+}
+
+/**
+ * Partition the components stored in a graph file, which image_graph_cut
+ * saves with p.fnSaveGraph, and write the part labels to p.fnOutput. The
+ * graphs are used in place from the mapped file, so no image is read and no
+ * graph is built or copied. The labels are the same as those of the run that
+ * saved the file, provided that p.max_comp does not exceed the number of
+ * components saved and the weights gave every voxel of the kept components a
+ * vertex.
+ */
+void PartitionGraphFile(const ImageGraphCutParameters &p)
+{
+  // Set random seed
+  if(p.use_random_seed)
+    srand(p.random_seed);
+
+  // Write partition information
+  PrintParameters(p);
+
+  ImageGraphGeometry geometry;
+  std::vector<ImageGraphComponent> components;
+  LoadComponentGraphs(p, geometry, components);
+  PartitionComponentsForCounts(p, std::vector<int>(1, p.nParts), geometry, components,
+                               [&](size_t, ImageType *labels) {
+    cout << "writing output image" << endl;
+    WriteImageFile(labels, p.fnOutput);
+  });
+}
+
+/* ***************************************************************************
+ * PART COUNT SWEEPS
+ * *************************************************************************** */
+
+/** Insert the part count before the extension of a file name, e.g., parts_100.nii.gz */
+std::string SweepFileName(const std::string &filename, int n_parts)
+{
+  size_t slash = filename.find_last_of("/\\");
+  size_t dot = filename.find('.', slash == std::string::npos ? 1 : slash + 2);
+  if(dot == std::string::npos)
+    dot = filename.size();
+  return filename.substr(0, dot) + "_" + std::to_string(n_parts) + filename.substr(dot);
+}
+
+std::vector<ImageGraphCutSweepResult> image_graph_cut_sweep(const ImageGraphCutParameters &p)
+{
+  if(p.sweep_parts.empty())
+    throw std::invalid_argument("No part counts to sweep");
+  if(p.fnPrevious.size())
+    throw std::invalid_argument("Incremental repartitioning is not supported in part count sweeps");
+  if(p.stream_slab > 0)
+    throw std::invalid_argument("Part count sweeps are not supported when streaming");
+  CheckPartWeights(p);
+
+  // Set random seed
+  if(p.use_random_seed)
+    srand(p.random_seed);
+
+  cout << "will sweep " << p.sweep_parts.size() << " part counts" << endl;
+  cout << "   using " << 8 * sizeof(idxtype) << "-bit graph indices" << endl << endl;
+
+  // Build the graphs once
+  ImageGraphGeometry geometry;
+  std::vector<ImageGraphComponent> components;
+  LoadComponentGraphs(p, geometry, components);
+
+  // The stack holds one volume per count
+  typedef itk::Image<short, 4> StackType;
+  StackType::Pointer stack;
+  if(p.sweep_stack)
+  {
+    stack = StackType::New();
+    StackType::RegionType region;
+    StackType::SpacingType spacing;
+    StackType::PointType origin;
+    StackType::DirectionType direction;
+    direction.SetIdentity();
+    for(unsigned int d = 0; d < 3; d++)
+    {
+      region.SetSize(d, geometry.Size[d]);
+      spacing[d] = geometry.Spacing[d];
+      origin[d] = geometry.Origin[d];
+      for(unsigned int k = 0; k < 3; k++)
+        direction(d, k) = geometry.Direction[3 * d + k];
+    }
+    region.SetSize(3, p.sweep_parts.size());
+    spacing[3] = 1.0;
+    origin[3] = 0.0;
+    stack->SetRegions(region);
+    stack->SetSpacing(spacing);
+    stack->SetOrigin(origin);
+    stack->SetDirection(direction);
+    stack->Allocate();
+  }
+
+  std::vector<std::string> filenames(p.sweep_parts.size(), p.fnOutput);
+  std::vector<ImageGraphCutSweepResult> results = PartitionComponentsForCounts(
+    p, p.sweep_parts, geometry, components, [&](size_t k, ImageType *labels) {
+      size_t n_pixels = labels->GetBufferedRegion().GetNumberOfPixels();
+      if(stack)
+      {
+        std::copy(labels->GetBufferPointer(), labels->GetBufferPointer() + n_pixels,
+                  stack->GetBufferPointer() + k * n_pixels);
+        return;
+      }
+      filenames[k] = SweepFileName(p.fnOutput, p.sweep_parts[k]);
+      cout << "writing output image " << filenames[k] << endl;
+      WriteImageFile(labels, filenames[k]);
+    });
+
+  if(stack)
+  {
+    cout << "writing output stack" << endl;
+    WriteImageFile(stack.GetPointer(), p.fnOutput);
+  }
+
+  cout << endl << "parts\tedge cut\timbalance\toutput" << endl;
+  for(size_t k = 0; k < results.size(); k++)
+  {
+    results[k].fn_output = filenames[k];
+    cout << results[k].n_parts << "\t" << results[k].edge_cut << "\t"
+         << results[k].imbalance << "\t" << filenames[k] << endl;
+  }
+  return results;
+}
+
+/* ***************************************************************************
+ * PARTITION TREES
+ * *************************************************************************** */
+
+/** A node of a partition tree, with the subgraph of its vertices */
+struct TreeNode
+{
+  long parent;
+  unsigned int level;
+  short component;
+  size_t first_label, n_labels;
+  size_t n_vertices = 0;
+  double weight = 0.0, cut = 0.0;
+
+  /** Subgraph of the node, and the vertex of the component graph for each of its vertices */
+  ComponentGraph graph;
+  std::vector<idxtype> vertices;
+
+  /** Subgraphs of the children, until the children are created */
+  std::vector<ComponentGraph> child_graphs;
+  std::vector<std::vector<idxtype>> child_vertices;
+};
+
+/** A node to be split, with its memory estimate for the scheduler */
+struct TreeTask
+{
+  size_t node;
+  size_t memory;
+};
+
+/** Write the description of the partition trees */
+void WriteTreeFile(const std::string &filename, const std::vector<TreeNode> &nodes,
+                   unsigned int branching, unsigned int depth)
+{
+  std::ofstream out(filename);
+  out << "# Each component is split into " << branching << " parts, recursively, "
+      << depth << " levels deep." << endl;
+  out << "# Voxels are labeled with the leaves of the trees. A node has the labels "
+      << "first_label to last_label of its leaves, so the node at level L that holds "
+      << "a voxel with label c is the one with first_label = c - (c - f) % "
+      << branching << "^(" << depth << " - L), where f is the first_label of the root." << endl;
+  out << "node\tparent\tlevel\tcomponent\tfirst_label\tlast_label\tvertices\tweight\tcut" << endl;
+  for(size_t i = 0; i < nodes.size(); i++)
+  {
+    const TreeNode &node = nodes[i];
+    out << i << "\t" << node.parent << "\t" << node.level << "\t" << node.component << "\t"
+        << node.first_label << "\t" << node.first_label + node.n_labels - 1 << "\t"
+        << node.n_vertices << "\t" << node.weight << "\t" << node.cut << endl;
+  }
+  if(!out)
+    throw std::runtime_error("Cannot write tree file " + filename);
+}
+
+/**
+ * Split every kept component recursively into p.nParts parts, p.tree_depth
+ * levels deep, with METIS on the subgraph of every node. The nodes of each
+ * level are split concurrently, largest first. The leaves are labeled in
+ * depth-first order, so that every node has consecutive labels, and the
+ * trees are described in p.fnTree.
+ */
+void PartitionTree(const ImageGraphCutParameters &p)
+{
+  if(p.fnTree.empty())
+    throw std::invalid_argument("Partition trees need a tree file");
+  if(p.fnPrevious.size() || p.stream_slab > 0 || p.sweep_parts.size())
+    throw std::invalid_argument("Partition trees are not supported with incremental "
+                                "repartitioning, streaming or part count sweeps");
+
+  // Set random seed
+  if(p.use_random_seed)
+    srand(p.random_seed);
+
+  const unsigned int k = p.nParts, depth = p.tree_depth;
+  cout << "will split each component into " << k << " parts, " << depth << " levels deep" << endl;
+  cout << "   using " << 8 * sizeof(idxtype) << "-bit graph indices" << endl << endl;
+
+  ImageGraphGeometry geometry;
+  std::vector<ImageGraphComponent> components;
+  LoadComponentGraphs(p, geometry, components);
+
+  // Every kept component is the root of a tree. Only the components in the
+  // list are considered, as in PartitionComponentsForCounts.
+  unsigned int hist_size = std::min<size_t>(p.max_comp, components.size()) + 1;
+  std::vector<size_t> comp_histogram(hist_size, 0);
+  for(unsigned int i = 1; i < hist_size; i++)
+    comp_histogram[i] = components[i-1].Voxels;
+  std::map<short, unsigned int> comp_parts = SelectComponents(p, comp_histogram);
+
+  const size_t max_labels = std::numeric_limits<short>::max();
+  size_t n_leaves = 1;
+  for(unsigned int level = 0; level < depth; level++)
+    if((n_leaves *= k) * comp_parts.size() > max_labels)
+      throw std::invalid_argument("The partition trees have more leaves than the output can label");
+
+  std::vector<TreeNode> nodes;
+  for(auto comp : comp_parts)
+  {
+    if(comp.first < 1 || (size_t) comp.first > components.size())
+      continue;
+    TreeNode root;
+    root.parent = -1;
+    root.level = 0;
+    root.component = comp.first;
+    root.first_label = 1 + nodes.size() * n_leaves;
+    root.n_labels = n_leaves;
+    root.graph = components[comp.first - 1].Graph;
+    root.vertices.resize(root.graph.GetNumberOfVertices());
+    for(size_t v = 0; v < root.vertices.size(); v++)
+      root.vertices[v] = (idxtype) v;
+    nodes.push_back(std::move(root));
+  }
+  const size_t n_roots = nodes.size();
+
+  // Split the nodes level by level
+  Vec weights = (p.xWeights.size() == k) ? p.xWeights : Vec(k, 1.0 / k);
+  std::mutex mutex_log;
+  size_t level_begin = 0;
+  for(unsigned int level = 0; level <= depth; level++)
+  {
+    size_t level_end = nodes.size();
+    std::vector<TreeTask> tasks;
+    for(size_t i = level_begin; i < level_end; i++)
+      tasks.push_back(TreeTask { i, EstimateComponentMemory(nodes[i].graph) });
+
+    RunTasks<TreeTask>(tasks, p.n_threads, p.mem_budget_gb * (1ul << 30), [&](TreeTask &task) {
+      TreeNode &node = nodes[task.node];
+      node.n_vertices = node.graph.GetNumberOfVertices();
+      for(size_t v = 0; v < node.n_vertices; v++)
+        node.weight += node.graph.GetVertexWeights()[v];
+      if(level == depth)
+        return;
+
+      // METIS needs at least one vertex per part
+      std::ostringstream log;
+      std::vector<idxtype> partition(node.n_vertices);
+      if(node.n_vertices >= k)
+      {
+        log << "   Splitting node " << task.node << " of component " << node.component
+            << " at level " << level << ", " << node.n_vertices << " vertices" << endl;
+        Vec node_weights = weights;
+        PartitionGraph(p, &node.graph, node_weights, partition, log);
+        node.cut = EvaluatePartition(node.graph, partition.data(), k, weights.data_block()).EdgeCut;
+        log << "      Cut value: " << node.cut << endl;
+      }
+      else
+      {
+        for(size_t v = 0; v < node.n_vertices; v++)
+          partition[v] = (idxtype) v;
+      }
+
+      node.child_graphs.resize(k);
+      SplitVoxelGraphByPartition(&node.graph, partition.data(), node.child_graphs, node.child_vertices);
+      node.graph.Clear();
+
+      std::lock_guard<std::mutex> guard(mutex_log);
+      cout << log.str() << flush;
+    });
+
+    // Create the children, with their vertices in the component graph
+    for(size_t i = level_begin; i < level_end && level < depth; i++)
+    {
+      for(unsigned int j = 0; j < k; j++)
+      {
+        TreeNode child;
+        child.parent = (long) i;
+        child.level = level + 1;
+        child.component = nodes[i].component;
+        child.n_labels = nodes[i].n_labels / k;
+        child.first_label = nodes[i].first_label + j * child.n_labels;
+        child.graph = nodes[i].child_graphs[j];
+        const std::vector<idxtype> &child_vertices = nodes[i].child_vertices[j];
+        child.vertices.resize(child_vertices.size());
+        for(size_t v = 0; v < child_vertices.size(); v++)
+          child.vertices[v] = nodes[i].vertices[child_vertices[v]];
+        nodes.push_back(std::move(child));
+      }
+      nodes[i].child_graphs.clear();
+      nodes[i].child_vertices.clear();
+      std::vector<idxtype>().swap(nodes[i].vertices);
+    }
+
+    double level_cut = 0.0;
+    for(size_t i = 0; i < level_begin; i++)
+      level_cut += nodes[i].cut;
+    cout << "level " << level << ": " << level_end - level_begin << " nodes, cut " << level_cut << endl;
+    level_begin = level_end;
+  }
+
+  // Label the vertices of each component with their leaves
+  std::map<short, std::vector<short>> codes;
+  for(const TreeNode &leaf : nodes)
+  {
+    if(leaf.level < depth)
+      continue;
+    std::vector<short> &comp_codes = codes[leaf.component];
+    comp_codes.resize(components[leaf.component - 1].Graph.GetNumberOfVertices());
+    for(idxtype v : leaf.vertices)
+      comp_codes[v] = (short) leaf.first_label;
+  }
+
+  ImageType::Pointer imgOut = CreateImage(geometry);
+  imgOut->FillBuffer(0);
+  short *out_buffer = imgOut->GetBufferPointer();
+  for(size_t r = 0; r < n_roots; r++)
+  {
+    ImageGraphComponent &comp = components[nodes[r].component - 1];
+    ComponentGraph &graph = comp.Graph;
+    if(graph.GetNumberOfVertices() == 0)
+    {
+      out_buffer[comp.FirstVoxel] = (short) nodes[r].first_label;
+      continue;
+    }
+
+    const std::vector<short> &comp_codes = codes[nodes[r].component];
+    const VoxelRun *runs = graph.GetVertexRuns();
+    for(size_t iRun = 0; iRun < graph.GetNumberOfVertexRuns(); iRun++)
+    {
+      short *outPixel = out_buffer + runs[iRun].BufferOffset;
+      for(size_t iVertex = runs[iRun].FirstVertex; iVertex < runs[iRun+1].FirstVertex; iVertex++)
+        *outPixel++ = comp_codes[iVertex];
+    }
+  }
+
+  cout << "writing output image" << endl;
+  WriteImageFile(imgOut.GetPointer(), p.fnOutput);
+  WriteTreeFile(p.fnTree, nodes, k, depth);
+}
+
+/* ***************************************************************************
+ * IMAGE FILES
+ * *************************************************************************** */
+
+/**
+ * Wrap a buffer of voxels in x-fastest order as an image without copying.
+ * The buffer remains owned by the caller.
+ */
+ImageType::Pointer WrapImageBuffer(short *buffer, const size_t size[3],
+                                   const double spacing[3], const double origin[3])
+{
+  ImageType::Pointer image = ImageType::New();
+  ImageType::RegionType region;
+  ImageType::SpacingType img_spacing;
+  ImageType::PointType img_origin;
+  for(unsigned int d = 0; d < 3; d++)
+  {
+    region.SetSize(d, size[d]);
+    img_spacing[d] = spacing[d];
+    img_origin[d] = origin[d];
+  }
+  image->SetRegions(region);
+  image->SetSpacing(img_spacing);
+  image->SetOrigin(img_origin);
+  image->GetPixelContainer()->SetImportPointer(buffer, region.GetNumberOfPixels(), false);
+  return image;
+}
+
+/**
+ * Buffers that are kept between the image files partitioned by a worker.
+ * ITK only reallocates the buffer of an image when it grows, so keeping the
+ * reader, with its output preserved across updates, and the output image
+ * saves allocating and faulting in two images per file.
+ */
+struct ImageFileBuffers
+{
+  ReaderType::Pointer reader;
+  ImageType::Pointer output;
+};
+
+/**
+ * Partition the image or graph file p.fnInput, using the given buffers, and
+ * record the stages in the profile, if one is given.
+ */
+void PartitionFile(const ImageGraphCutParameters &p, ImageFileBuffers &buffers,
+                   ImageGraphCutProfile *profile)
+{
+  CheckPartWeights(p);
+
+  // Split the components recursively
+  if(p.tree_depth > 0)
+  {
+    ProfileStage stage(profile, "partition tree");
+    PartitionTree(p);
+    return;
+  }
+
+  // Partition for several part counts with one graph build
+  if(p.sweep_parts.size())
+  {
+    ProfileStage stage(profile, "part count sweep");
+    image_graph_cut_sweep(p);
+    return;
+  }
+
+  // Partition the graphs saved by an earlier run
+  if(IsImageGraphFile(p.fnInput))
+  {
+    if(p.fnPrevious.size())
+      throw std::invalid_argument("Incremental repartitioning needs the input image, not a graph file");
+    if(p.fnSaveGraph.size())
+      throw std::invalid_argument("The input is already a graph file");
+    ProfileStage stage(profile, "graph file");
+    PartitionGraphFile(p);
+    return;
+  }
+
+  // Partition images that need not fit into memory slab by slab
+  if(p.stream_slab > 0)
+  {
+    if(p.fnPrevious.size())
+      throw std::invalid_argument("Incremental repartitioning is not supported when streaming");
+    if(p.fnHint.size())
+      throw std::invalid_argument("Hint files are not supported when streaming");
+    if(p.fnEdgeImage.size())
+      throw std::invalid_argument("Edge weight images are not supported when streaming");
+    ProfileStage stage(profile, "streaming");
+    PartitionImageFileStreaming(p);
+    return;
+  }
+
+  // Read the input image image
+  cout << "reading input image" << endl;
+  ProfileStage stage_read(profile, "read");
+
+  if(!buffers.reader)
+  {
+    buffers.reader = ReaderType::New();
+    buffers.reader->ReleaseDataBeforeUpdateFlagOff();
+    buffers.output = ImageType::New();
+  }
+  ReaderType *fltReader = buffers.reader;
+  fltReader->SetFileName(p.fnInput.c_str());
+  fltReader->Update();
+  ImageType::Pointer img = fltReader->GetOutput();
+
+  // Create output image
+  ImageType::Pointer imgOut = buffers.output;
+  imgOut->SetRegions(img->GetBufferedRegion());
+  imgOut->CopyInformation(img);
+  imgOut->Allocate();
+  stage_read.Stop();
+
+  // Read the previous result, if repartitioning incrementally
+  ImageType::Pointer imgPrev;
+  if(p.fnPrevious.size())
+  {
+    cout << "reading previous label image" << endl;
+    ProfileStage stage_prev(profile, "read previous");
+    ReaderType::Pointer fltPrevReader = ReaderType::New();
+    fltPrevReader->SetFileName(p.fnPrevious.c_str());
+    fltPrevReader->Update();
+    imgPrev = fltPrevReader->GetOutput();
+  }
+
+  // Read the companion image of the edge weights, if any
+  EdgeImageType::Pointer imgEdge;
+  if(p.fnEdgeImage.size())
+  {
+    ProfileStage stage_edge(profile, "read edge image");
+    imgEdge = ReadEdgeImage(p, img);
+  }
+
+  // Partition the image
+  PartitionImage(p, img, imgOut, imgPrev, imgEdge, profile);
+
+  // Write the image
+  cout << "writing output image" << endl;
+  ProfileStage stage_write(profile, "write");
+
+  typedef ImageFileWriter<ImageType> WriterType;
+  WriterType::Pointer fltWriter = WriterType::New();
+  fltWriter->SetInput(imgOut);
+  fltWriter->SetFileName(p.fnOutput.c_str());
+  fltWriter->Update();
+}
+
+/**
+ * Partition p.fnInput with the given buffers, recording the whole run in the
+ * profile, if one is given, and saving it to p.fnProfile if that is set.
+ */
+void RunFile(const ImageGraphCutParameters &p, ImageFileBuffers &buffers,
+             ImageGraphCutProfile *profile = nullptr)
+{
+  ImageGraphCutProfile file_profile;
+  if(!profile && p.fnProfile.size())
+    profile = &file_profile;
+
+  if(!profile)
+  {
+    PartitionFile(p, buffers, nullptr);
+    return;
+  }
+
+  *profile = ImageGraphCutProfile();
+  ProcessUsage start = GetProcessUsage();
+  PartitionFile(p, buffers, profile);
+  profile->total = MakeStageProfile("total", start, GetProcessUsage());
+
+  if(p.fnProfile.size())
+    WriteProfileFile(p.fnProfile, p, *profile);
+}
+
+int image_graph_cut(const ImageGraphCutParameters &p)
+{
+  ImageFileBuffers buffers;
+  RunFile(p, buffers);
+
+  // Done!
+  return 0;
+}
+
+int image_graph_cut(const ImageGraphCutParameters &p, ImageGraphCutProfile &profile)
+{
+  ImageFileBuffers buffers;
+  RunFile(p, buffers, &profile);
+  return 0;
+}
+
+/* ***************************************************************************
+ * BATCH MODE
+ * *************************************************************************** */
+
+/** A case of a batch, with its memory estimate for the scheduler */
+struct BatchTask
+{
+  size_t index;
+  size_t memory;
+};
+
+/**
+ * Conservative estimate of the memory needed by a case, from the header of
+ * its input: the input, output and component images, plus the graph of a
+ * solid mask (about 2 + 2 * p.connectivity indices per voxel) with the METIS
+ * workspace. 18-connected components take another index per voxel. Mapped
+ * graph files count three times their size, and streaming cases two input
+ * slabs and an output slab. Inputs that cannot be read count as zero, and
+ * fail when the case runs.
+ */
+size_t EstimateCaseMemory(const ImageGraphCutParameters &p)
+{
+  try
+  {
+    if(IsImageGraphFile(p.fnInput))
+    {
+      std::ifstream in(p.fnInput, std::ios::binary | std::ios::ate);
+      return 3 * (size_t) in.tellg();
+    }
+
+    ReaderType::Pointer reader = ReaderType::New();
+    reader->SetFileName(p.fnInput.c_str());
+    reader->UpdateOutputInformation();
+    const ImageType::RegionType &region = reader->GetOutput()->GetLargestPossibleRegion();
+    size_t n_pixels = region.GetNumberOfPixels();
+    if(p.stream_slab > 0)
+      return 3 * region.GetSize(0) * region.GetSize(1) * std::max(3, p.stream_slab) * sizeof(short);
+    size_t n_edge_bytes = p.fnEdgeImage.size() ? sizeof(float) : 0;
+    size_t n_comp_bytes = p.connectivity == 18 ? sizeof(size_t) : 0;
+    size_t n_graph_indices = 2 + 2 * p.connectivity;
+    return n_pixels * (4 * sizeof(short) + n_edge_bytes + n_comp_bytes
+                       + 3 * n_graph_indices * sizeof(idxtype));
+  }
+  catch(...)
+  {
+    return 0;
+  }
+}
+
+std::vector<ImageGraphCutBatchResult> image_graph_cut_batch(
+  const std::vector<ImageGraphCutParameters> &cases, int n_jobs, double mem_budget_gb)
+{
+  std::vector<ImageGraphCutBatchResult> results(cases.size());
+  std::vector<BatchTask> tasks(cases.size());
+  for(size_t i = 0; i < cases.size(); i++)
+  {
+    tasks[i].index = i;
+    tasks[i].memory = EstimateCaseMemory(cases[i]);
+  }
+
+  // Running cases take a set of buffers from the pool and return it when
+  // they succeed, so there are at most n_jobs sets
+  std::mutex mutex;
+  std::vector<std::unique_ptr<ImageFileBuffers>> pool;
+  size_t n_done = 0;
+  RunTasks<BatchTask>(tasks, n_jobs, mem_budget_gb * (1ul << 30), [&](BatchTask &task) {
+    std::unique_ptr<ImageFileBuffers> buffers;
+    {
+      std::lock_guard<std::mutex> guard(mutex);
+      if(pool.size())
+      {
+        buffers = std::move(pool.back());
+        pool.pop_back();
+      }
+    }
+    if(!buffers)
+      buffers.reset(new ImageFileBuffers());
+
+    // A failed case only fails its own result
+    const ImageGraphCutParameters &p = cases[task.index];
+    ImageGraphCutBatchResult &result = results[task.index];
+    auto t_start = std::chrono::steady_clock::now();
+    try
+    {
+      RunFile(p, *buffers);
+      result.ok = true;
+    }
+    catch(std::exception &exc)
+    {
+      result.message = exc.what();
+    }
+    catch(...)
+    {
+      result.message = "unknown error";
+    }
+    result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - t_start).count();
+
+    std::lock_guard<std::mutex> guard(mutex);
+    if(result.ok)
+      pool.push_back(std::move(buffers));
+    cout << "case " << task.index + 1 << " (" << ++n_done << " of " << cases.size() << " done): "
+         << (result.ok ? "ok" : "failed") << " in " << result.seconds << " s, "
+         << p.fnInput << endl;
+  });
+
+  return results;
+}
+
+
+int image_graph_cut(const ImageGraphCutParameters &p, const short *input, short *output,
+                    const size_t size[3], const double spacing[3], const double origin[3],
+                    const short *previous, ImageGraphCutProfile *profile)
+{
+  CheckPartWeights(p);
+
+  ProcessUsage start;
+  if(profile)
+  {
+    *profile = ImageGraphCutProfile();
+    start = GetProcessUsage();
+  }
+
+  // The pipeline only reads the input and previous buffers
+  ImageType::Pointer img = WrapImageBuffer(const_cast<short *>(input), size, spacing, origin);
+  ImageType::Pointer imgOut = WrapImageBuffer(output, size, spacing, origin);
+  ImageType::Pointer imgPrev;
+  if(previous)
+    imgPrev = WrapImageBuffer(const_cast<short *>(previous), size, spacing, origin);
+  PartitionImage(p, img, imgOut, imgPrev, nullptr, profile);
+
+  if(profile)
+    profile->total = MakeStageProfile("total", start, GetProcessUsage());
+  return 0;
+}
+
+void image_graph_build(const short *input, const size_t size[3], ImageGraph &graph,
+                       unsigned int connectivity)
+{
+  const double spacing[3] = { 1.0, 1.0, 1.0 }, origin[3] = { 0.0, 0.0, 0.0 };
+  ImageType::Pointer img = WrapImageBuffer(const_cast<short *>(input), size, spacing, origin);
+
+  MyWeightFunctor fnWeight;
+  GraphFilter::Pointer fltGraph = GraphFilter::New();
+  fltGraph->SetInput(img);
+  fltGraph->SetWeightFunctor(&fnWeight);
+  fltGraph->SetConnectivity(connectivity);
+  fltGraph->ParallelBuildOn();
+  fltGraph->Update();
+  fltGraph->TransferGraph(graph);
+}
+
+idx_t image_graph_partition(ImageGraph &graph, int n_parts, const float *weights,
+                            float tolerance, int n_iter, idx_t *partition)
+{
+  std::vector<float> part_weights(n_parts, 1.0f / n_parts);
+  if(weights)
+    part_weights.assign(weights, weights + n_parts);
+
+  // The graph holds every component of the image, so the parts are not
+  // required to be connected
+  return RunMETISPartition(&graph, n_parts, part_weights.data(), partition,
+                           tolerance, n_iter, false, false);
+}
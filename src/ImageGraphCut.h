@@ -1,25 +1,208 @@
 #ifndef __ImageGraphCut_h_
 #define __ImageGraphCut_h_
 
+#include <cstddef>
 #include <string>
+#include <vector>
 #include <vnl/vnl_vector.h>
+#include <metis.h>
+#include "VoxelGraph.h"
 
 struct ImageGraphCutParameters
 {
   // Variables to hold command line arguments
   std::string fnInput, fnOutput;
+  std::string fnPrevious;
+  std::string fnScratch;
+  std::string fnSaveGraph;
+  std::string fnProfile;
+  std::string fnHint;
+  std::string fnEdgeImage;
+  std::string edge_function = "gauss";
+  double edge_sigma = 0.0;
+  double edge_scale = 100.0;
   int nParts;
   vnl_vector<float> xWeights;
   int iPlaneDim = -1, iPlaneSlice = -1, iPlaneStrength = 10;
+  int connectivity = 6;
   bool flagOptimize = false;
+  int opt_population = 1;
+  int opt_max_evals = 100;
+  double opt_max_seconds = 0.0;
+  int coarsen_factor = 1;
+  int refine_passes = 8;
+  int incremental_radius = 3;
   float tolerance = 1.001;
   int nMetisIter = 1;
   int max_comp = 1;
   double min_comp_frac = 0.0;
   bool use_random_seed = false;
   int random_seed = 0;
+  int n_threads = 1;
+  double mem_budget_gb = 0.0;
+  int stream_slab = 0;
+  std::vector<int> sweep_parts;
+  bool sweep_stack = false;
+  int tree_depth = 0;
+  std::string fnTree;
 };
 
+/**
+ * Partition the image in p.fnInput and save the part labels to p.fnOutput.
+ * If p.stream_slab is positive, the image is read and written in slabs of
+ * that many slices, and the graph is stored in the memory-mapped scratch
+ * file p.fnScratch (by default, next to the output), so that the image does
+ * not need to fit into memory. If p.fnSaveGraph is set, the graphs of the
+ * components 1 to p.max_comp are saved to that file, which can be given as
+ * p.fnInput of later runs to partition the graphs again without reading the
+ * image or rebuilding them. If p.sweep_parts is not empty, the partitions for
+ * all of its part counts are computed as in image_graph_cut_sweep.
+ *
+ * If p.tree_depth is positive, every kept component is instead split into
+ * p.nParts parts recursively, p.tree_depth levels deep, and the output labels
+ * the leaves of these trees, which are described in the text file p.fnTree.
+ * The leaves of every node have consecutive labels, so the node at level L
+ * that holds a voxel labeled c is labeled c - (c - f) % pow(p.nParts,
+ * p.tree_depth - L), where f is the first label of the component.
+ *
+ * If p.fnHint is set, the vertex and edge weights of the graph follow the
+ * rules of that hint file, as described in the usage of the command line
+ * tool, and only the pixels with a positive vertex weight are partitioned.
+ * If p.fnEdgeImage is set, the weight of every edge is further multiplied by
+ * p.edge_scale * f(d / p.edge_sigma), rounded and at least one, where d is
+ * the difference of the intensities of its voxels in that image and f is
+ * exp(-x^2) for p.edge_function "gauss", exp(-|x|) for "exp" or 1 / (1 + |x|)
+ * for "inv". Unless p.edge_sigma is positive, it is the root mean square of
+ * the differences over all the edges, so that cuts prefer weak boundaries.
+ * If p.iPlaneDim is 0, 1 or 2, the weights of all the edges except those
+ * between slices p.iPlaneSlice - 1 and p.iPlaneSlice of that dimension are
+ * multiplied by p.iPlaneStrength, so that cuts follow that plane.
+ *
+ * The voxels of the components and graphs are linked to their 6 face
+ * neighbors, or with p.connectivity 18 or 26, to their edge and corner
+ * neighbors as well. The weights of the edges are then multiplied by 10, 7
+ * and 6 for face, edge and corner neighbors, roughly inverse to distance.
+ *
+ * If p.fnProfile is set, the profile of the run, as returned by the overload
+ * below, is saved to that file in JSON format.
+ */
 int image_graph_cut(const ImageGraphCutParameters &p);
 
+/** Wall time, CPU time and peak memory of one stage of image_graph_cut */
+struct ImageGraphCutStageProfile
+{
+  std::string name;
+  double wall_seconds = 0.0;
+  double cpu_seconds = 0.0;
+  size_t peak_rss_bytes = 0;
+};
+
+/**
+ * Size and timings of the graph of one connected component. The partition
+ * time includes the coarsening and boundary refinement of the multi-
+ * resolution and incremental modes. The weight optimization runs METIS
+ * itself, so the METIS time stays zero when the weights are optimized.
+ */
+struct ImageGraphCutComponentProfile
+{
+  int label = 0;
+  int n_parts = 0;
+  size_t voxels = 0, vertices = 0, edges = 0, runs = 0, graph_bytes = 0;
+  double edge_cut = 0.0;
+  double partition_seconds = 0.0, optimize_seconds = 0.0, metis_seconds = 0.0;
+  double write_seconds = 0.0;
+};
+
+/**
+ * Profile of a run of image_graph_cut. The stages of the default pipeline
+ * are listed in the order in which they ran, and the components are
+ * partitioned concurrently within the partition stage. The other modes
+ * (streaming, graph files, sweeps and trees) are recorded as a single
+ * stage. The CPU time counts all the threads of the process, and the peak
+ * memory is that of the process when the stage ends.
+ */
+struct ImageGraphCutProfile
+{
+  ImageGraphCutStageProfile total;
+  std::vector<ImageGraphCutStageProfile> stages;
+  std::vector<ImageGraphCutComponentProfile> components;
+};
+
+/** Run image_graph_cut, recording the time and memory of its stages */
+int image_graph_cut(const ImageGraphCutParameters &p, ImageGraphCutProfile &profile);
+
+/** Edge cut and balance of the partition for one part count of a sweep */
+struct ImageGraphCutSweepResult
+{
+  int n_parts = 0;
+  double edge_cut = 0.0;
+  double imbalance = 1.0;
+  std::string fn_output;
+};
+
+/**
+ * Partition the image or graph file p.fnInput into each of the numbers of
+ * parts in p.sweep_parts, building the graphs only once. The components of
+ * all the counts are partitioned concurrently, as allowed by p.n_threads and
+ * p.mem_budget_gb. The labels for n parts are written to p.fnOutput with _n
+ * inserted before the extension, or, if p.sweep_stack is set, as the volumes
+ * of a 4D image in p.fnOutput. The weights in p.xWeights only apply to the
+ * counts that they have as many weights as. Returns the total edge cut and
+ * the largest imbalance over the components for each count.
+ */
+std::vector<ImageGraphCutSweepResult> image_graph_cut_sweep(const ImageGraphCutParameters &p);
+
+/** Outcome of a case of image_graph_cut_batch */
+struct ImageGraphCutBatchResult
+{
+  bool ok = false;
+  double seconds = 0.0;
+  std::string message;
+};
+
+/**
+ * Partition many image files in one process, as image_graph_cut would with
+ * the parameters of each case. Up to n_jobs cases run at once, largest first,
+ * and a case only starts when its estimated memory fits within mem_budget_gb
+ * together with the running cases (zero means no limit). Each worker reuses
+ * its image buffers from one case to the next. A case that fails is reported
+ * in its result and does not stop the others.
+ */
+std::vector<ImageGraphCutBatchResult> image_graph_cut_batch(
+  const std::vector<ImageGraphCutParameters> &cases, int n_jobs, double mem_budget_gb);
+
+/**
+ * Partition an image held in memory, ignoring p.fnInput and p.fnOutput. The
+ * input and output are buffers of size[0] x size[1] x size[2] voxels with x
+ * varying fastest, and neither one is copied. Spacing and origin are given 
+ * in the same (x, y, z) order. If previous is given, it holds the labels of
+ * an earlier run, in the same layout, to repartition incrementally from. If
+ * profile is given, the stages of the run are recorded in it.
+ */
+int image_graph_cut(const ImageGraphCutParameters &p, const short *input, short *output,
+                    const size_t size[3], const double spacing[3], const double origin[3],
+                    const short *previous = nullptr, ImageGraphCutProfile *profile = nullptr);
+
+/** The voxel graph of an image, with the METIS index type for all arrays */
+typedef VoxelGraph<idx_t> ImageGraph;
+
+/**
+ * Build the voxel graph of an image held in memory, using the same vertices
+ * and weights as image_graph_cut, linking each voxel to 6, 18 or 26
+ * neighbors. The input is laid out as above, and the runs of the graph refer
+ * to offsets in the input buffer.
+ */
+void image_graph_build(const short *input, const size_t size[3], ImageGraph &graph,
+                       unsigned int connectivity = 6);
+
+/**
+ * Partition a graph into n_parts parts with METIS, with optional relative
+ * part weights (nullptr for equal parts). The zero-based part of every vertex
+ * is written to partition. Returns the edge cut. Since the graph may have
+ * several components, the parts are not required to be connected. Throws a
+ * std::runtime_error when METIS fails.
+ */
+idx_t image_graph_partition(ImageGraph &graph, int n_parts, const float *weights,
+                            float tolerance, int n_iter, idx_t *partition);
+
 #endif
@@ -0,0 +1,527 @@
+#include "ImageGraphCut.h"
+#include "ImageToGraphFilter.h"
+#include "StreamingGraphBuilder.h"
+#include <itkImage.h>
+#include <itkImageFileWriter.h>
+#include <itkMultiThreaderBase.h>
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <exception>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+int usage()
+{
+  const char *usage =
+    "usage: image_graph_cut_benchmark [options]"
+    "\n   partitions synthetic masks with image_graph_cut and reports the time of"
+    "\n   each stage, one row per shape, size, thread count and repeat"
+    "\noptions: "
+    "\n   -shapes list        Comma-separated shapes (default: all of them):"
+    "\n                         sphere   a solid ball"
+    "\n                         tubes    thin curved tubes, like vessels"
+    "\n                         blobs    many small separate balls"
+    "\n                         shell    a hollow sphere"
+    "\n   -sizes list         Comma-separated edge lengths of the cubic images"
+    "\n                       (default: 64,128,256; up to 1024)"
+    "\n   -threads list       Comma-separated thread counts (default: 1,2,4)"
+    "\n   -parts N            Number of parts (default: 16)"
+    "\n   -c N                Partition up to N components (default: 100)"
+    "\n   -repeat N           Run each configuration N times (default: 1)"
+    "\n   -csv file           Save the rows as comma-separated values (default:"
+    "\n                       print them once all the runs are done)"
+    "\n   -json file          Save the rows as a JSON array"
+    "\n   -v                  Print the log of every run"
+    "\n   -verify file.mha    Instead of timing the runs, check that the serial,"
+    "\n                       parallel and streaming graph builders give the same"
+    "\n                       graph of every mask, in every neighborhood. The"
+    "\n                       mask is written to the given file for streaming"
+    "\ncolumns: "
+    "\n   components_seconds  connected components, relabeling and selection"
+    "\n   build_seconds       graph construction"
+    "\n   partition_seconds   partitioning of the components, which run concurrently"
+    "\n   metis_seconds       METIS time, summed over the components"
+    "\n   writeback_seconds   writing the labels into the output, summed over the"
+    "\n                       components, plus shifting them by component"
+    "\n   total_seconds, cpu_seconds and peak_rss_bytes cover the whole run\n";
+  cout << usage;
+  return -1;
+}
+
+/** Parse a comma-separated list of positive integers */
+bool parse_list(const char *arg, std::vector<int> &values)
+{
+  values.clear();
+  std::istringstream iss(arg);
+  for(std::string value; std::getline(iss, value, ','); )
+  {
+    values.push_back(atoi(value.c_str()));
+    if(values.back() < 1)
+      return false;
+  }
+  return values.size() > 0;
+}
+
+/**
+ * Fill a cubic mask of edge n with a synthetic shape. The shapes are drawn
+ * from a fixed seed, so that every run sees the same masks.
+ */
+bool make_mask(const std::string &shape, long n, std::vector<short> &mask)
+{
+  mask.assign(n * n * n, 0);
+  std::mt19937 rng(12345);
+  std::uniform_real_distribution<double> uniform(0.0, 1.0);
+  const double c = 0.5 * (n - 1), pi = 3.14159265358979323846;
+
+  auto ball = [&](double cx, double cy, double cz, double r) {
+    long x0 = std::max(0L, (long) (cx - r)), x1 = std::min(n - 1, (long) (cx + r) + 1);
+    long y0 = std::max(0L, (long) (cy - r)), y1 = std::min(n - 1, (long) (cy + r) + 1);
+    long z0 = std::max(0L, (long) (cz - r)), z1 = std::min(n - 1, (long) (cz + r) + 1);
+    for(long z = z0; z <= z1; z++)
+      for(long y = y0; y <= y1; y++)
+        for(long x = x0; x <= x1; x++)
+          if((x - cx) * (x - cx) + (y - cy) * (y - cy) + (z - cz) * (z - cz) <= r * r)
+            mask[x + n * (y + n * z)] = 1;
+  };
+
+  if(shape == "sphere")
+  {
+    ball(c, c, c, 0.45 * n);
+  }
+  else if(shape == "shell")
+  {
+    double r_out = 0.45 * n, r_in = 0.45 * n - std::max(2.0, 0.04 * n);
+    for(long z = 0; z < n; z++)
+      for(long y = 0; y < n; y++)
+        for(long x = 0; x < n; x++)
+        {
+          double d2 = (x - c) * (x - c) + (y - c) * (y - c) + (z - c) * (z - c);
+          if(d2 <= r_out * r_out && d2 >= r_in * r_in)
+            mask[x + n * (y + n * z)] = 1;
+        }
+  }
+  else if(shape == "tubes")
+  {
+    // Helices of radius 1.5 voxels wound around random axes through the
+    // volume, which touch each other now and then like a vessel tree
+    int n_tubes = std::max(4L, n / 8);
+    for(int t = 0; t < n_tubes; t++)
+    {
+      double ax = uniform(rng) * n, ay = uniform(rng) * n;
+      double amp = 0.02 * n + 0.08 * n * uniform(rng), freq = 2 + 4 * uniform(rng);
+      double phase = 2 * pi * uniform(rng);
+      for(double z = 0; z < n; z += 0.5)
+      {
+        double a = phase + freq * 2 * pi * z / n;
+        ball(ax + amp * cos(a), ay + amp * sin(a), z, 1.5);
+      }
+    }
+  }
+  else if(shape == "blobs")
+  {
+    // Balls of radius 2 to 4 on a jittered grid, so that they do not touch
+    long spacing = 12;
+    for(long z = spacing / 2; z + spacing / 2 < n; z += spacing)
+      for(long y = spacing / 2; y + spacing / 2 < n; y += spacing)
+        for(long x = spacing / 2; x + spacing / 2 < n; x += spacing)
+          ball(x + uniform(rng) - 0.5, y + uniform(rng) - 0.5, z + uniform(rng) - 0.5,
+               2 + 2 * uniform(rng));
+  }
+  else
+  {
+    return false;
+  }
+  return true;
+}
+
+/** The measurements of one run */
+struct BenchmarkRow
+{
+  std::string shape;
+  int size, threads, repeat;
+  size_t voxels = 0, vertices = 0, edges = 0, components = 0;
+  double components_seconds = 0.0, build_seconds = 0.0, partition_seconds = 0.0;
+  double metis_seconds = 0.0, writeback_seconds = 0.0;
+  double total_seconds = 0.0, cpu_seconds = 0.0;
+  size_t peak_rss_bytes = 0;
+};
+
+/** Sum up the profile of a run into a row */
+void fill_row(const ImageGraphCutProfile &profile, BenchmarkRow &row)
+{
+  for(const ImageGraphCutStageProfile &stage : profile.stages)
+  {
+    if(stage.name == "connected components" || stage.name == "relabel"
+       || stage.name == "select components")
+      row.components_seconds += stage.wall_seconds;
+    else if(stage.name == "build graph")
+      row.build_seconds += stage.wall_seconds;
+    else if(stage.name == "partition")
+      row.partition_seconds += stage.wall_seconds;
+    else if(stage.name == "label write-back")
+      row.writeback_seconds += stage.wall_seconds;
+  }
+
+  for(const ImageGraphCutComponentProfile &comp : profile.components)
+  {
+    if(comp.voxels > 0)
+      row.components++;
+    row.voxels += comp.voxels;
+    row.vertices += comp.vertices;
+    row.edges += comp.edges;
+    row.metis_seconds += comp.metis_seconds;
+    row.writeback_seconds += comp.write_seconds;
+  }
+  row.total_seconds = profile.total.wall_seconds;
+  row.cpu_seconds = profile.total.cpu_seconds;
+  row.peak_rss_bytes = profile.total.peak_rss_bytes;
+}
+
+typedef itk::Image<short, 3> ImageType;
+typedef StaticBinaryGraphWeightFunctor<ImageType, idx_t> BinaryWeightFunctor;
+typedef ImageToGraphFilter<ImageType, idx_t, idx_t, BinaryWeightFunctor> BinaryGraphFilter;
+typedef StreamingGraphBuilder<ImageType, idx_t, idx_t, BinaryWeightFunctor> BinaryStreamingBuilder;
+
+/** Name the first array in which two graphs differ, or return an empty string */
+std::string compare_graphs(ImageGraph &a, ImageGraph &b)
+{
+  size_t nv = a.GetNumberOfVertices(), ne = a.GetNumberOfEdges(), nr = a.GetNumberOfVertexRuns();
+  if(nv != b.GetNumberOfVertices() || ne != b.GetNumberOfEdges() || nr != b.GetNumberOfVertexRuns())
+    return "size";
+  if(!std::equal(a.GetAdjacencyIndex(), a.GetAdjacencyIndex() + nv + 1, b.GetAdjacencyIndex()))
+    return "xadj";
+  if(!std::equal(a.GetAdjacency(), a.GetAdjacency() + ne, b.GetAdjacency()))
+    return "adjncy";
+  if(!std::equal(a.GetVertexWeights(), a.GetVertexWeights() + nv, b.GetVertexWeights()))
+    return "vwgt";
+  if(!std::equal(a.GetEdgeWeights(), a.GetEdgeWeights() + ne, b.GetEdgeWeights()))
+    return "adjwgt";
+  for(size_t r = 0; r <= nr; r++)
+    if(a.GetVertexRuns()[r].BufferOffset != b.GetVertexRuns()[r].BufferOffset
+       || a.GetVertexRuns()[r].FirstVertex != b.GetVertexRuns()[r].FirstVertex)
+      return "runs";
+  return std::string();
+}
+
+/**
+ * Build the graph of a mask serially, in parallel with each thread count, and
+ * with the streaming builder from a copy of the mask in fn_image, and check
+ * that the graphs are the same. A cut plane through the middle of the mask
+ * varies the edge weights. Prints the differences and returns false if there
+ * are any.
+ */
+bool verify_graphs(const std::string &shape, int size, unsigned int connectivity,
+                   const std::vector<short> &mask, const std::vector<int> &threads,
+                   const std::string &fn_image)
+{
+  ImageType::Pointer img = ImageType::New();
+  ImageType::RegionType region;
+  for(unsigned int d = 0; d < 3; d++)
+    region.SetSize(d, size);
+  img->SetRegions(region);
+  img->Allocate();
+  std::copy(mask.begin(), mask.end(), img->GetBufferPointer());
+
+  BinaryWeightFunctor fnWeight;
+  VoxelCutPlane plane;
+  plane.Dimension = 2;
+  plane.Slice = size / 2;
+  plane.Strength = 4;
+
+  auto build = [&](bool parallel, int n_threads, ImageGraph &graph) {
+    BinaryGraphFilter::Pointer fltGraph = BinaryGraphFilter::New();
+    fltGraph->SetInput(img);
+    fltGraph->SetWeightFunctor(&fnWeight);
+    fltGraph->SetCutPlane(plane);
+    fltGraph->SetConnectivity(connectivity);
+    fltGraph->SetParallelBuild(parallel);
+    fltGraph->SetNumberOfWorkUnits(n_threads);
+    fltGraph->Update();
+    fltGraph->TransferGraph(graph);
+  };
+
+  ImageGraph serial;
+  build(false, 1, serial);
+
+  std::ostringstream what;
+  what << shape << " " << size << "^3, " << connectivity << " neighbors";
+  bool same = true;
+  for(int n_threads : threads)
+  {
+    ImageGraph parallel;
+    build(true, n_threads, parallel);
+    std::string diff = compare_graphs(serial, parallel);
+    if(diff.size())
+    {
+      cerr << what.str() << ": parallel build on " << n_threads
+           << " threads differs in " << diff << endl;
+      same = false;
+    }
+  }
+
+  // The streaming builder puts every component into one graph, whose
+  // vertices are numbered in raster order like those of the filter
+  itk::ImageFileWriter<ImageType>::Pointer writer = itk::ImageFileWriter<ImageType>::New();
+  writer->SetFileName(fn_image.c_str());
+  writer->SetInput(img);
+  writer->Update();
+
+  std::string fn_scratch = fn_image + ".scratch";
+  {
+    BinaryStreamingBuilder builder;
+    builder.SetFileName(fn_image);
+    builder.SetSlabThickness(std::max(3, size / 8));
+    builder.SetWeightFunctor(&fnWeight);
+    builder.SetCutPlane(plane);
+    builder.SetConnectivity(connectivity);
+    builder.SetScratchFileName(fn_scratch);
+    builder.FindComponents();
+
+    std::vector<int> comp_block(builder.GetNumberOfComponents() + 1, 0);
+    std::vector<ImageGraph> blocks(1);
+    std::vector<idx_t *> partitions;
+    builder.BuildComponentGraphs(comp_block, blocks, partitions);
+    std::string diff = compare_graphs(serial, blocks[0]);
+    if(diff.size())
+    {
+      cerr << what.str() << ": streaming build differs in " << diff << endl;
+      same = false;
+    }
+  }
+  std::remove(fn_image.c_str());
+
+  if(same)
+    cerr << what.str() << ": " << serial.GetNumberOfVertices() << " vertices, "
+         << serial.GetNumberOfEdges() << " edges, same graphs" << endl;
+  return same;
+}
+
+const char *csv_header =
+  "shape,size,threads,repeat,voxels,vertices,edges,components,components_seconds,"
+  "build_seconds,partition_seconds,metis_seconds,writeback_seconds,total_seconds,"
+  "cpu_seconds,peak_rss_bytes";
+
+std::ostream &write_csv(std::ostream &out, const BenchmarkRow &r)
+{
+  return out << r.shape << "," << r.size << "," << r.threads << "," << r.repeat << ","
+             << r.voxels << "," << r.vertices << "," << r.edges << "," << r.components << ","
+             << r.components_seconds << "," << r.build_seconds << "," << r.partition_seconds << ","
+             << r.metis_seconds << "," << r.writeback_seconds << "," << r.total_seconds << ","
+             << r.cpu_seconds << "," << r.peak_rss_bytes;
+}
+
+std::ostream &write_json(std::ostream &out, const BenchmarkRow &r)
+{
+  return out << "{ \"shape\": \"" << r.shape << "\", \"size\": " << r.size
+             << ", \"threads\": " << r.threads << ", \"repeat\": " << r.repeat
+             << ", \"voxels\": " << r.voxels << ", \"vertices\": " << r.vertices
+             << ", \"edges\": " << r.edges << ", \"components\": " << r.components
+             << ", \"components_seconds\": " << r.components_seconds
+             << ", \"build_seconds\": " << r.build_seconds
+             << ", \"partition_seconds\": " << r.partition_seconds
+             << ", \"metis_seconds\": " << r.metis_seconds
+             << ", \"writeback_seconds\": " << r.writeback_seconds
+             << ", \"total_seconds\": " << r.total_seconds
+             << ", \"cpu_seconds\": " << r.cpu_seconds
+             << ", \"peak_rss_bytes\": " << r.peak_rss_bytes << " }";
+}
+
+int main(int argc, char *argv[])
+{
+  std::vector<std::string> shapes = { "sphere", "tubes", "blobs", "shell" };
+  std::vector<int> sizes = { 64, 128, 256 }, threads = { 1, 2, 4 };
+  int n_parts = 16, max_comp = 100, n_repeat = 1;
+  std::string fn_csv, fn_json, fn_verify;
+  bool verbose = false;
+
+  for(int iArg = 1; iArg < argc; iArg++)
+  {
+    bool has_value = iArg + 1 < argc;
+    if(!strcmp(argv[iArg], "-shapes") && has_value)
+    {
+      shapes.clear();
+      std::istringstream iss(argv[++iArg]);
+      for(std::string shape; std::getline(iss, shape, ','); )
+        shapes.push_back(shape);
+    }
+    else if(!strcmp(argv[iArg], "-sizes") && has_value)
+    {
+      if(!parse_list(argv[++iArg], sizes))
+        return usage();
+    }
+    else if(!strcmp(argv[iArg], "-threads") && has_value)
+    {
+      if(!parse_list(argv[++iArg], threads))
+        return usage();
+    }
+    else if(!strcmp(argv[iArg], "-parts") && has_value)
+    {
+      n_parts = atoi(argv[++iArg]);
+    }
+    else if(!strcmp(argv[iArg], "-c") && has_value)
+    {
+      max_comp = atoi(argv[++iArg]);
+    }
+    else if(!strcmp(argv[iArg], "-repeat") && has_value)
+    {
+      n_repeat = atoi(argv[++iArg]);
+    }
+    else if(!strcmp(argv[iArg], "-csv") && has_value)
+    {
+      fn_csv = argv[++iArg];
+    }
+    else if(!strcmp(argv[iArg], "-json") && has_value)
+    {
+      fn_json = argv[++iArg];
+    }
+    else if(!strcmp(argv[iArg], "-verify") && has_value)
+    {
+      fn_verify = argv[++iArg];
+    }
+    else if(!strcmp(argv[iArg], "-v"))
+    {
+      verbose = true;
+    }
+    else
+    {
+      cerr << "unknown option " << argv[iArg] << endl;
+      return usage();
+    }
+  }
+
+  if(n_parts < 1 || max_comp < 1 || n_repeat < 1)
+    return usage();
+
+  if(fn_verify.size())
+  {
+    bool same = true;
+    for(const std::string &shape : shapes)
+    {
+      for(int size : sizes)
+      {
+        std::vector<short> mask;
+        if(!make_mask(shape, size, mask))
+        {
+          cerr << "unknown shape " << shape << endl;
+          return usage();
+        }
+        for(unsigned int connectivity : { 6u, 18u, 26u })
+        {
+          try
+          {
+            same &= verify_graphs(shape, size, connectivity, mask, threads, fn_verify);
+          }
+          catch(std::exception &exc)
+          {
+            cerr << shape << " " << size << ": " << exc.what() << endl;
+            return -1;
+          }
+        }
+      }
+    }
+    return same ? 0 : -1;
+  }
+
+  // The pipeline logs to cout, which is silenced unless asked for
+  std::ostringstream log_sink;
+  std::streambuf *cout_buf = cout.rdbuf();
+
+  std::vector<BenchmarkRow> rows;
+  for(const std::string &shape : shapes)
+  {
+    for(int size : sizes)
+    {
+      std::vector<short> mask;
+      if(!make_mask(shape, size, mask))
+      {
+        cerr << "unknown shape " << shape << endl;
+        return usage();
+      }
+      std::vector<short> labels(mask.size());
+
+      for(int n_threads : threads)
+      {
+        for(int repeat = 0; repeat < n_repeat; repeat++)
+        {
+          ImageGraphCutParameters p;
+          p.nParts = n_parts;
+          p.xWeights.set_size(n_parts);
+          p.xWeights.fill(1.0 / n_parts);
+          p.max_comp = max_comp;
+          p.n_threads = n_threads;
+          p.use_random_seed = true;
+
+          // Graph construction and component analysis use the ITK threads
+          itk::MultiThreaderBase::SetGlobalDefaultNumberOfThreads(n_threads);
+
+          const size_t dims[3] = { (size_t) size, (size_t) size, (size_t) size };
+          const double spacing[3] = { 1.0, 1.0, 1.0 }, origin[3] = { 0.0, 0.0, 0.0 };
+          ImageGraphCutProfile profile;
+          try
+          {
+            if(!verbose)
+              cout.rdbuf(log_sink.rdbuf());
+            image_graph_cut(p, mask.data(), labels.data(), dims, spacing, origin, nullptr, &profile);
+            cout.rdbuf(cout_buf);
+            log_sink.str(std::string());
+          }
+          catch(std::exception &exc)
+          {
+            cout.rdbuf(cout_buf);
+            cerr << shape << " " << size << ": " << exc.what() << endl;
+            return -1;
+          }
+
+          BenchmarkRow row;
+          row.shape = shape;
+          row.size = size;
+          row.threads = n_threads;
+          row.repeat = repeat;
+          fill_row(profile, row);
+          rows.push_back(row);
+          cerr << shape << " " << size << "^3, " << n_threads << " threads: "
+               << row.total_seconds << " s" << endl;
+        }
+      }
+    }
+  }
+
+  std::ofstream csv_file;
+  if(fn_csv.size())
+    csv_file.open(fn_csv);
+  std::ostream &csv = fn_csv.size() ? csv_file : cout;
+  csv << csv_header << endl;
+  for(const BenchmarkRow &row : rows)
+    write_csv(csv, row) << endl;
+  if(!csv)
+  {
+    cerr << "cannot write " << fn_csv << endl;
+    return -1;
+  }
+
+  if(fn_json.size())
+  {
+    std::ofstream out(fn_json);
+    out << "[";
+    for(size_t i = 0; i < rows.size(); i++)
+      write_json(out << (i ? "," : "") << endl << "  ", rows[i]);
+    out << endl << "]" << endl;
+    if(!out)
+    {
+      cerr << "cannot write " << fn_json << endl;
+      return -1;
+    }
+  }
+
+  return 0;
+}
@@ -2,6 +2,11 @@
 #include <iostream>
 #include <cstring>
 #include <cstdlib>
+#include <exception>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
 
 using namespace std;
 
@@ -9,12 +14,38 @@ int usage()
 {
   const char *usage =
     "usage: metisseg [options] input.img output.img num_part"
-    "\n   uses METIS to segment a binary image into num_part partitions"
+    "\n       metisseg [options] -batch manifest.txt"
+    "\n   uses METIS to segment a binary image into num_part partitions. num_part"
+    "\n   may be a comma-separated list of part counts, e.g., 50,100,200, which are"
+    "\n   all computed from one graph build. The labels for n parts are then saved"
+    "\n   as output_n.img, and the edge cut and imbalance of each count are listed"
     "\noptions: "
-    "\n   -w X.X X.X          Specify relative weights of the partitions"
+    "\n   -w X.X X.X          Specify relative weights of the partitions. With a list"
+    "\n                       of part counts, the weights apply to the first count"
+    "\n   -hint file          Weight the vertices and edges of the graph by the"
+    "\n                       intensities of the input, following the rules of a"
+    "\n                       hint file (see below)"
+    "\n   -edge-image file    Multiply the edge weights by a function of the"
+    "\n                       intensity difference of their voxels in this image,"
+    "\n                       which has the size of the input, so that cuts"
+    "\n                       prefer weak boundaries"
+    "\n   -edge-weight F S W  Edge weight W * F(difference / S), rounded and at"
+    "\n                       least 1, where F is gauss (exp(-x^2)), exp"
+    "\n                       (exp(-|x|)) or inv (1 / (1 + |x|)). S = 0 uses the"
+    "\n                       RMS difference over the edges. Default: gauss 0 100"
     "\n   -p N1 N2 N3         define cut plane at dimension N1, slice N2"
-    "\n                       with relative edge strength N3"
+    "\n                       with relative edge strength N3: the edges between"
+    "\n                       slices N2-1 and N2 are N3 times cheaper to cut"
+    "\n                       than the others, whose weights are multiplied by N3"
+    "\n   -conn N             Link each voxel to its N = 6 (default), 18 or 26"
+    "\n                       neighbors, in the connected components and the"
+    "\n                       graph. Edge weights are then 10, 7 and 6 for face,"
+    "\n                       edge and corner neighbors"
     "\n   -o                  use optimization to refine partition weights"
+    "\n   -op N               with -o, evaluate N candidate weights concurrently per"
+    "\n                       generation of a parallel evolution strategy"
+    "\n   -oe N               with -o -op, stop after N METIS runs (default 100)"
+    "\n   -ot seconds         with -o -op, stop after this much wall-clock time"
     "\n   -u float            Load imbalance tolerance (ubvec in METIS). "
     "\n                       Must be >= 1. Larger values means more flexibility"
     "\n                       for non-equal partitions"
@@ -22,6 +53,47 @@ int usage()
     "\n   -c N frac           Allow up to N connected components in the input image "
     "\n                       rejecting components smaller than frac of total foreground"
     "\n                       each component will be handled separately"
+    "\n   -t N                Partition up to N components concurrently, largest first"
+    "\n   -mr k               Multi-resolution mode: partition the graph of k x k x k"
+    "\n                       blocks of voxels, then refine the part boundaries on the"
+    "\n                       voxel graph. Faster, but with a somewhat higher cut"
+    "\n   -prev labels.img    Repartition incrementally from the output of an earlier"
+    "\n                       run on a slightly different mask. Voxels keep their"
+    "\n                       previous labels except near the edits"
+    "\n   -ir N               With -prev, refine voxels up to N edges from an edit"
+    "\n   -mem GB             Only start a component when the estimated memory of the"
+    "\n                       running components stays below GB gigabytes"
+    "\n   -stream N           Read and write the image in slabs of N slices, keeping"
+    "\n                       the graph in a memory-mapped scratch file, for images"
+    "\n                       that do not fit into memory. Compressed images are"
+    "\n                       still read and written as a whole"
+    "\n   -scratch file       With -stream, the scratch file (default: output.scratch)"
+    "\n   -save-graph file    Save the graphs of the components allowed by -c to a"
+    "\n                       file, which can be given instead of input.img to"
+    "\n                       partition them again without rebuilding them"
+    "\n   -stack              With a list of part counts, save the labels of all the"
+    "\n                       counts as the volumes of a 4D image in output.img"
+    "\n   -profile file.json  Save the wall time, CPU time and peak memory of every"
+    "\n                       stage, and the graph size and timings of every"
+    "\n                       component, to a JSON file"
+    "\n   -tree D tree.txt    Split every component into num_part parts recursively,"
+    "\n                       D levels deep, label the voxels with the leaves, and"
+    "\n                       describe the tree in tree.txt. Every level can be read"
+    "\n                       from the leaf labels as explained in tree.txt"
+    "\nbatch mode: "
+    "\n   -batch manifest.txt Partition many images in one process. Each line of the"
+    "\n                       manifest holds '[options] input.img output.img num_part'"
+    "\n                       separated by spaces, and the options given on the"
+    "\n                       command line apply to every line. Blank lines and"
+    "\n                       lines starting with # are skipped. A failing line does"
+    "\n                       not stop the others, and the status and time of every"
+    "\n                       line are listed at the end"
+    "\n   -jobs N             Run up to N lines at once, largest images first (their"
+    "\n                       logs interleave)"
+    "\n   -jobs-mem GB        Only start a line when the estimated memory of the"
+    "\n                       running lines stays below GB gigabytes"
+    "\n   -summary file       Also write the status of every line to a file, as"
+    "\n                       tab-separated values"
     "\nhint files: "
     "\n   The hint file is used to convert an image into a graph. It specifies "
     "\n   the weights assigned to the vertices and edges in the graph based on"
@@ -39,23 +111,52 @@ int usage()
     "\n   value. For the latter, use the notation 'U n1 n2' for the uniform dist."
     "\n   and 'N n1 n2' for the normal dist. with mean n1 and s.d. n2. The order in"
     "\n   which the rules are specified matters, as the later rules replace the"
-    "\n   earlier ones.";
+    "\n   earlier ones. Random weights are drawn once for every intensity, or pair"
+    "\n   of intensities, and rounded to positive integers. Without any rule,"
+    "\n   nonzero intensities have unit weight. Blank lines and lines starting"
+    "\n   with # are skipped, and the intensities of the input may span at most"
+    "\n   4096 values.";
 
   cout << usage << endl;
   return -1;
 }
 
 
-int main(int argc, char *argv[])
+/**
+ * Read the options in argv[1] to argv[argc-4], followed by the input, output
+ * and number of parts. Returns false, with the reason in error, if they are
+ * not valid.
+ */
+bool parse_arguments(int argc, char *argv[], ImageGraphCutParameters &p, std::string &error)
 {
-  // Check arguments
-  if(argc < 4) return usage();
+  if(argc < 4)
+  {
+    error = "missing input, output or number of parts";
+    return false;
+  }
 
-  // Variables to hold command line arguments
-  ImageGraphCutParameters p;
   p.fnInput = argv[argc-3];
   p.fnOutput = argv[argc-2];
-  p.nParts = atoi(argv[argc-1]);
+
+  // A list of part counts is swept
+  std::istringstream counts(argv[argc-1]);
+  for(std::string count; std::getline(counts, count, ','); )
+  {
+    p.sweep_parts.push_back(atoi(count.c_str()));
+    if(p.sweep_parts.back() < 1)
+    {
+      error = "incorrect number of parts";
+      return false;
+    }
+  }
+  if(p.sweep_parts.empty())
+  {
+    error = "incorrect number of parts";
+    return false;
+  }
+  p.nParts = p.sweep_parts.front();
+  if(p.sweep_parts.size() == 1)
+    p.sweep_parts.clear();
   p.xWeights.set_size(p.nParts);
   p.xWeights.fill(1.0 / p.nParts);
 
@@ -72,20 +173,50 @@ int main(int argc, char *argv[])
       }
       else
       {
-        cerr << "Incorrect index in -w parameter" << endl;
-        return usage();
+        error = "incorrect index in -w parameter";
+        return false;
       }
     }
+    else if(!strcmp(argv[iArg],"-hint"))
+    {
+      p.fnHint = argv[++iArg];
+    }
+    else if(!strcmp(argv[iArg],"-edge-image"))
+    {
+      p.fnEdgeImage = argv[++iArg];
+    }
+    else if(!strcmp(argv[iArg],"-edge-weight"))
+    {
+      p.edge_function = argv[++iArg];
+      p.edge_sigma = atof(argv[++iArg]);
+      p.edge_scale = atof(argv[++iArg]);
+    }
     else if(!strcmp(argv[iArg],"-p"))
     {
       p.iPlaneDim = atoi(argv[++iArg]);
       p.iPlaneSlice = atoi(argv[++iArg]);
       p.iPlaneStrength = atoi(argv[++iArg]);
     }
+    else if(!strcmp(argv[iArg],"-conn"))
+    {
+      p.connectivity = atoi(argv[++iArg]);
+    }
     else if(!strcmp(argv[iArg],"-o"))
     {
       p.flagOptimize = true;
     }
+    else if(!strcmp(argv[iArg],"-op"))
+    {
+      p.opt_population = atoi(argv[++iArg]);
+    }
+    else if(!strcmp(argv[iArg],"-oe"))
+    {
+      p.opt_max_evals = atoi(argv[++iArg]);
+    }
+    else if(!strcmp(argv[iArg],"-ot"))
+    {
+      p.opt_max_seconds = atof(argv[++iArg]);
+    }
     else if(!strcmp(argv[iArg],"-seed"))
     {
       p.use_random_seed = true;
@@ -104,12 +235,190 @@ int main(int argc, char *argv[])
       p.max_comp = atoi(argv[++iArg]);
       p.min_comp_frac = atof(argv[++iArg]);
     }
+    else if(!strcmp(argv[iArg], "-t"))
+    {
+      p.n_threads = atoi(argv[++iArg]);
+    }
+    else if(!strcmp(argv[iArg], "-mr"))
+    {
+      p.coarsen_factor = atoi(argv[++iArg]);
+    }
+    else if(!strcmp(argv[iArg], "-prev"))
+    {
+      p.fnPrevious = argv[++iArg];
+    }
+    else if(!strcmp(argv[iArg], "-ir"))
+    {
+      p.incremental_radius = atoi(argv[++iArg]);
+    }
+    else if(!strcmp(argv[iArg], "-mem"))
+    {
+      p.mem_budget_gb = atof(argv[++iArg]);
+    }
+    else if(!strcmp(argv[iArg], "-stream"))
+    {
+      p.stream_slab = atoi(argv[++iArg]);
+    }
+    else if(!strcmp(argv[iArg], "-scratch"))
+    {
+      p.fnScratch = argv[++iArg];
+    }
+    else if(!strcmp(argv[iArg], "-stack"))
+    {
+      p.sweep_stack = true;
+    }
+    else if(!strcmp(argv[iArg], "-save-graph"))
+    {
+      p.fnSaveGraph = argv[++iArg];
+    }
+    else if(!strcmp(argv[iArg], "-profile"))
+    {
+      p.fnProfile = argv[++iArg];
+    }
+    else if(!strcmp(argv[iArg], "-tree"))
+    {
+      p.tree_depth = atoi(argv[++iArg]);
+      p.fnTree = argv[++iArg];
+    }
+    else
+    {
+      error = std::string("unknown option ") + argv[iArg];
+      return false;
+    }
+  }
+
+  return true;
+}
+
+/**
+ * Run the lines of a batch manifest. The arguments other than the batch
+ * options are put in front of the arguments of every line.
+ */
+int batch_main(int argc, char *argv[])
+{
+  std::string fnManifest, fnSummary;
+  int n_jobs = 1;
+  double mem_budget_gb = 0.0;
+  std::vector<std::string> common;
+  for(int iArg = 1; iArg < argc; iArg++)
+  {
+    if(!strcmp(argv[iArg], "-batch") && iArg + 1 < argc)
+      fnManifest = argv[++iArg];
+    else if(!strcmp(argv[iArg], "-jobs") && iArg + 1 < argc)
+      n_jobs = atoi(argv[++iArg]);
+    else if(!strcmp(argv[iArg], "-jobs-mem") && iArg + 1 < argc)
+      mem_budget_gb = atof(argv[++iArg]);
+    else if(!strcmp(argv[iArg], "-summary") && iArg + 1 < argc)
+      fnSummary = argv[++iArg];
+    else
+      common.push_back(argv[iArg]);
+  }
+
+  std::ifstream manifest(fnManifest);
+  if(!manifest)
+  {
+    cerr << "cannot read manifest " << fnManifest << endl;
+    return -1;
+  }
+
+  // Parse the lines, keeping the ones that are not valid as failed cases
+  std::vector<size_t> line_number;
+  std::vector<std::string> line_input, line_output;
+  std::vector<ImageGraphCutBatchResult> results;
+  std::vector<ImageGraphCutParameters> cases;
+  std::vector<size_t> case_line;
+  std::string line;
+  for(size_t iLine = 1; std::getline(manifest, line); iLine++)
+  {
+    std::istringstream iss(line);
+    std::vector<std::string> args(1, argv[0]);
+    args.insert(args.end(), common.begin(), common.end());
+    size_t n_common = args.size();
+    for(std::string arg; iss >> arg; )
+      args.push_back(arg);
+    if(args.size() == n_common || args[n_common][0] == '#')
+      continue;
+
+    std::vector<char *> line_argv;
+    for(auto &arg : args)
+      line_argv.push_back(&arg[0]);
+
+    ImageGraphCutParameters p;
+    std::string error;
+    ImageGraphCutBatchResult result;
+    if(parse_arguments((int) line_argv.size(), line_argv.data(), p, error))
+    {
+      case_line.push_back(results.size());
+      cases.push_back(p);
+    }
     else
     {
-      cerr << "unknown option!" << endl;
-      return usage();
+      result.message = error;
     }
+    line_number.push_back(iLine);
+    bool has_files = args.size() >= n_common + 3;
+    line_input.push_back(has_files ? args[args.size()-3] : "");
+    line_output.push_back(has_files ? args[args.size()-2] : "");
+    results.push_back(result);
   }
 
-  return image_graph_cut(p);
+  cout << "running " << cases.size() << " of " << results.size() << " lines of "
+       << fnManifest << " with " << n_jobs << " jobs" << endl;
+  std::vector<ImageGraphCutBatchResult> case_results = image_graph_cut_batch(cases, n_jobs, mem_budget_gb);
+  for(size_t i = 0; i < cases.size(); i++)
+    results[case_line[i]] = case_results[i];
+
+  // List the status of every line
+  std::ostringstream summary;
+  summary << "line\tstatus\tseconds\tinput\toutput\tmessage" << endl;
+  size_t n_failed = 0;
+  for(size_t i = 0; i < results.size(); i++)
+  {
+    n_failed += results[i].ok ? 0 : 1;
+    summary << line_number[i] << "\t" << (results[i].ok ? "ok" : "failed") << "\t"
+            << results[i].seconds << "\t" << line_input[i] << "\t" << line_output[i] << "\t"
+            << results[i].message << endl;
+  }
+
+  cout << endl << summary.str();
+  cout << results.size() - n_failed << " lines succeeded, " << n_failed << " failed" << endl;
+  if(fnSummary.size())
+  {
+    std::ofstream out(fnSummary);
+    out << summary.str();
+    if(!out)
+      cerr << "cannot write summary " << fnSummary << endl;
+  }
+
+  return n_failed ? -1 : 0;
+}
+
+int main(int argc, char *argv[])
+{
+  // Run a batch if a manifest is given
+  for(int iArg = 1; iArg < argc; iArg++)
+    if(!strcmp(argv[iArg], "-batch"))
+      return batch_main(argc, argv);
+
+  // Check arguments
+  if(argc < 4) return usage();
+
+  // Read the command line arguments
+  ImageGraphCutParameters p;
+  std::string error;
+  if(!parse_arguments(argc, argv, p, error))
+  {
+    cerr << error << endl;
+    return usage();
+  }
+
+  try
+  {
+    return image_graph_cut(p);
+  }
+  catch(std::exception &exc)
+  {
+    cerr << "image_graph_cut failed: " << exc.what() << endl;
+    return -1;
+  }
 }
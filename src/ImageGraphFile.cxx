@@ -0,0 +1,182 @@
+#include "ImageGraphFile.h"
+#include "MemoryMappedFile.h"
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <sstream>
+#include <stdexcept>
+
+namespace
+{
+
+const char GraphFileMagic[8] = { 'I', 'G', 'C', 'G', 'R', 'A', 'P', 'H' };
+const uint32_t GraphFileVersion = 1;
+
+/** Header at the start of a graph file */
+struct GraphFileHeader
+{
+  char Magic[8];
+  uint32_t Version;
+  uint32_t IndexSize;
+  uint64_t NumberOfComponents;
+  uint64_t Size[3];
+  double Spacing[3], Origin[3], Direction[9];
+};
+
+/** Entry of the table of components that follows the header. The offsets
+ * of the adjacency index, adjacency, vertex weight, edge weight and run
+ * arrays are in bytes from the start of the file. */
+struct GraphFileComponent
+{
+  uint64_t Voxels, FirstVoxel;
+  uint64_t Vertices, Edges, Runs;
+  uint64_t Offset[5];
+};
+
+static_assert(sizeof(VoxelRun) == 16, "Graph files store runs as two 64-bit offsets");
+
+size_t Align(size_t bytes)
+{
+  return (bytes + 63) & ~(size_t) 63;
+}
+
+}
+
+void WriteImageGraphFile(const std::string &filename, const ImageGraphGeometry &geometry,
+                         std::vector<ImageGraphComponent> &components)
+{
+  GraphFileHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.Magic, GraphFileMagic, sizeof(GraphFileMagic));
+  header.Version = GraphFileVersion;
+  header.IndexSize = sizeof(idx_t);
+  header.NumberOfComponents = components.size();
+  for(unsigned int d = 0; d < 3; d++)
+  {
+    header.Size[d] = geometry.Size[d];
+    header.Spacing[d] = geometry.Spacing[d];
+    header.Origin[d] = geometry.Origin[d];
+  }
+  memcpy(header.Direction, geometry.Direction, sizeof(header.Direction));
+
+  // Lay out the arrays. Components without vertices store no arrays.
+  std::vector<GraphFileComponent> table(components.size());
+  size_t offset = Align(sizeof(header) + table.size() * sizeof(GraphFileComponent));
+  for(size_t c = 0; c < components.size(); c++)
+  {
+    VoxelGraph<idx_t> &g = components[c].Graph;
+    GraphFileComponent &entry = table[c];
+    memset(&entry, 0, sizeof(entry));
+    entry.Voxels = components[c].Voxels;
+    entry.FirstVoxel = components[c].FirstVoxel;
+    if(g.GetNumberOfVertices() == 0)
+      continue;
+
+    entry.Vertices = g.GetNumberOfVertices();
+    entry.Edges = g.GetNumberOfEdges();
+    entry.Runs = g.GetNumberOfVertexRuns();
+    const size_t bytes[5] = {
+      (entry.Vertices + 1) * sizeof(idx_t), entry.Edges * sizeof(idx_t),
+      entry.Vertices * sizeof(idx_t), entry.Edges * sizeof(idx_t),
+      (entry.Runs + 1) * sizeof(VoxelRun) };
+    for(unsigned int k = 0; k < 5; k++)
+    {
+      entry.Offset[k] = offset;
+      offset = Align(offset + bytes[k]);
+    }
+  }
+
+  std::ofstream out(filename, std::ios::binary);
+  if(!out)
+    throw std::runtime_error("Cannot create graph file " + filename);
+
+  size_t pos = 0;
+  auto write = [&](const void *data, size_t bytes, size_t at) {
+    static const char zeros[64] = { 0 };
+    for(; pos < at; pos += std::min<size_t>(at - pos, sizeof(zeros)))
+      out.write(zeros, std::min<size_t>(at - pos, sizeof(zeros)));
+    out.write((const char *) data, bytes);
+    pos += bytes;
+  };
+
+  write(&header, sizeof(header), 0);
+  write(table.data(), table.size() * sizeof(GraphFileComponent), sizeof(header));
+  for(size_t c = 0; c < components.size(); c++)
+  {
+    VoxelGraph<idx_t> &g = components[c].Graph;
+    const GraphFileComponent &entry = table[c];
+    if(entry.Vertices == 0)
+      continue;
+    write(g.GetAdjacencyIndex(), (entry.Vertices + 1) * sizeof(idx_t), entry.Offset[0]);
+    write(g.GetAdjacency(), entry.Edges * sizeof(idx_t), entry.Offset[1]);
+    write(g.GetVertexWeights(), entry.Vertices * sizeof(idx_t), entry.Offset[2]);
+    write(g.GetEdgeWeights(), entry.Edges * sizeof(idx_t), entry.Offset[3]);
+    write(g.GetVertexRuns(), (entry.Runs + 1) * sizeof(VoxelRun), entry.Offset[4]);
+  }
+
+  if(!out.flush())
+    throw std::runtime_error("Cannot write graph file " + filename);
+}
+
+void ReadImageGraphFile(const std::string &filename, ImageGraphGeometry &geometry,
+                        std::vector<ImageGraphComponent> &components)
+{
+  auto file = std::make_shared<MemoryMappedFile>();
+  file->Open(filename);
+  char *base = file->GetPointer();
+
+  GraphFileHeader header;
+  if(file->GetSize() < sizeof(header) || memcmp(base, GraphFileMagic, sizeof(GraphFileMagic)))
+    throw std::runtime_error(filename + " is not a graph file");
+  memcpy(&header, base, sizeof(header));
+  if(header.Version != GraphFileVersion)
+    throw std::runtime_error(filename + " has an unsupported graph file version");
+  if(header.IndexSize != sizeof(idx_t))
+  {
+    std::ostringstream oss;
+    oss << filename << " was written with " << 8 * header.IndexSize << "-bit graph indices, but METIS uses "
+        << 8 * sizeof(idx_t) << "-bit indices";
+    throw std::runtime_error(oss.str());
+  }
+
+  for(unsigned int d = 0; d < 3; d++)
+  {
+    geometry.Size[d] = header.Size[d];
+    geometry.Spacing[d] = header.Spacing[d];
+    geometry.Origin[d] = header.Origin[d];
+  }
+  memcpy(geometry.Direction, header.Direction, sizeof(header.Direction));
+
+  size_t table_end = sizeof(header) + header.NumberOfComponents * sizeof(GraphFileComponent);
+  if(file->GetSize() < table_end)
+    throw std::runtime_error("Graph file " + filename + " is truncated");
+  const GraphFileComponent *table = (const GraphFileComponent *) (base + sizeof(header));
+
+  components.clear();
+  components.resize(header.NumberOfComponents);
+  for(size_t c = 0; c < components.size(); c++)
+  {
+    const GraphFileComponent &entry = table[c];
+    components[c].Voxels = entry.Voxels;
+    components[c].FirstVoxel = entry.FirstVoxel;
+    if(entry.Vertices == 0)
+      continue;
+
+    if(entry.Offset[4] + (entry.Runs + 1) * sizeof(VoxelRun) > file->GetSize())
+      throw std::runtime_error("Graph file " + filename + " is truncated");
+
+    components[c].Graph.SetArrays(
+      entry.Vertices, entry.Edges, entry.Runs,
+      (idx_t *) (base + entry.Offset[0]), (idx_t *) (base + entry.Offset[1]),
+      (idx_t *) (base + entry.Offset[2]), (idx_t *) (base + entry.Offset[3]),
+      (VoxelRun *) (base + entry.Offset[4]), file);
+  }
+}
+
+bool IsImageGraphFile(const std::string &filename)
+{
+  char magic[sizeof(GraphFileMagic)];
+  std::ifstream in(filename, std::ios::binary);
+  return in.read(magic, sizeof(magic)) && !memcmp(magic, GraphFileMagic, sizeof(magic));
+}
@@ -0,0 +1,62 @@
+#ifndef __ImageGraphFile_h_
+#define __ImageGraphFile_h_
+
+#include <cstddef>
+#include <string>
+#include <vector>
+#include <metis.h>
+#include "VoxelGraph.h"
+
+/* ***************************************************************************
+ * GRAPH FILES
+ *
+ * A graph file stores everything that image_graph_cut computes before it
+ * calls METIS: the geometry of the image, and the size and voxel graph of
+ * each of its largest connected components. Partitioning a graph file skips
+ * reading the image, labeling the components and building the graphs. The
+ * arrays are stored in native byte order, aligned so that the graphs can be
+ * used straight from a memory-mapped copy of the file.
+ * *************************************************************************** */
+
+/** Geometry of the image that a graph file was built from */
+struct ImageGraphGeometry
+{
+  size_t Size[3];
+  double Spacing[3], Origin[3], Direction[9];
+};
+
+/** A connected component stored in a graph file */
+struct ImageGraphComponent
+{
+  /** Number of voxels of the component */
+  size_t Voxels = 0;
+
+  /** Offset of the first voxel of the component in raster order, which is
+   * its only voxel when the graph is empty */
+  size_t FirstVoxel = 0;
+
+  /** Graph of the voxels of the component */
+  VoxelGraph<idx_t> Graph;
+};
+
+/**
+ * Write a graph file. The components are listed by decreasing size, so that
+ * component c has label c + 1 as in RelabelComponentImageFilter. Throws
+ * std::runtime_error if the file cannot be written.
+ */
+void WriteImageGraphFile(const std::string &filename, const ImageGraphGeometry &geometry,
+                         std::vector<ImageGraphComponent> &components);
+
+/**
+ * Map a graph file into memory. The graphs of the components use the mapped
+ * arrays, which are copy-on-write and stay mapped for as long as any graph
+ * refers to them. Throws std::runtime_error if the file is not a graph file
+ * or was written with a different METIS index width.
+ */
+void ReadImageGraphFile(const std::string &filename, ImageGraphGeometry &geometry,
+                        std::vector<ImageGraphComponent> &components);
+
+/** Check whether a file starts like a graph file */
+bool IsImageGraphFile(const std::string &filename);
+
+#endif // __ImageGraphFile_h_
@@ -2,6 +2,7 @@
  * Convert image to a graph of boundary pixels. Requires selecting pixel corners 
  * that are not surrounded by eight pixels of the same intensity
  */
+#include "VoxelGraph.h"
 #include <itkImage.h>
 #include <itkImageFileReader.h>
 #include <itkImageRegionConstIterator.h>
@@ -9,6 +10,8 @@
 #include <itkNeighborhoodIterator.h>
 #include <itkConnectedComponentImageFilter.h>
 #include <itkRelabelComponentImageFilter.h>
+#include <cstdlib>
+#include <cstring>
 #include <iostream>
 #include <fstream>
 #include <vector>
@@ -19,7 +22,8 @@ using namespace itk;
 
 int usage()
 {
-  cerr << "Usage: gcut_makepts input.img out.txt" << endl;
+  cerr << "Usage: gcut_makepts [-conn 6|18|26] input.img out.txt" << endl;
+  cerr << "   -conn N    Neighborhood of the connected components (default: 26)" << endl;
   return -1;
 }
 
@@ -32,6 +36,18 @@ int main(int argc, char *argv[])
   char *input = argv[argc-2];
   char *output = argv[argc-1];
 
+  // Read the options
+  unsigned int connectivity = 26;
+  for(int iArg = 1; iArg < argc - 2; iArg++)
+    {
+    if(!strcmp(argv[iArg], "-conn") && iArg + 1 < argc - 2)
+      connectivity = atoi(argv[++iArg]);
+    else
+      return usage();
+    }
+  if(connectivity != 6 && connectivity != 18 && connectivity != 26)
+    return usage();
+
   cerr << "Processing " << input << " and " << output << endl;
   
   if(!input || !output)
@@ -60,17 +76,33 @@ int main(int argc, char *argv[])
   // Report the size
   cout << "There are " << nVertices << " non-zero voxels in the image " << endl;
 
-  // Compute the connected components
-  typedef ConnectedComponentImageFilter<ImageType,ShortImageType> CCFilter;
-  CCFilter::Pointer fltConComp = CCFilter::New();
-  fltConComp->SetInput(imgBinary);
-  fltConComp->SetFullyConnected(true);
-  fltConComp->Update();
+  // Compute the connected components. ITK handles the 6 and 26 neighborhoods,
+  // and the 18-neighborhood is labeled like in image_graph_cut
+  ShortImageType::Pointer imgComp;
+  if(connectivity == 18)
+    {
+    const ImageType::RegionType &region = imgBinary->GetBufferedRegion();
+    const size_t size[3] = { region.GetSize(0), region.GetSize(1), region.GetSize(2) };
+    imgComp = ShortImageType::New();
+    imgComp->CopyInformation(imgBinary);
+    imgComp->SetRegions(region);
+    imgComp->Allocate();
+    LabelVoxelComponents18(imgBinary->GetBufferPointer(), size, imgComp->GetBufferPointer());
+    }
+  else
+    {
+    typedef ConnectedComponentImageFilter<ImageType,ShortImageType> CCFilter;
+    CCFilter::Pointer fltConComp = CCFilter::New();
+    fltConComp->SetInput(imgBinary);
+    fltConComp->SetFullyConnected(connectivity == 26);
+    fltConComp->Update();
+    imgComp = fltConComp->GetOutput();
+    }
 
   // Relabel the components
   typedef RelabelComponentImageFilter<ShortImageType,ShortImageType> RCFilter;
   RCFilter::Pointer fltRelabel = RCFilter::New();
-  fltRelabel->SetInput(fltConComp->GetOutput());
+  fltRelabel->SetInput(imgComp);
   fltRelabel->Update();
 
   // Print the statistics about the connected components
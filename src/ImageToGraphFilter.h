@@ -2,8 +2,13 @@
 #define __ImageToGraphFilter_h_
 
 #include <itkImage.h>
-#include <itkConstantBoundaryCondition.h>
-#include <itkConstNeighborhoodIterator.h>
+#include <itkMultiThreaderBase.h>
+#include "VoxelGraph.h"
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <type_traits>
+#include <vector>
 
 /* ***************************************************************************
  * FUNCTOR DEFINITIONS
@@ -23,6 +28,9 @@ public:
   typedef typename TImage::PixelType TPixel;
   typedef itk::Point<float, ImageDimension> Point;
 
+  /** The filter always passes physical coordinates to virtual functors */
+  static constexpr bool NeedsPhysicalPoint = true;
+
   /** Return true if the vertex should be included in the graph */
   virtual bool IsPixelAVertex( TPixel i, Point x )
     { return IsPixelAVertex(i); }
@@ -76,6 +84,121 @@ protected:
 };
 
 
+/**
+ * This is the base class for functors that are bound to ImageToGraphFilter
+ * at compile time, using the curiously recurring template pattern. Unlike 
+ * AbstractGraphWeightFunctor, there are no virtual calls: the derived class
+ * implements the public non-virtual methods
+ *
+ *   bool IsPixelAVertex(TPixel i)
+ *   TWeight GetEdgeWeight(TPixel i1, TPixel i2)
+ *   TWeight GetVertexWeight(TPixel i)
+ *
+ * and the filter inlines them. Functors that need the physical position of
+ * the pixels set NeedsPhysicalPoint to true and implement the overloads that
+ * take points instead, as in AbstractGraphWeightFunctor. Otherwise, the
+ * filter never computes the physical position of a pixel.
+ */
+template <class TDerived, class TImage, class TWeight = int>
+class StaticGraphWeightFunctor
+{
+public:
+  /** Image dimension. */
+  itkStaticConstMacro(ImageDimension, unsigned int, TImage::ImageDimension);
+
+  typedef typename TImage::PixelType TPixel;
+  typedef itk::Point<float, ImageDimension> Point;
+
+  /** Whether the filter should compute the physical position of pixels */
+  static constexpr bool NeedsPhysicalPoint = false;
+};
+
+/**
+ * Compile-time version of BinaryGraphWeightFunctor: pixels with non-zero 
+ * intensities are vertices, and edges and vertices have unit weights
+ */
+template <class TImage, class TWeight = int>
+class StaticBinaryGraphWeightFunctor
+: public StaticGraphWeightFunctor<StaticBinaryGraphWeightFunctor<TImage, TWeight>, TImage, TWeight>
+{
+public:
+  typedef typename TImage::PixelType TPixel;
+
+  bool IsPixelAVertex(TPixel i) const
+    { return (i != 0); }
+
+  TWeight GetEdgeWeight(TPixel, TPixel) const
+    { return 1; }
+
+  TWeight GetVertexWeight(TPixel) const
+    { return 1; }
+};
+
+
+/**
+ * Edge weights computed from the difference d of the intensities of two
+ * neighboring pixels in a companion image, e.g., a grayscale image aligned
+ * with the mask, so that cuts prefer weak boundaries. The weight is
+ * Scale * f(d / Sigma), rounded and at least one, where f(x) is exp(-x^2)
+ * (Gaussian), exp(-|x|) (Exponential) or 1 / (1 + |x|) (Inverse). The
+ * weights are tabulated for differences in steps of Sigma / 256, so that the
+ * weights of a scanline are computed by two branch-free loops that the
+ * compiler vectorizes, one binning the differences and one looking them up.
+ */
+template <class TWeight = int>
+class IntensityEdgeWeightKernel
+{
+public:
+  enum FunctionType { Gaussian, Exponential, Inverse };
+
+  /** Tabulate the weights of a function, for a positive sigma and scale */
+  void Initialize(FunctionType function, double sigma, double scale)
+    {
+    const unsigned int binsPerSigma = 256, maxBins = 1u << 16;
+    m_InverseStep = (float) (binsPerSigma / sigma);
+    m_Table.clear();
+    for(unsigned int b = 0; b < maxBins; b++)
+      {
+      double x = (b + 0.5) / binsPerSigma, f;
+      switch(function)
+        {
+        case Gaussian: f = std::exp(-x * x); break;
+        case Exponential: f = std::exp(-x); break;
+        default: f = 1.0 / (1.0 + x); break;
+        }
+      TWeight w = (TWeight) std::max(1.0, std::floor(scale * f + 0.5));
+      m_Table.push_back(w);
+
+      // The functions decrease, so the rest of the table would be ones
+      if(w == 1)
+        break;
+      }
+    m_LastBin = (float) (m_Table.size() - 1);
+    }
+
+  /** Whether the weights have been tabulated */
+  bool IsInitialized() const { return m_Table.size() > 0; }
+
+  /** The largest weight, which is that of equal intensities */
+  TWeight GetMaximumWeight() const { return m_Table.size() ? m_Table.front() : 1; }
+
+  /** Compute the weights w[i] of the differences of a[i] and b[i] */
+  void ComputeWeights(const float *a, const float *b, size_t n, TWeight *w) const
+    {
+    // NaN differences go to the last bin, since std::min returns its first
+    // argument when the comparison fails
+    for(size_t i = 0; i < n; i++)
+      w[i] = (TWeight) std::min(m_LastBin, std::abs(a[i] - b[i]) * m_InverseStep);
+    for(size_t i = 0; i < n; i++)
+      w[i] = m_Table[w[i]];
+    }
+
+protected:
+  std::vector<TWeight> m_Table;
+  float m_InverseStep = 0.0f, m_LastBin = 0.0f;
+};
+
+
 /* ***************************************************************************
  * MAIN CLASS DEFINITION
  * *************************************************************************** */
@@ -91,9 +214,23 @@ protected:
  *
  * The user can specify a functor derived from AbstractGraphWeightFunctor
  * that will be used to compute the weights of the edges and vertices
- * in the graph.
+ * in the graph. Alternatively, the functor type can be passed as the
+ * TWeightFunctor template parameter, in which case it should derive from
+ * StaticGraphWeightFunctor and its methods are called without virtual
+ * dispatch. The edge weights can further be scaled by the intensity
+ * differences in a companion image, see SetEdgeWeightImage().
+ *
+ * By default, each voxel is linked to its 6 face neighbors. With
+ * SetConnectivity(), the edge and corner neighbors can be linked as well,
+ * and the edge weights are then scaled by GetVoxelNeighborWeight().
+ *
+ * The graph is built in a single sweep over the pixel buffer, one slice
+ * at a time. Only three slices worth of vertex flags and vertex numbers
+ * are kept in memory, so no full-size index image is needed. Optionally,
+ * slabs of slices are counted and filled concurrently.
  */
-template<class TImage, class TVertex = int, class TWeight = int> 
+template<class TImage, class TVertex = int, class TWeight = int,
+         class TWeightFunctor = AbstractGraphWeightFunctor<TImage, TWeight> >
 class ImageToGraphFilter : public itk::ProcessObject
 {
 public:
@@ -103,8 +240,18 @@ public:
   typedef itk::SmartPointer<const Self> ConstPointer;
   typedef TImage ImageType;
   typedef typename TImage::IndexType IndexType;
+  typedef typename TImage::PixelType PixelType;
   typedef TVertex VertexType;
-  typedef AbstractGraphWeightFunctor<TImage, TWeight> WeightFunctorType;
+  typedef TWeight WeightType;
+  typedef TWeightFunctor WeightFunctorType;
+  typedef itk::Image<float, TImage::ImageDimension> EdgeWeightImageType;
+  typedef IntensityEdgeWeightKernel<TWeight> EdgeWeightKernelType;
+
+  /** The functor used when none is set: the binary functor for the virtual
+   * interface, or a default-constructed instance of a static functor */
+  typedef typename std::conditional<
+    std::is_abstract<TWeightFunctor>::value,
+    BinaryGraphWeightFunctor<TImage, TWeight>, TWeightFunctor>::type DefaultWeightFunctorType;
 
   /** Method for creation through the object factory. */
   itkNewMacro(Self);
@@ -115,22 +262,13 @@ public:
   /** Constructor */
   ImageToGraphFilter()
     {
-    m_Adjacency = NULL;
-    m_AdjacencyIndex = NULL;
-    m_ImageIndex = NULL;
-    m_VertexWeights = NULL;
-    m_EdgeWeights = NULL;
-
     m_NumberOfVertices = 0;
     m_NumberOfEdges = 0;
     m_SpareEdges = m_SpareVertices = 0;
     m_WeightFunctor = &m_DefaultWeightFunctor;
-    }
-
-  /** Destructor */
-  ~ImageToGraphFilter()
-    {
-    CleanUpGraphArrays();
+    m_EdgeWeightKernel = nullptr;
+    m_ParallelBuild = false;
+    m_Connectivity = 6;
     }
 
   /** Set the input */
@@ -153,232 +291,661 @@ public:
   void SetWeightFunctor(WeightFunctorType *in_Functor)
     { m_WeightFunctor = in_Functor; }
 
+  /**
+   * Multiply the weight of every edge by the weight that a kernel assigns to
+   * the difference of the intensities of its pixels in a companion image,
+   * which must have the buffered region of the input. The weights of each
+   * scanline are computed at once, as the adjacency lists are filled. Pass
+   * a null image to go back to the weights of the functor alone.
+   */
+  void SetEdgeWeightImage(const EdgeWeightImageType *image, const EdgeWeightKernelType *kernel)
+    { m_EdgeWeightImage = image; m_EdgeWeightKernel = kernel; }
+
+  /**
+   * Make cuts along a plane cheap, by multiplying the weights of the edges
+   * that do not cross it by its strength as the adjacency lists are filled
+   */
+  void SetCutPlane(const VoxelCutPlane &plane) { m_CutPlane = plane; }
+  const VoxelCutPlane &GetCutPlane() const { return m_CutPlane; }
+
+  /**
+   * Set the neighborhood of the voxels that are linked by edges: 6 (faces),
+   * 18 (faces and edges) or 26 (faces, edges and corners). Defaults to 6.
+   */
+  void SetConnectivity(unsigned int connectivity)
+    {
+    CheckVoxelConnectivity(connectivity);
+    if(m_Connectivity != connectivity)
+      {
+      m_Connectivity = connectivity;
+      this->Modified();
+      }
+    }
+  itkGetMacro(Connectivity, unsigned int);
+
+  /** 
+   * Build the graph in parallel, splitting the image into slabs along the
+   * last dimension. The number of slabs is the number of work units of the
+   * filter, which follows the usual ITK threading controls. The graph is
+   * identical to the one built serially, but the weight functor must be 
+   * safe to call from several threads. Off by default.
+   */
+  itkSetMacro(ParallelBuild, bool);
+  itkGetMacro(ParallelBuild, bool);
+  itkBooleanMacro(ParallelBuild);
+
   /** Update method (why?) */
   void Update() override { this->GenerateData(); }
 
   /** Get the adjacency index */
-  itkGetMacro( AdjacencyIndex, VertexType * );
+  VertexType *GetAdjacencyIndex() { return m_AdjacencyIndex.data(); }
 
   /** Get the adjacency index */
-  itkGetMacro( Adjacency, VertexType * );
+  VertexType *GetAdjacency() { return m_Adjacency.data(); }
 
   /** Get the array of vertex weights */
-  itkGetMacro( VertexWeights, TWeight * );
+  TWeight *GetVertexWeights() { return m_VertexWeights.data(); }
 
   /** Get the array of edge weights */
-  itkGetMacro( EdgeWeights, TWeight * );
+  TWeight *GetEdgeWeights() { return m_EdgeWeights.data(); }
 
   /** Get the number of vertices */
-  itkGetMacro( NumberOfVertices, unsigned int );
+  itkGetMacro( NumberOfVertices, size_t );
 
   /** Get the number of directional edges (2x symmetric edges) */
-  itkGetMacro( NumberOfEdges, unsigned int );
+  itkGetMacro( NumberOfEdges, size_t );
+
+  /** 
+   * Move the graph into a VoxelGraph, which then owns the arrays. The spare
+   * vertices and edges are dropped, and the filter is left empty.
+   */
+  void TransferGraph(VoxelGraph<VertexType, WeightType> &graph)
+    {
+    m_AdjacencyIndex.resize(m_NumberOfVertices + 1);
+    m_VertexWeights.resize(m_NumberOfVertices);
+    m_Adjacency.resize(m_NumberOfEdges);
+    m_EdgeWeights.resize(m_NumberOfEdges);
+    graph.Assign(std::move(m_AdjacencyIndex), std::move(m_Adjacency),
+                 std::move(m_VertexWeights), std::move(m_EdgeWeights),
+                 std::move(m_VertexRuns));
+    m_AdjacencyIndex.clear();
+    m_Adjacency.clear();
+    m_VertexWeights.clear();
+    m_EdgeWeights.clear();
+    m_VertexRuns.clear();
+    m_NumberOfVertices = m_NumberOfEdges = 0;
+    }
 
   /** Get number of vertex's adjacencies */
-  unsigned int GetVertexNumberOfNeighbors(unsigned int iVertex)
+  size_t GetVertexNumberOfNeighbors(size_t iVertex)
     {
     return m_AdjacencyIndex[iVertex+1] - m_AdjacencyIndex[iVertex];
     }
   
   /** Get the adjacency list for a vertex */
-  VertexType *GetVertexNeighbors(unsigned int iVertex)
+  VertexType *GetVertexNeighbors(size_t iVertex)
     {
-    return m_Adjacency + m_AdjacencyIndex[iVertex];
+    return m_Adjacency.data() + m_AdjacencyIndex[iVertex];
+    }
+
+  /** Runs of vertices that map the graph back to the input image buffer */
+  typedef VoxelRun VertexRun;
+
+  /** Get the number of vertex runs, not counting the sentinel */
+  size_t GetNumberOfVertexRuns() { return m_VertexRuns.size() - 1; }
+
+  /** Get the table of vertex runs, followed by the sentinel */
+  const VertexRun *GetVertexRuns() { return m_VertexRuns.data(); }
+
+  /** Get the offset in the input image buffer of the pixel of a vertex */
+  size_t GetVertexBufferOffset(size_t iVertex)
+    {
+    // Find the last run that starts at or before the vertex
+    auto it = std::upper_bound(
+      m_VertexRuns.begin(), m_VertexRuns.end() - 1, iVertex,
+      [](size_t v, const VertexRun &run) { return v < run.FirstVertex; });
+    --it;
+    return it->BufferOffset + (iVertex - it->FirstVertex);
     }
 
   /** Get the image index associated with a vertex */
-  IndexType GetVertexImageIndex(unsigned int iVertex) 
+  IndexType GetVertexImageIndex(size_t iVertex) 
     {
-    return m_ImageIndex[iVertex];
+    size_t offset = GetVertexBufferOffset(iVertex);
+    IndexType idx = m_BufferedRegion.GetIndex();
+    for(unsigned int d = 0; d < ImageDimension; d++)
+      {
+      idx[d] += offset % m_BufferedRegion.GetSize(d);
+      offset /= m_BufferedRegion.GetSize(d);
+      }
+    return idx;
     }
   
   /** Generate data */
   void GenerateData() override
     {
-    // Get the image
-    typename ImageType::ConstPointer image =
-      reinterpret_cast<ImageType *>(this->GetInput(0));
-    
-    // Initialize the iterator
-    itk::Size<ImageDimension> radius;
-    radius.Fill(1);
-    NeighborhoodIterator it(radius, image, image->GetBufferedRegion());
-
-    // The vector of neighboring pixels
-    unsigned int iCenter = it.Size() >> 1;
-    unsigned int iIndex[ImageDimension * 2];
-    for(unsigned int iDim=0;iDim<ImageDimension;iDim++)
+    // Get the image and describe its buffer
+    const ImageType *image = static_cast<const ImageType *>(this->GetInput(0));
+    ScanlineGeometry g = ComputeScanlineGeometry(image);
+    const long nz = (long) g.Size[2];
+    m_BufferedRegion = image->GetBufferedRegion();
+    if(m_EdgeWeightImage && m_EdgeWeightImage->GetBufferedRegion() != m_BufferedRegion)
       {
-      iIndex[iDim << 1] = iCenter - it.GetStride(iDim);
-      iIndex[(iDim << 1) + 1] = iCenter + it.GetStride(iDim);
+      itkExceptionMacro(<< "The edge weight image does not match the input image region");
+      }
+    if(m_CutPlane.Dimension >= (int) ImageDimension || m_CutPlane.Strength < 1)
+      {
+      itkExceptionMacro(<< "Invalid cut plane in dimension " << m_CutPlane.Dimension
+                        << " with strength " << m_CutPlane.Strength);
       }
 
-    // Create an image that maps connected pixels to graph index
-    typedef itk::Image<int, ImageDimension> IndexImage;
-    typename IndexImage::Pointer imgIndex = IndexImage::New();
-    imgIndex->SetRegions(image->GetBufferedRegion());
-    imgIndex->Allocate();
-    imgIndex->FillBuffer(-1);
-
-    // We will count edges and vertices
-    m_NumberOfVertices = 0;
-    m_NumberOfEdges = 0;
+    // Clear the arrays, keeping their storage for reuse
+    m_AdjacencyIndex.clear();
+    m_Adjacency.clear();
+    m_VertexRuns.clear();
+    m_VertexWeights.clear();
+    m_EdgeWeights.clear();
 
-    // Continue until iterator finishes
-    while(!it.IsAtEnd())
+    unsigned int nSlabs = (unsigned int) std::min<long>(this->GetNumberOfWorkUnits(), nz);
+    if(m_ParallelBuild && nSlabs > 1)
       {
-      // Only consider the vertex if it has non-zero weight
-      if(IsPixelAVertex(it, iCenter)) 
+      // Split the image into slabs of whole slices, one per work unit
+      std::vector<long> slab(nSlabs + 1);
+      for(unsigned int i = 0; i <= nSlabs; i++)
+        slab[i] = i * nz / nSlabs;
+
+      // The threader is shared with the pipeline, so its settings are left
+      // alone; ParallelizeArray visits every slab whatever its work units
+      itk::MultiThreaderBase *mt = this->GetMultiThreader();
+
+      // Count the vertices, edges and vertex runs in every slice
+      std::vector<SliceCount> count(nz);
+      mt->ParallelizeArray(0, nSlabs, [&](itk::SizeValueType i) {
+        CountSlab(g, slab[i], slab[i+1], count.data());
+      }, nullptr);
+
+      // The prefix sums give the first vertex, edge and run of every slice
+      std::vector<SliceCount> first(nz + 1);
+      for(long z = 0; z < nz; z++)
         {
-        // See if any of the pixel's neighbors qualify
-        unsigned int nNeighbors = 0;
-        for(unsigned int i=0;i<(ImageDimension << 1);i++)
-          {
-          // If the neighbor has a positive weight, increment the number of nbrs
-          if(IsPixelAVertex(it, iIndex[i])) 
-            ++nNeighbors;
-          }
-
-        if(nNeighbors > 0)
-          {
-          m_NumberOfEdges += nNeighbors;
-          imgIndex->SetPixel(it.GetIndex(iCenter), m_NumberOfVertices);
-          m_NumberOfVertices++;
-          }
+        first[z+1].Vertices = first[z].Vertices + count[z].Vertices;
+        first[z+1].Edges = first[z].Edges + count[z].Edges;
+        first[z+1].Runs = first[z].Runs + count[z].Runs;
         }
-      ++it;
+      CheckGraphSize(first[nz].Edges);
+
+      // Allocate the arrays and fill the slabs concurrently
+      m_AdjacencyIndex.resize(first[nz].Vertices);
+      m_VertexWeights.resize(first[nz].Vertices);
+      m_VertexRuns.resize(first[nz].Runs);
+      m_Adjacency.resize(first[nz].Edges);
+      m_EdgeWeights.resize(first[nz].Edges);
+      mt->ParallelizeArray(0, nSlabs, [&](itk::SizeValueType i) {
+        long z0 = slab[i];
+        SliceCount start = first[z0];
+        start.Vertices = z0 > 0 ? first[z0-1].Vertices : 0;
+        FillSlab(g, z0, slab[i+1], start, false);
+      }, nullptr);
       }
-
-    // Clear the arrays if needed
-    CleanUpGraphArrays();
-      
-    // Allocate the arrays 
-    m_AdjacencyIndex = new VertexType[m_NumberOfVertices + m_SpareVertices + 1];
-    m_Adjacency = new VertexType[m_NumberOfEdges + m_SpareEdges];
-    m_ImageIndex = new IndexType[m_NumberOfVertices];
-    m_VertexWeights = new TWeight[m_NumberOfVertices + m_SpareVertices];
-    m_EdgeWeights = new TWeight[m_NumberOfEdges + m_SpareEdges];
-
-    // Now, create the adjacency structure
-    it.GoToBegin();
-    unsigned int iVertex = 0, iEdge = 0;
-    while(!it.IsAtEnd())
+    else
       {
-      int offset = imgIndex->GetPixel(it.GetIndex(iCenter));
-      if(offset >= 0)
-        {
-        // Pixel should be included
-        m_ImageIndex[iVertex] = it.GetIndex(iCenter);
-        m_AdjacencyIndex[iVertex] = iEdge;
-
-        // Compute the weight of the vertex 
-        m_VertexWeights[iVertex++] = GetVertexWeight(it, iCenter);
-
-        // Add all the edges of the pixel 
-        for(unsigned int i=0;i<(ImageDimension << 1);i++)
-          {
-          IndexType indNbr = it.GetIndex(iIndex[i]);
-          if(!imgIndex->GetBufferedRegion().IsInside(indNbr)) continue;
-          int idxNbr = imgIndex->GetPixel(indNbr);
-          if(idxNbr >= 0)
-            {
-            // Add the edge to the adjacency list
-            m_Adjacency[iEdge] = idxNbr;
-
-            // Compute the weight of the edge
-            m_EdgeWeights[iEdge++] = GetEdgeWeight(it, iCenter, iIndex[i]);
-            }
-          }
-        }
-      ++it;
+      // Single sweep over the image, growing the arrays as we go
+      FillSlab(g, 0, nz, SliceCount(), true);
       }
 
-    // Complete xAdjIndex
-    m_AdjacencyIndex[iVertex] = iEdge;
+    size_t nVertices = m_VertexWeights.size(), nEdges = m_Adjacency.size();
+    m_NumberOfVertices = nVertices;
+    m_NumberOfEdges = nEdges;
+
+    // Allocate the spare vertices and edges and complete xAdjIndex
+    m_AdjacencyIndex.resize(nVertices + m_SpareVertices + 1);
+    m_AdjacencyIndex[nVertices] = nEdges;
+    m_VertexRuns.push_back(VertexRun { g.SliceStride * g.Size[2], nVertices });
+    m_VertexWeights.resize(nVertices + m_SpareVertices);
+    m_Adjacency.resize(nEdges + m_SpareEdges);
+    m_EdgeWeights.resize(nEdges + m_SpareEdges);
     }
 
 protected:
 
   /** Mapping from vertices to indices in the adjacency array */
-  VertexType *m_AdjacencyIndex;
+  std::vector<VertexType> m_AdjacencyIndex;
 
   /** List of adjacencies indexed by the above array */
-  VertexType *m_Adjacency;
+  std::vector<VertexType> m_Adjacency;
+
+  /** Mapping from vertices to input image pixels, as runs of vertices */
+  std::vector<VertexRun> m_VertexRuns;
 
-  /** Mapping from vertices to input image indices */
-  IndexType *m_ImageIndex;
+  /** Buffered region of the input image, which the runs refer to */
+  typename ImageType::RegionType m_BufferedRegion;
 
   /** List of weights associated with each vertex */
-  TWeight *m_VertexWeights;
+  std::vector<TWeight> m_VertexWeights;
 
   /** List of weights associated with each adjacency (directed edge) */
-  TWeight *m_EdgeWeights;
+  std::vector<TWeight> m_EdgeWeights;
   
   /** A table that determines the weights for edges and vertices */
   WeightFunctorType *m_WeightFunctor;
 
   /** The default weight table */
-  BinaryGraphWeightFunctor<TImage, TWeight> m_DefaultWeightFunctor;
+  DefaultWeightFunctorType m_DefaultWeightFunctor;
+
+  /** Companion image whose intensity differences scale the edge weights */
+  typename EdgeWeightImageType::ConstPointer m_EdgeWeightImage;
+  const EdgeWeightKernelType *m_EdgeWeightKernel;
+
+  /** Plane along which cuts are cheap */
+  VoxelCutPlane m_CutPlane;
+
+  /** Number of neighbors linked to each voxel */
+  unsigned int m_Connectivity;
 
   /** The number of directed edges (2x undirected). These do not include 
    the spare vertices and edges */
-  unsigned int m_NumberOfVertices, m_NumberOfEdges;
+  size_t m_NumberOfVertices, m_NumberOfEdges;
 
   /** Spare edges and vertices */
   unsigned int m_SpareVertices, m_SpareEdges;
 
-  // Neighborhood iterator typedefs
-  typedef typename itk::ConstantBoundaryCondition<ImageType> ConditionType;
-  typedef typename itk::ConstNeighborhoodIterator<ImageType, ConditionType> 
-    NeighborhoodIterator;
+  /** Whether slabs of the image are processed concurrently */
+  bool m_ParallelBuild;
+
+  /** Vertex number assigned to pixels that are not in the graph */
+  static constexpr VertexType NoVertex = static_cast<VertexType>(-1);
+
+  /** 
+   * Layout of the pixel buffer as seen by the scanline builder. The slices
+   * of vertex flags and vertex numbers are padded by one pixel on each side
+   * in x and y, so the in-slice neighbors of a pixel are always at offsets 
+   * -1, +1, -PaddedRowStride and +PaddedRowStride, with no bounds checks.
+   * PaddedOffset and PixelOffset hold the offsets of the neighbors in
+   * VoxelNeighborOffsets within a padded slice and within the buffer.
+   */
+  struct ScanlineGeometry
+    {
+    const ImageType *Image;
+    const PixelType *Buffer;
+    IndexType Origin;
+    size_t Size[3];
+    size_t SliceStride;
+    size_t PaddedRowStride;
+    size_t PaddedSliceSize;
+    long PaddedOffset[26];
+    long PixelOffset[26];
+    };
+
+  ScanlineGeometry ComputeScanlineGeometry(const ImageType *image)
+    {
+    static_assert(ImageDimension >= 2 && ImageDimension <= 3,
+                  "ImageToGraphFilter supports 2D and 3D images");
+
+    ScanlineGeometry g;
+    g.Image = image;
+    g.Buffer = image->GetBufferPointer();
+    g.Origin = image->GetBufferedRegion().GetIndex();
+    for(unsigned int d = 0; d < 3; d++)
+      g.Size[d] = d < ImageDimension ? image->GetBufferedRegion().GetSize(d) : 1;
+    g.SliceStride = g.Size[0] * g.Size[1];
+    g.PaddedRowStride = g.Size[0] + 2;
+    g.PaddedSliceSize = g.PaddedRowStride * (g.Size[1] + 2);
+    for(unsigned int k = 0; k < 26; k++)
+      {
+      const int *o = VoxelNeighborOffsets[k];
+      g.PaddedOffset[k] = o[0] + o[1] * (long) g.PaddedRowStride;
+      g.PixelOffset[k] = o[0] + o[1] * (long) g.Size[0] + o[2] * (long) g.SliceStride;
+      }
+    return g;
+    }
+
+  /** Compute the image index of the pixel at a position in the buffer */
+  IndexType GetPixelIndex(const ScanlineGeometry &g, size_t x, size_t y, size_t z)
+    {
+    const size_t pos[3] = { x, y, z };
+    IndexType idx = g.Origin;
+    for(unsigned int d = 0; d < ImageDimension; d++)
+      idx[d] += pos[d];
+    return idx;
+    }
+
+  /** Get the position of a pixel in physical space */
+  typename WeightFunctorType::Point GetPixelPoint(const ScanlineGeometry &g, const IndexType &idx)
+    {
+    typename WeightFunctorType::Point x;
+    g.Image->TransformIndexToPhysicalPoint(idx, x);
+    return x;
+    }
+
+  /** Ask the weight functor whether a pixel may be a vertex */
+  bool IsPixelAVertex(const ScanlineGeometry &g, PixelType i, const IndexType &idx)
+    {
+    if constexpr(WeightFunctorType::NeedsPhysicalPoint)
+      return m_WeightFunctor->IsPixelAVertex(i, GetPixelPoint(g, idx));
+    else
+      return m_WeightFunctor->IsPixelAVertex(i);
+    }
 
-  /** Get the weight associated with a vertex (internal method) */
-  int IsPixelAVertex( const NeighborhoodIterator &it, int index )
+  /** Get the weight of a vertex from the weight functor */
+  TWeight GetVertexWeight(const ScanlineGeometry &g, PixelType i, const IndexType &idx)
     {
-    // Get the position of the vertex in image coordinates
-    typename WeightFunctorType::Point xVertex;
-    it.GetImagePointer()->TransformIndexToPhysicalPoint(
-      it.GetIndex(index), xVertex);
+    if constexpr(WeightFunctorType::NeedsPhysicalPoint)
+      return m_WeightFunctor->GetVertexWeight(i, GetPixelPoint(g, idx));
+    else
+      return m_WeightFunctor->GetVertexWeight(i);
+    }
 
-    // Get the weight of the vertex from the weight table
-    return m_WeightFunctor->IsPixelAVertex( it.GetPixel(index), xVertex );
+  /** Get the weight of the edge from a pixel to its neighbor k in
+   * VoxelNeighborOffsets from the weight functor */
+  TWeight GetEdgeWeight(const ScanlineGeometry &g, 
+                        PixelType i1, const IndexType &idx, PixelType i2, unsigned int k)
+    {
+    if constexpr(WeightFunctorType::NeedsPhysicalPoint)
+      {
+      IndexType idxNbr = idx;
+      for(unsigned int d = 0; d < ImageDimension; d++)
+        idxNbr[d] += VoxelNeighborOffsets[k][d];
+      return m_WeightFunctor->GetEdgeWeight(
+        i1, GetPixelPoint(g, idx), i2, GetPixelPoint(g, idxNbr));
+      }
+    else
+      return m_WeightFunctor->GetEdgeWeight(i1, i2);
     }
 
-  /** Get the weight associated with a vertex (internal method) */
-  TWeight GetVertexWeight( const NeighborhoodIterator &it, int index )
+  /** 
+   * Ask the weight functor which pixels of slice z may be vertices. Slices
+   * outside of the image are empty.
+   */
+  void ComputeVertexFlags(const ScanlineGeometry &g, long z, unsigned char *flags)
     {
-    // Get the position of the vertex in image coordinates
-    typename WeightFunctorType::Point xVertex;
-    it.GetImagePointer()->TransformIndexToPhysicalPoint(
-      it.GetIndex(index), xVertex);
+    if(z < 0 || z >= (long) g.Size[2])
+      {
+      std::fill(flags, flags + g.PaddedSliceSize, 0);
+      return;
+      }
 
-    // Get the weight of the vertex from the weight table
-    return m_WeightFunctor->GetVertexWeight( it.GetPixel(index), xVertex );
+    for(size_t y = 0; y < g.Size[1]; y++)
+      {
+      const PixelType *row = g.Buffer + z * g.SliceStride + y * g.Size[0];
+      unsigned char *rowFlags = flags + (y + 1) * g.PaddedRowStride + 1;
+      for(size_t x = 0; x < g.Size[0]; x++)
+        {
+        rowFlags[x] = IsPixelAVertex(g, row[x], GetPixelIndex(g, x, y, z)) ? 1 : 0;
+        }
+      }
     }
 
-  /** Get the weight associated with an edge (internal method) */
-  TWeight GetEdgeWeight( const NeighborhoodIterator &it, int i1, int i2 )
+  /** Numbers of vertices, directed edges and vertex runs in a slice */
+  struct SliceCount
     {
-    // Get the position of the vertex in image coordinates
-    typename WeightFunctorType::Point xVertex1, xVertex2;
-    it.GetImagePointer()->TransformIndexToPhysicalPoint( it.GetIndex(i1), xVertex1);
-    it.GetImagePointer()->TransformIndexToPhysicalPoint( it.GetIndex(i2), xVertex2);
-
-    // Get the weight of the vertex from the weight table
-    return m_WeightFunctor->GetEdgeWeight( 
-      it.GetPixel(i1), xVertex1, it.GetPixel(i2), xVertex2 );
+    size_t Vertices = 0, Edges = 0, Runs = 0;
+    };
+
+  /**
+   * Assign vertex numbers, starting with iFirst, to the pixels in a slice
+   * that are flagged and have at least one flagged neighbor. Since a flagged
+   * neighbor of a vertex is itself a vertex, the degree of a vertex is just
+   * the number of flagged neighbors. Returns the number of vertices, edges
+   * and vertex runs in the slice.
+   */
+  SliceCount NumberVertices(
+    const ScanlineGeometry &g, 
+    const unsigned char *prev, const unsigned char *curr, const unsigned char *next,
+    size_t iFirst, VertexType *ids)
+    {
+    switch(m_Connectivity)
+      {
+      case 18: return NumberVertices<18>(g, prev, curr, next, iFirst, ids);
+      case 26: return NumberVertices<26>(g, prev, curr, next, iFirst, ids);
+      default: return NumberVertices<6>(g, prev, curr, next, iFirst, ids);
+      }
     }
 
-  /** Memory cleanup for graph arrays */
-  void CleanUpGraphArrays()
+  /** Implementation of NumberVertices() for a neighborhood of N voxels */
+  template <unsigned int N>
+  SliceCount NumberVertices(
+    const ScanlineGeometry &g, 
+    const unsigned char *prev, const unsigned char *curr, const unsigned char *next,
+    size_t iFirst, VertexType *ids)
     {
-    if(m_AdjacencyIndex) 
+    const size_t s = g.PaddedRowStride;
+    const unsigned char *slices[] = { prev, curr, next };
+    SliceCount count;
+    for(size_t y = 0; y < g.Size[1]; y++)
       {
-      delete m_AdjacencyIndex;
-      delete m_Adjacency;
-      delete m_ImageIndex;
-      delete m_EdgeWeights;
-      delete m_VertexWeights;
+      size_t p = (y + 1) * s + 1;
+      for(size_t x = 0; x < g.Size[0]; x++, p++)
+        {
+        unsigned int degree = 0;
+        if(curr[p])
+          for(unsigned int k = 0; k < N; k++)
+            degree += slices[VoxelNeighborOffsets[k][2] + 1][p + g.PaddedOffset[k]];
+        if(degree)
+          {
+          // The padding makes ids[p-1] empty at the start of each row
+          if(ids[p-1] == NoVertex)
+            count.Runs++;
+          ids[p] = static_cast<VertexType>(iFirst + count.Vertices++);
+          count.Edges += degree;
+          }
+        else
+          {
+          ids[p] = NoVertex;
+          }
+        }
+      }
+    return count;
+    }
+
+  /**
+   * Count the vertices, directed edges and vertex runs in each slice of the
+   * slab [z0, z1). Only the vertex flags of a rolling window of three slices
+   * are kept.
+   */
+  void CountSlab(const ScanlineGeometry &g, long z0, long z1, SliceCount *count)
+    {
+    std::vector<unsigned char> flags[3];
+    for(unsigned int k = 0; k < 3; k++)
+      flags[k].assign(g.PaddedSliceSize, 0);
+    std::vector<VertexType> ids(g.PaddedSliceSize, NoVertex);
+
+    ComputeVertexFlags(g, z0 - 1, flags[Slot(z0 - 1)].data());
+    ComputeVertexFlags(g, z0, flags[Slot(z0)].data());
+    for(long z = z0; z < z1; z++)
+      {
+      ComputeVertexFlags(g, z + 1, flags[Slot(z + 1)].data());
+      count[z] = NumberVertices(
+        g, flags[Slot(z - 1)].data(), flags[Slot(z)].data(), flags[Slot(z + 1)].data(),
+        0, ids.data());
+      }
+    }
+
+  /**
+   * Number the vertices of the slab [z0, z1) and fill in their adjacency 
+   * lists, weights and runs. The vertex numbers of the slice preceding the 
+   * slab start at start.Vertices, and the first edge and run of the slab 
+   * are start.Edges and start.Runs. When grow is set, the arrays are 
+   * enlarged one slice at a time; otherwise they must already be large 
+   * enough to hold the slab.
+   */
+  void FillSlab(const ScanlineGeometry &g, long z0, long z1, SliceCount start, bool grow)
+    {
+    // Rolling window of vertex flags and vertex numbers for three slices
+    std::vector<unsigned char> flags[3];
+    std::vector<VertexType> ids[3];
+    for(unsigned int k = 0; k < 3; k++)
+      {
+      flags[k].assign(g.PaddedSliceSize, 0);
+      ids[k].assign(g.PaddedSliceSize, NoVertex);
+      }
+
+    // Number the vertices in the slice before the slab
+    ComputeVertexFlags(g, z0 - 2, flags[Slot(z0 - 2)].data());
+    ComputeVertexFlags(g, z0 - 1, flags[Slot(z0 - 1)].data());
+    ComputeVertexFlags(g, z0, flags[Slot(z0)].data());
+    start.Vertices += NumberVertices(
+      g, flags[Slot(z0 - 2)].data(), flags[Slot(z0 - 1)].data(), flags[Slot(z0)].data(),
+      start.Vertices, ids[Slot(z0 - 1)].data()).Vertices;
+
+    // Number the vertices in the first slice of the slab
+    ComputeVertexFlags(g, z0 + 1, flags[Slot(z0 + 1)].data());
+    SliceCount slice = NumberVertices(
+      g, flags[Slot(z0 - 1)].data(), flags[Slot(z0)].data(), flags[Slot(z0 + 1)].data(),
+      start.Vertices, ids[Slot(z0)].data());
+
+    for(long z = z0; z < z1; z++)
+      {
+      // Number the vertices in the next slice, which requires the flags of
+      // the slice after it. This recycles the slots of slices z-1 and z-2.
+      ComputeVertexFlags(g, z + 2, flags[Slot(z + 2)].data());
+      SliceCount next = NumberVertices(
+        g, flags[Slot(z)].data(), flags[Slot(z + 1)].data(), flags[Slot(z + 2)].data(),
+        start.Vertices + slice.Vertices, ids[Slot(z + 1)].data());
+
+      // Emit the vertices and edges of slice z
+      if(grow)
+        {
+        CheckGraphSize(start.Edges + slice.Edges);
+        m_AdjacencyIndex.resize(start.Vertices + slice.Vertices);
+        m_VertexWeights.resize(start.Vertices + slice.Vertices);
+        m_VertexRuns.resize(start.Runs + slice.Runs);
+        m_Adjacency.resize(start.Edges + slice.Edges);
+        m_EdgeWeights.resize(start.Edges + slice.Edges);
+        }
+      FillSlice(g, z, ids[Slot(z - 1)].data(), ids[Slot(z)].data(), ids[Slot(z + 1)].data(),
+                start);
+
+      start.Vertices += slice.Vertices;
+      start.Edges += slice.Edges;
+      start.Runs += slice.Runs;
+      slice = next;
+      }
+    }
+
+  /** 
+   * Make sure that vertex numbers and edge offsets fit into VertexType. 
+   * Every vertex has at least one edge, so checking the edges is enough.
+   */
+  void CheckGraphSize(size_t nEdges)
+    {
+    if(nEdges > (size_t) std::numeric_limits<VertexType>::max())
+      {
+      itkExceptionMacro(<< "Graph has at least " << nEdges << " directed edges, which "
+                        << "does not fit into the " << 8 * sizeof(VertexType) 
+                        << "-bit vertex index type. A wider index type is needed, "
+                        << "e.g., METIS built with IDXTYPEWIDTH=64.");
+      }
+    }
+
+  /** Slot of slice z in a rolling window of three slices */
+  static unsigned int Slot(long z) { return (unsigned int) ((z + 3) % 3); }
+
+  /**
+   * Compute the kernel weights of the edges of the pixels of row y of slice
+   * z in the edge weight image, so that w[k][x] is the weight of the edge
+   * from pixel x to its neighbor k in VoxelNeighborOffsets, for the first N
+   * neighbors. The buffer holds N * Size[0] weights. The weights of edges
+   * that leave the image are not computed.
+   */
+  template <unsigned int N>
+  void ComputeRowEdgeWeights(const ScanlineGeometry &g, size_t y, long z,
+                             TWeight *buffer, const TWeight *w[N])
+    {
+    const long n = (long) g.Size[0];
+    const float *row = m_EdgeWeightImage->GetBufferPointer() + z * g.SliceStride + y * n;
+    for(unsigned int k = 0; k < N; k++)
+      {
+      const int *o = VoxelNeighborOffsets[k];
+      TWeight *wk = buffer + k * n;
+      w[k] = wk;
+      long yn = (long) y + o[1], zn = z + o[2];
+      if(yn < 0 || yn >= (long) g.Size[1] || zn < 0 || zn >= (long) g.Size[2])
+        continue;
+
+      // Only the pixels whose neighbor is in the row are computed
+      long x0 = std::max(0, -o[0]), x1 = n - std::max(0, o[0]);
+      if(x1 > x0)
+        m_EdgeWeightKernel->ComputeWeights(
+          row + x0, row + x0 + g.PixelOffset[k], x1 - x0, wk + x0);
+      }
+    }
+
+  /**
+   * Write the adjacency lists, weights and runs of the vertices in slice z 
+   * to the graph arrays, starting at the vertex, edge and run in start. The 
+   * neighbors of each vertex are listed in the order of VoxelNeighborOffsets,
+   * i.e., -x, +x, -y, +y, -z, +z for the 6-neighborhood.
+   */
+  void FillSlice(
+    const ScanlineGeometry &g, long z,
+    const VertexType *prev, const VertexType *curr, const VertexType *next,
+    const SliceCount &start)
+    {
+    switch(m_Connectivity)
+      {
+      case 18: FillSlice<18>(g, z, prev, curr, next, start); break;
+      case 26: FillSlice<26>(g, z, prev, curr, next, start); break;
+      default: FillSlice<6>(g, z, prev, curr, next, start); break;
+      }
+    }
+
+  /** Implementation of FillSlice() for a neighborhood of N voxels */
+  template <unsigned int N>
+  void FillSlice(
+    const ScanlineGeometry &g, long z,
+    const VertexType *prev, const VertexType *curr, const VertexType *next,
+    const SliceCount &start)
+    {
+    size_t iVertex = start.Vertices, iEdge = start.Edges, iRun = start.Runs;
+    const long s = (long) g.PaddedRowStride;
+    const VertexType *slices[] = { prev, curr, next };
+
+    // Kernel weights of the edges of the current row, if any
+    const bool useEdgeImage = m_EdgeWeightImage.IsNotNull();
+    const bool usePlane = m_CutPlane.IsEnabled();
+    std::vector<TWeight> rowWeights(useEdgeImage ? N * g.Size[0] : 0);
+    const TWeight *w[N] = {};
+
+    for(size_t y = 0; y < g.Size[1]; y++)
+      {
+      size_t p = (y + 1) * s + 1;
+      const PixelType *row = g.Buffer + z * g.SliceStride + y * g.Size[0];
+      if(useEdgeImage)
+        ComputeRowEdgeWeights<N>(g, y, z, rowWeights.data(), w);
+      for(size_t x = 0; x < g.Size[0]; x++, p++)
+        {
+        if(curr[p] == NoVertex)
+          continue;
+
+        // Start a new run if the previous pixel is not a vertex
+        size_t offset = z * g.SliceStride + y * g.Size[0] + x;
+        if(curr[p-1] == NoVertex)
+          m_VertexRuns[iRun++] = VertexRun { offset, iVertex };
+
+        // Record the vertex
+        IndexType idx = GetPixelIndex(g, x, y, z);
+        m_AdjacencyIndex[iVertex] = static_cast<VertexType>(iEdge);
+        m_VertexWeights[iVertex++] = GetVertexWeight(g, row[x], idx);
+
+        // Add all the edges of the vertex
+        for(unsigned int k = 0; k < N; k++)
+          {
+          const int *o = VoxelNeighborOffsets[k];
+          VertexType nbr = slices[o[2] + 1][p + g.PaddedOffset[k]];
+          if(nbr == NoVertex) 
+            continue;
+
+          TWeight weight = GetEdgeWeight(g, row[x], idx, row[(long) x + g.PixelOffset[k]], k);
+          if(N != 6)
+            weight *= static_cast<TWeight>(GetVoxelNeighborWeight(N, k));
+          if(useEdgeImage)
+            weight *= w[k][x];
+          if(usePlane)
+            weight *= static_cast<TWeight>(m_CutPlane.GetEdgeFactor(idx, o));
+          m_Adjacency[iEdge] = nbr;
+          m_EdgeWeights[iEdge++] = weight;
+          }
+        }
       }
     }
 };
@@ -1,15 +1,105 @@
 #include "METISTools.h"
+#include <itkMultiThreaderBase.h>
 #include <iostream>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <exception>
+#include <random>
+#include <sstream>
+#include <stdexcept>
+#include <vector>
 
 using namespace std;
 
+idxtype RunMETISPartition(
+  const MetisGraphView &graph,
+  idxtype nParts,
+  float *xPartWeights,
+  idxtype *outPartition,
+  float tolerance,
+  idxtype nTries,
+  bool useRecursiveAlgorithm,
+  bool contiguous)
+{
+  // Variables used to call METIS
+  idxtype nVertices = graph.nVertices;
+  idxtype nConstraints = 1;
+  idxtype edgecut = 0;
+  real_t ubvec = tolerance;
+
+  // METIS may be built with double precision reals
+  std::vector<real_t> tpwgts(xPartWeights, xPartWeights + nParts);
+
+  idxtype options[METIS_NOPTIONS];
+  METIS_SetDefaultOptions(options); 
+  options[METIS_OPTION_CONTIG] = contiguous ? 1 : 0;
+  options[METIS_OPTION_MINCONN] = 1;
+  options[METIS_OPTION_CCORDER] = 1;
+  options[METIS_OPTION_NCUTS] = nTries;
+
+  int status;
+  if( useRecursiveAlgorithm )
+    {
+    status = METIS_PartGraphRecursive(
+      &nVertices,
+      &nConstraints,
+      graph.xadj,
+      graph.adjncy,
+      graph.vwgt,
+      NULL,                                 // vsize ?
+      graph.adjwgt,
+      &nParts,
+      tpwgts.data(),                        // tpweights
+      &ubvec,                               // ubvec
+      options,                              // options
+      &edgecut,
+      outPartition);
+    }
+  else
+    {
+    status = METIS_PartGraphKway(
+      &nVertices,
+      &nConstraints,
+      graph.xadj,
+      graph.adjncy,
+      graph.vwgt,
+      NULL,                                 // vsize ?
+      graph.adjwgt,
+      &nParts,
+      tpwgts.data(),                        // tpweights
+      &ubvec,                                 // ubvec
+      options,                              // options
+      &edgecut,
+      outPartition);
+    }  
+
+  // The partition is not filled in when METIS fails
+  if( status != METIS_OK )
+    {
+    std::ostringstream oss;
+    oss << "METIS failed to partition a graph of " << graph.nVertices
+        << " vertices into " << nParts << " parts: "
+        << (status == METIS_ERROR_INPUT ? "input error" :
+            status == METIS_ERROR_MEMORY ? "out of memory" : "error")
+        << " (code " << status << ")";
+    throw std::runtime_error(oss.str());
+    }
+
+  return edgecut;
+}
+
 void
 MetisPartitionProblem
-::SetProblem(GraphFilter *fltGraph, unsigned int nParts)
+::SetProblem(const MetisGraphView &graph, unsigned int nParts)
 {
-  m_Graph = fltGraph;
-  m_Partition = new idxtype[m_Graph->GetNumberOfVertices()];
+  m_Graph = graph;
+  m_Partition.resize(m_Graph.nVertices);
   m_NumberOfParameters = nParts;
+  m_Cache.clear();
+  m_BestPartition.clear();
+  m_NumberOfEvaluations = m_NumberOfCacheHits = 0;
 }
 
 MetisPartitionProblem::MeasureType
@@ -25,14 +115,143 @@ MetisPartitionProblem
     sum += wgt[i];
     }
   wgt[x.size()] = 1.0f - sum;
+  m_NumberOfEvaluations++;
+
+  // Reuse the edge cut of a weight vector that is the same after rounding
+  std::vector<long> key(x.size());
+  for(unsigned int i=0;i<x.size();i++)
+    key[i] = std::lround(x[i] / m_WeightQuantum);
+  auto it = m_Cache.find(key);
+  if(it != m_Cache.end())
+    {
+    m_NumberOfCacheHits++;
+    if(m_Log)
+      *m_Log << " Reusing METIS result [ x = " << x << "] - edge cut " << it->second << endl;
+    return (MeasureType) it->second;
+    }
 
-  // Run the METIS code
-  cout << " Running METIS iteration [ x = " << x << "] " << endl;
-  int edgecut = 
-    RunMETISPartition(m_Graph, wgt.size(), wgt.data_block(), m_Partition); 
+  // Run the METIS code. A failed run throws before its result is cached.
+  if(m_Log)
+    *m_Log << " Running METIS iteration [ x = " << x << "] " << endl;
+  idxtype edgecut = RunMETISPartition(
+    m_Graph, wgt.size(), wgt.data_block(), m_Partition.data(),
+    m_Tolerance, m_NumberOfTries, m_UseRecursiveAlgorithm);
+  m_Cache[key] = edgecut;
+
+  // Keep the partition if it is the best so far
+  if(m_BestPartition.empty() || edgecut < m_BestEdgeCut)
+    {
+    m_BestPartition.swap(m_Partition);
+    m_Partition.resize(m_Graph.nVertices);
+    m_BestWeights = wgt;
+    m_BestEdgeCut = edgecut;
+    }
 
   // Report the edge cut
-  cout << "  - done - edge cut " << edgecut << endl;
+  if(m_Log)
+    *m_Log << "  - done - edge cut " << edgecut << endl;
 
   return (MeasureType) edgecut;
-}
\ No newline at end of file
+}
+
+MetisWeightSearchResult SearchMETISPartitionWeights(
+  const MetisGraphView &graph,
+  const std::vector<float> &initialWeights,
+  const MetisWeightSearchParameters &param)
+{
+  typedef std::chrono::steady_clock Clock;
+  Clock::time_point tStart = Clock::now();
+  auto elapsed = [&]() { return std::chrono::duration<double>(Clock::now() - tStart).count(); };
+
+  // Step size control of the evolution strategy
+  const double growth = 1.5, shrink = 0.8;
+
+  // Every candidate has its own weights and partition buffer
+  const unsigned int nParts = initialWeights.size();
+  const unsigned int nPop = std::max(1u, param.PopulationSize);
+  std::vector< std::vector<float> > weights(nPop, initialWeights);
+  std::vector< std::vector<idxtype> > partition(nPop, std::vector<idxtype>(graph.nVertices));
+  std::vector<idxtype> edgecut(nPop);
+
+  // Run METIS on the first n candidates concurrently. METIS builds whose
+  // random generator is shared between threads may return partitions that
+  // differ from run to run.
+  // A failure of METIS is rethrown once all the candidates finish.
+  MultiThreaderBase::Pointer mt = MultiThreaderBase::New();
+  auto evaluate = [&](unsigned int n) {
+    std::vector<std::exception_ptr> error(n);
+    mt->SetMaximumNumberOfThreads(n);
+    mt->SetNumberOfWorkUnits(n);
+    mt->ParallelizeArray(0, n, [&](SizeValueType i) {
+      try
+        {
+        edgecut[i] = RunMETISPartition(
+          graph, nParts, weights[i].data(), partition[i].data(),
+          param.Tolerance, param.NumberOfTries, param.UseRecursiveAlgorithm);
+        }
+      catch(...)
+        {
+        error[i] = std::current_exception();
+        }
+    }, nullptr);
+    for(auto &e : error)
+      if(e)
+        std::rethrow_exception(e);
+  };
+
+  // Start with the initial weights
+  MetisWeightSearchResult result;
+  evaluate(1);
+  result.Weights = weights[0];
+  result.EdgeCut = edgecut[0];
+  result.Partition.swap(partition[0]);
+  partition[0].resize(graph.nVertices);
+  result.Evaluations = 1;
+
+  std::mt19937 rng(param.Seed);
+  std::normal_distribution<double> normal;
+  double radius = param.InitialRadius;
+  while(result.Evaluations < param.MaximumEvaluations &&
+        (param.MaximumSeconds <= 0 || elapsed() < param.MaximumSeconds))
+    {
+    // Draw the candidates around the best weights. As in MetisPartitionProblem,
+    // the last weight makes up the difference to one, and every weight is 
+    // kept positive so that METIS accepts the candidate.
+    unsigned int n = std::min(nPop, param.MaximumEvaluations - result.Evaluations);
+    for(unsigned int i = 0; i < n; i++)
+      {
+      float sum = 0.0f, total = 0.0f;
+      for(unsigned int j = 0; j + 1 < nParts; j++)
+        {
+        weights[i][j] = result.Weights[j] + (float) (radius * normal(rng));
+        sum += weights[i][j];
+        }
+      weights[i][nParts - 1] = 1.0f - sum;
+      for(float &w : weights[i])
+        total += (w = std::max(w, 1.0e-4f));
+      for(float &w : weights[i])
+        w /= total;
+      }
+
+    evaluate(n);
+    result.Evaluations += n;
+    result.Generations++;
+
+    // Keep the best candidate, and its partition
+    unsigned int iBest = std::min_element(edgecut.begin(), edgecut.begin() + n) - edgecut.begin();
+    if(edgecut[iBest] < result.EdgeCut)
+      {
+      result.Weights = weights[iBest];
+      result.EdgeCut = edgecut[iBest];
+      result.Partition.swap(partition[iBest]);
+      radius *= growth;
+      }
+    else
+      {
+      radius *= shrink;
+      }
+    }
+
+  result.Seconds = elapsed();
+  return result;
+}
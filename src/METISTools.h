@@ -8,74 +8,83 @@
 #include <vnl/vnl_cost_function.h>
 #include <vnl/algo/vnl_powell.h>
 #include <metis.h>
+#include <map>
+#include <ostream>
+#include <type_traits>
+#include <vector>
 
 using namespace itk;
 
-typedef int idxtype;
+/** 
+ * Integer type of vertex numbers, edge offsets, weights and part labels. 
+ * This is the idx_t of the METIS build we are compiled against, so it is 
+ * 64 bits wide when METIS was built with IDXTYPEWIDTH=64. Graph filters
+ * whose output is passed to METIS must use it as their vertex and weight
+ * type.
+ */
+typedef idx_t idxtype;
+
+/** 
+ * Pointers to a graph in the compressed sparse row format used by METIS.
+ * The arrays are owned by someone else, e.g., an ImageToGraphFilter.
+ */
+struct MetisGraphView
+{
+  idxtype nVertices;
+  idxtype *xadj;
+  idxtype *adjncy;
+  idxtype *vwgt;
+  idxtype *adjwgt;
+};
+
+/** Get the METIS view of the graph generated by an ImageToGraphFilter */
+template< class TGraphFilter >
+MetisGraphView GetMetisGraphView(TGraphFilter *fltGraph)
+{
+  static_assert(std::is_same<typename TGraphFilter::VertexType, idxtype>::value &&
+                std::is_same<typename TGraphFilter::WeightType, idxtype>::value,
+                "The graph filter must use the METIS idx_t for vertices and weights");
+
+  MetisGraphView graph;
+  graph.nVertices = fltGraph->GetNumberOfVertices();
+  graph.xadj = fltGraph->GetAdjacencyIndex();
+  graph.adjncy = fltGraph->GetAdjacency();
+  graph.vwgt = fltGraph->GetVertexWeights();
+  graph.adjwgt = fltGraph->GetEdgeWeights();
+  return graph;
+}
+
+/**
+ * Function to run METIS on a graph, returns the edge cut. Throws a
+ * std::runtime_error with the METIS error code when METIS fails. Unless
+ * contiguous is false, every part is required to be connected, which METIS
+ * can only do for connected graphs.
+ */
+idxtype RunMETISPartition(
+  const MetisGraphView &graph,
+  idxtype nParts,
+  float *xPartWeights,
+  idxtype *outPartition,
+  float tolerance = 1.001,
+  idxtype nTries = 1,
+  bool useRecursiveAlgorithm = true,
+  bool contiguous = true);
 
 /** Function to run METIS using ImageToGraphFilter */
-template< class TImage >
-int RunMETISPartition(
-  ImageToGraphFilter<TImage> *fltGraph,
-  int nParts,
+template< class TGraphFilter >
+idxtype RunMETISPartition(
+  TGraphFilter *fltGraph,
+  idxtype nParts,
   float *xPartWeights,
-  int *outPartition,
+  idxtype *outPartition,
   float tolerance = 1.001,
-  int nTries = 1,
-  bool useRecursiveAlgorithm = true)
+  idxtype nTries = 1,
+  bool useRecursiveAlgorithm = true,
+  bool contiguous = true)
 {
-  // Variables used to call METIS
-  int nVertices = fltGraph->GetNumberOfVertices();
-  int nConstraints = 1;
-  int wgtflag = 3;
-  int numflag = 0;
-  int edgecut = 0;
-  float ubvec = tolerance;
-
-  int options[METIS_NOPTIONS];
-  METIS_SetDefaultOptions(options); 
-  options[METIS_OPTION_CONTIG] = 1;
-  options[METIS_OPTION_MINCONN] = 1;
-  options[METIS_OPTION_CCORDER] = 1;
-  options[METIS_OPTION_NCUTS] = nTries;
-
-  if( useRecursiveAlgorithm )
-    {
-    METIS_PartGraphRecursive(
-      &nVertices,
-      &nConstraints,
-      fltGraph->GetAdjacencyIndex(),
-      fltGraph->GetAdjacency(),
-      fltGraph->GetVertexWeights(),
-      NULL,                                 // vsize ?
-      fltGraph->GetEdgeWeights(),
-      &nParts,
-      xPartWeights,                         // tpweights
-      &ubvec,                               // ubvec
-      options,                              // options
-      &edgecut,
-      outPartition);
-    }
-  else
-    {
-    printf("Using K-way algorithm\n");
-    METIS_PartGraphKway(
-      &nVertices,
-      &nConstraints,
-      fltGraph->GetAdjacencyIndex(),
-      fltGraph->GetAdjacency(),
-      fltGraph->GetVertexWeights(),
-      NULL,                                 // vsize ?
-      fltGraph->GetEdgeWeights(),
-      &nParts,
-      xPartWeights,                         // tpweights
-      &ubvec,                                 // ubvec
-      options,                              // options
-      &edgecut,
-      outPartition);
-    }  
-
-  return edgecut;
+  return RunMETISPartition(
+    GetMetisGraphView(fltGraph), nParts, xPartWeights, outPartition,
+    tolerance, nTries, useRecursiveAlgorithm, contiguous);
 }
 
 /*
@@ -98,15 +107,41 @@ public:
 
   itkNewMacro(Self);
   
-  typedef itk::Image<short,3> ImageType; 
-  typedef ImageToGraphFilter<ImageType> GraphFilter;
-
   typedef Superclass::MeasureType MeasureType;
   typedef Superclass::ParametersType ParametersType;
   typedef Superclass::DerivativeType DerivativeType;
 
   /** Set the problem parameters */
-  void SetProblem(GraphFilter *fltGraph, unsigned int nParts);
+  void SetProblem(const MetisGraphView &graph, unsigned int nParts);
+
+  /** Set the problem parameters from an ImageToGraphFilter */
+  template< class TGraphFilter >
+  void SetProblem(TGraphFilter *fltGraph, unsigned int nParts)
+    { SetProblem(GetMetisGraphView(fltGraph), nParts); }
+
+  /** 
+   * METIS settings used by every evaluation. They should match the final
+   * partition, so that the best partition seen can be used as the result.
+   */
+  itkSetMacro(Tolerance, float);
+  itkGetMacro(Tolerance, float);
+  itkSetMacro(NumberOfTries, idxtype);
+  itkGetMacro(NumberOfTries, idxtype);
+  itkSetMacro(UseRecursiveAlgorithm, bool);
+  itkGetMacro(UseRecursiveAlgorithm, bool);
+
+  /** 
+   * Weight vectors that agree after rounding to a multiple of this quantum
+   * are considered the same, and METIS only runs for the first of them
+   */
+  itkSetMacro(WeightQuantum, double);
+  itkGetMacro(WeightQuantum, double);
+
+  /**
+   * Stream that each evaluation is reported to, e.g., the log of the
+   * component being partitioned. Null by default, for no reports.
+   */
+  void SetLog(std::ostream *log) { m_Log = log; }
 
   /** Return the number of parameters */
   unsigned int GetNumberOfParameters() const override
@@ -118,19 +153,99 @@ public:
   /** Not used, since there are no derivatives to evaluate */
   void GetDerivative(const ParametersType &, DerivativeType &) const override {}
 
-  /** Get the result of the last partition */
-  idxtype *GetLastPartition() { return m_Partition; }
+  /** Get the partition with the smallest edge cut seen so far */
+  std::vector<idxtype> &GetBestPartition() { return m_BestPartition; }
+
+  /** Get the part weights (all of them) that gave the best partition */
+  const vnl_vector<float> &GetBestWeights() const { return m_BestWeights; }
+
+  /** Get the edge cut of the best partition */
+  idxtype GetBestEdgeCut() const { return m_BestEdgeCut; }
+
+  /** Number of calls to GetValue, and how many of them reused a result */
+  unsigned int GetNumberOfEvaluations() const { return m_NumberOfEvaluations; }
+  unsigned int GetNumberOfCacheHits() const { return m_NumberOfCacheHits; }
   
 private:
   /** The stored graph information */
-  GraphFilter *m_Graph;
+  MetisGraphView m_Graph;
 
-  /** The partition array */
-  idxtype *m_Partition;
+  /** The partition array, used as scratch space by GetValue */
+  mutable std::vector<idxtype> m_Partition;
 
   /** Problem size */
   unsigned int m_NumberOfParameters;
+
+  /** METIS settings */
+  float m_Tolerance = 1.001;
+  idxtype m_NumberOfTries = 1;
+  bool m_UseRecursiveAlgorithm = true;
+
+  /** Edge cuts of the weight vectors evaluated so far, by quantized weights */
+  double m_WeightQuantum = 1.0e-4;
+  mutable std::map<std::vector<long>, idxtype> m_Cache;
+
+  /** The best partition seen so far */
+  mutable std::vector<idxtype> m_BestPartition;
+  mutable vnl_vector<float> m_BestWeights;
+  mutable idxtype m_BestEdgeCut = 0;
+
+  /** Evaluation statistics */
+  mutable unsigned int m_NumberOfEvaluations = 0;
+  mutable unsigned int m_NumberOfCacheHits = 0;
+
+  /** Stream for the reports of the evaluations, if any */
+  std::ostream *m_Log = nullptr;
 };
 
+/** Settings of the parallel search over the relative part weights */
+struct MetisWeightSearchParameters
+{
+  /** Number of candidate weight vectors evaluated concurrently per generation */
+  unsigned int PopulationSize = 8;
+
+  /** Maximum number of METIS runs, including the one for the initial weights */
+  unsigned int MaximumEvaluations = 100;
+
+  /** Wall-clock limit in seconds, checked between generations. Zero for none */
+  double MaximumSeconds = 0.0;
+
+  /** Initial standard deviation of the changes to the weights */
+  double InitialRadius = 0.005;
+
+  /** Seed of the candidate generator. The candidates depend only on the seed */
+  unsigned int Seed = 0;
+
+  /** METIS settings used for every evaluation, and so for the result */
+  float Tolerance = 1.001;
+  idxtype NumberOfTries = 1;
+  bool UseRecursiveAlgorithm = false;
+};
+
+/** Best weights found by the parallel search, with their partition */
+struct MetisWeightSearchResult
+{
+  std::vector<float> Weights;
+  idxtype EdgeCut = 0;
+  std::vector<idxtype> Partition;
+  unsigned int Evaluations = 0;
+  unsigned int Generations = 0;
+  double Seconds = 0.0;
+};
+
+/**
+ * Minimize the edge cut over the relative part weights with a (1+lambda)
+ * evolution strategy. Every generation draws PopulationSize candidates 
+ * around the best weights so far and runs METIS on all of them at once,
+ * each into its own partition buffer. The step size grows after a 
+ * generation that improves the cut and shrinks otherwise. The search stops
+ * when the evaluation budget or the time limit is used up, and returns the
+ * partition of the best weights, so METIS does not need to run again.
+ */
+MetisWeightSearchResult SearchMETISPartitionWeights(
+  const MetisGraphView &graph,
+  const std::vector<float> &initialWeights,
+  const MetisWeightSearchParameters &param);
+
 
 #endif // __METISTools_h_
@@ -0,0 +1,161 @@
+#include "MemoryMappedFile.h"
+#include <cerrno>
+#include <cstring>
+#include <sstream>
+#include <stdexcept>
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace
+{
+
+void ThrowFileError(const std::string &what, const std::string &filename)
+{
+  std::ostringstream oss;
+  oss << "Cannot " << what << " file " << filename << ": ";
+#ifdef _WIN32
+  oss << "error " << GetLastError();
+#else
+  oss << strerror(errno);
+#endif
+  throw std::runtime_error(oss.str());
+}
+
+}
+
+#ifdef _WIN32
+
+void MemoryMappedFile::Create(const std::string &filename, size_t size, bool temporary)
+{
+  Close();
+  m_FileName = filename;
+  DWORD flags = temporary
+    ? FILE_ATTRIBUTE_TEMPORARY | FILE_FLAG_DELETE_ON_CLOSE : FILE_ATTRIBUTE_NORMAL;
+  m_File = CreateFileA(filename.c_str(), GENERIC_READ | GENERIC_WRITE,
+                       FILE_SHARE_READ | FILE_SHARE_DELETE, nullptr, CREATE_ALWAYS, flags, nullptr);
+  if(m_File == INVALID_HANDLE_VALUE)
+  {
+    m_File = nullptr;
+    ThrowFileError("create", filename);
+  }
+
+  // Creating the mapping extends the file to the requested size
+  m_Size = size;
+  Map(true);
+}
+
+void MemoryMappedFile::Open(const std::string &filename, bool writable)
+{
+  Close();
+  m_FileName = filename;
+  m_File = CreateFileA(filename.c_str(), writable ? GENERIC_READ | GENERIC_WRITE : GENERIC_READ,
+                       FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+  if(m_File == INVALID_HANDLE_VALUE)
+  {
+    m_File = nullptr;
+    ThrowFileError("open", filename);
+  }
+
+  LARGE_INTEGER size;
+  if(!GetFileSizeEx(m_File, &size))
+    ThrowFileError("get the size of", filename);
+  m_Size = (size_t) size.QuadPart;
+  Map(writable);
+}
+
+void MemoryMappedFile::Map(bool writable)
+{
+  if(m_Size == 0)
+    return;
+
+  unsigned long long size = m_Size;
+  m_Mapping = CreateFileMappingA(m_File, nullptr, writable ? PAGE_READWRITE : PAGE_WRITECOPY,
+                                 (DWORD) (size >> 32), (DWORD) (size & 0xffffffff), nullptr);
+  if(!m_Mapping)
+    ThrowFileError("map", m_FileName);
+
+  m_Pointer = (char *) MapViewOfFile(m_Mapping, writable ? FILE_MAP_WRITE : FILE_MAP_COPY, 0, 0, m_Size);
+  if(!m_Pointer)
+    ThrowFileError("map", m_FileName);
+}
+
+void MemoryMappedFile::Close()
+{
+  if(m_Pointer)
+    UnmapViewOfFile(m_Pointer);
+  if(m_Mapping)
+    CloseHandle(m_Mapping);
+  if(m_File)
+    CloseHandle(m_File);
+  m_Pointer = nullptr;
+  m_Mapping = m_File = nullptr;
+  m_Size = 0;
+}
+
+#else
+
+void MemoryMappedFile::Create(const std::string &filename, size_t size, bool temporary)
+{
+  Close();
+  m_FileName = filename;
+  m_File = open(filename.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if(m_File < 0)
+    ThrowFileError("create", filename);
+  if(ftruncate(m_File, (off_t) size) != 0)
+    ThrowFileError("resize", filename);
+
+  m_Size = size;
+  Map(true);
+
+  // The mapping keeps the contents of an unlinked file alive
+  if(temporary)
+    unlink(filename.c_str());
+}
+
+void MemoryMappedFile::Open(const std::string &filename, bool writable)
+{
+  Close();
+  m_FileName = filename;
+  m_File = open(filename.c_str(), writable ? O_RDWR : O_RDONLY);
+  if(m_File < 0)
+    ThrowFileError("open", filename);
+
+  struct stat st;
+  if(fstat(m_File, &st) != 0)
+    ThrowFileError("get the size of", filename);
+  m_Size = (size_t) st.st_size;
+  Map(writable);
+}
+
+void MemoryMappedFile::Map(bool writable)
+{
+  if(m_Size == 0)
+    return;
+
+  void *ptr = mmap(nullptr, m_Size, PROT_READ | PROT_WRITE,
+                   writable ? MAP_SHARED : MAP_PRIVATE, m_File, 0);
+  if(ptr == MAP_FAILED)
+    ThrowFileError("map", m_FileName);
+  m_Pointer = (char *) ptr;
+}
+
+void MemoryMappedFile::Close()
+{
+  if(m_Pointer)
+    munmap(m_Pointer, m_Size);
+  if(m_File >= 0)
+    close(m_File);
+  m_Pointer = nullptr;
+  m_File = -1;
+  m_Size = 0;
+}
+
+#endif
@@ -0,0 +1,61 @@
+#ifndef __MemoryMappedFile_h_
+#define __MemoryMappedFile_h_
+
+#include <cstddef>
+#include <string>
+
+/**
+ * \class MemoryMappedFile
+ * \brief A file mapped into the address space of the process
+ *
+ * The operating system pages the contents of the file in and out as they
+ * are used, so arrays that do not fit into memory can be stored in a mapped
+ * file and accessed like ordinary arrays. Errors throw std::runtime_error.
+ */
+class MemoryMappedFile
+{
+public:
+  MemoryMappedFile() = default;
+  ~MemoryMappedFile() { Close(); }
+
+  MemoryMappedFile(const MemoryMappedFile &) = delete;
+  MemoryMappedFile &operator=(const MemoryMappedFile &) = delete;
+
+  /**
+   * Create a file of the given size, replacing any existing file, and map
+   * it for reading and writing. A temporary file is removed from the file
+   * system as soon as possible, and its space is reclaimed when it is
+   * closed, even if the process exits abnormally.
+   */
+  void Create(const std::string &filename, size_t size, bool temporary = false);
+
+  /**
+   * Map an existing file. Unless writable is set, the mapping is copy-on-
+   * write: the memory may be changed, but the changes are private to the
+   * process and never reach the file.
+   */
+  void Open(const std::string &filename, bool writable = false);
+
+  /** Unmap and close the file */
+  void Close();
+
+  /** Get the mapped contents of the file */
+  char *GetPointer() const { return m_Pointer; }
+
+  /** Get the size of the file */
+  size_t GetSize() const { return m_Size; }
+
+protected:
+  void Map(bool writable);
+
+  char *m_Pointer = nullptr;
+  size_t m_Size = 0;
+  std::string m_FileName;
+#ifdef _WIN32
+  void *m_File = nullptr, *m_Mapping = nullptr;
+#else
+  int m_File = -1;
+#endif
+};
+
+#endif // __MemoryMappedFile_h_
@@ -0,0 +1,296 @@
+#ifndef __MultiResolutionPartition_h_
+#define __MultiResolutionPartition_h_
+
+#include "VoxelGraph.h"
+#include <algorithm>
+#include <stdexcept>
+#include <vector>
+
+/* ***************************************************************************
+ * MULTI-RESOLUTION PARTITIONING
+ *
+ * A voxel graph is coarsened by aggregating its voxels into blocks of k x k x
+ * k voxels, the much smaller block graph is partitioned, and the labels of
+ * the blocks are projected back onto the voxels. Only the voxels on the
+ * boundaries between parts are then refined on the fine graph.
+ * *************************************************************************** */
+
+/** Edge cut and balance of a partition */
+struct PartitionQuality
+{
+  /** Total weight of the edges between different parts */
+  double EdgeCut;
+
+  /** Largest ratio of the weight of a part to its target weight */
+  double Imbalance;
+};
+
+/**
+ * Aggregate the vertices of a voxel graph into blocks of k x k x k voxels of
+ * an image of the given size. The weights of the coarse vertices and of the
+ * edges between blocks are summed from the fine graph, and the edges within
+ * blocks disappear. The coarse vertex of every fine vertex is returned in
+ * fineToCoarse. The coarse graph has no vertex runs.
+ */
+template <class TVertex, class TWeight>
+void CoarsenVoxelGraph(VoxelGraph<TVertex, TWeight> &fine, const size_t size[3], unsigned int k,
+                       VoxelGraph<TVertex, TWeight> &coarse, std::vector<TVertex> &fineToCoarse)
+{
+  const TVertex noVertex = static_cast<TVertex>(-1);
+  const size_t nFine = fine.GetNumberOfVertices();
+  const VoxelRun *runs = fine.GetVertexRuns();
+  const size_t nx = size[0], sliceSize = size[0] * size[1];
+  const size_t nbx = (size[0] + k - 1) / k, nby = (size[1] + k - 1) / k;
+
+  // Number the blocks in the order of their first vertex. The vertices are in
+  // raster order, so every slab of k slices is a range of vertices, and only
+  // the blocks of one slab need a table at any time.
+  fineToCoarse.assign(nFine, noVertex);
+  std::vector<TVertex> slabBlock(nbx * nby, noVertex);
+  std::vector<size_t> touched;
+  size_t nCoarse = 0, slab = (size_t) -1;
+  for(size_t r = 0; r < fine.GetNumberOfVertexRuns(); r++)
+    {
+    size_t offset = runs[r].BufferOffset;
+    size_t x0 = offset % nx, y = (offset % sliceSize) / nx, z = offset / sliceSize;
+    if(z / k != slab)
+      {
+      for(size_t b : touched)
+        slabBlock[b] = noVertex;
+      touched.clear();
+      slab = z / k;
+      }
+    for(size_t v = runs[r].FirstVertex; v < runs[r+1].FirstVertex; v++)
+      {
+      size_t b = (y / k) * nbx + (x0 + v - runs[r].FirstVertex) / k;
+      if(slabBlock[b] == noVertex)
+        {
+        slabBlock[b] = static_cast<TVertex>(nCoarse++);
+        touched.push_back(b);
+        }
+      fineToCoarse[v] = slabBlock[b];
+      }
+    }
+
+  // List the fine vertices of every block
+  std::vector<size_t> first(nCoarse + 1, 0), members(nFine);
+  for(size_t v = 0; v < nFine; v++)
+    first[fineToCoarse[v] + 1]++;
+  for(size_t c = 0; c < nCoarse; c++)
+    first[c+1] += first[c];
+  std::vector<size_t> cursor(first.begin(), first.end() - 1);
+  for(size_t v = 0; v < nFine; v++)
+    members[cursor[fineToCoarse[v]]++] = v;
+
+  // Sum the weights of the blocks and of the edges between them. The row of
+  // each block remembers where its neighbors are, so that parallel fine edges
+  // are merged into one coarse edge.
+  const TVertex *xadj = fine.GetAdjacencyIndex(), *adj = fine.GetAdjacency();
+  const TWeight *vwgt = fine.GetVertexWeights(), *adjwgt = fine.GetEdgeWeights();
+  std::vector<TVertex> cXAdj(nCoarse + 1), cAdj;
+  std::vector<TWeight> cVWgt(nCoarse, 0), cAdjWgt;
+  std::vector<size_t> where(nCoarse, (size_t) -1);
+  for(size_t c = 0; c < nCoarse; c++)
+    {
+    size_t rowStart = cAdj.size();
+    cXAdj[c] = static_cast<TVertex>(rowStart);
+    for(size_t i = first[c]; i < first[c+1]; i++)
+      {
+      size_t u = members[i];
+      cVWgt[c] += vwgt[u];
+      for(TVertex e = xadj[u]; e < xadj[u+1]; e++)
+        {
+        TVertex cv = fineToCoarse[adj[e]];
+        if((size_t) cv == c)
+          continue;
+        if(where[cv] != (size_t) -1 && where[cv] >= rowStart)
+          {
+          cAdjWgt[where[cv]] += adjwgt[e];
+          }
+        else
+          {
+          where[cv] = cAdj.size();
+          cAdj.push_back(cv);
+          cAdjWgt.push_back(adjwgt[e]);
+          }
+        }
+      }
+    }
+  cXAdj[nCoarse] = static_cast<TVertex>(cAdj.size());
+
+  std::vector<VoxelRun> cRuns(1, VoxelRun { 0, nCoarse });
+  coarse.Assign(std::move(cXAdj), std::move(cAdj), std::move(cVWgt),
+                std::move(cAdjWgt), std::move(cRuns));
+}
+
+/** Give every fine vertex the part of its coarse vertex */
+template <class TVertex>
+void ProjectPartition(const std::vector<TVertex> &fineToCoarse,
+                      const TVertex *coarsePartition, TVertex *finePartition)
+{
+  for(size_t v = 0; v < fineToCoarse.size(); v++)
+    finePartition[v] = coarsePartition[fineToCoarse[v]];
+}
+
+/**
+ * Compute the edge cut and the balance of a partition. The target weights
+ * of the parts are relative, and need not sum to one.
+ */
+template <class TVertex, class TWeight>
+PartitionQuality EvaluatePartition(VoxelGraph<TVertex, TWeight> &graph, const TVertex *partition,
+                                   unsigned int nParts, const float *targetWeights)
+{
+  const TVertex *xadj = graph.GetAdjacencyIndex(), *adj = graph.GetAdjacency();
+  const TWeight *vwgt = graph.GetVertexWeights(), *adjwgt = graph.GetEdgeWeights();
+
+  PartitionQuality q = { 0.0, 0.0 };
+  std::vector<double> partWeight(nParts, 0.0);
+  double total = 0.0, totalTarget = 0.0;
+  for(size_t v = 0; v < graph.GetNumberOfVertices(); v++)
+    {
+    partWeight[partition[v]] += vwgt[v];
+    total += vwgt[v];
+    for(TVertex e = xadj[v]; e < xadj[v+1]; e++)
+      if(partition[adj[e]] != partition[v])
+        q.EdgeCut += adjwgt[e];
+    }
+
+  // Every cut edge was counted from both sides
+  q.EdgeCut /= 2;
+  for(unsigned int p = 0; p < nParts; p++)
+    totalTarget += targetWeights[p];
+  for(unsigned int p = 0; p < nParts; p++)
+    if(targetWeights[p] > 0 && total > 0)
+      q.Imbalance = std::max(q.Imbalance, partWeight[p] * totalTarget / (targetWeights[p] * total));
+  return q;
+}
+
+/**
+ * Greedy refinement of the boundaries of a partition. A vertex with neighbors
+ * in other parts moves to the adjacent part that reduces the edge cut the
+ * most, provided that part stays within tolerance of its target weight. A
+ * move that leaves the cut unchanged is only made out of an overweight part.
+ * The first pass visits all boundary vertices, and each later pass visits
+ * the vertices around the moves of the previous one. If movable is given,
+ * only the vertices flagged in it are moved. Returns the number of moves.
+ * Throws if the target weights do not add up to a positive number.
+ */
+template <class TVertex, class TWeight>
+size_t RefinePartitionBoundary(VoxelGraph<TVertex, TWeight> &graph, TVertex *partition,
+                               unsigned int nParts, const float *targetWeights,
+                               double tolerance, unsigned int nPasses,
+                               const unsigned char *movable = nullptr)
+{
+  const size_t nVertices = graph.GetNumberOfVertices();
+  const TVertex *xadj = graph.GetAdjacencyIndex(), *adj = graph.GetAdjacency();
+  const TWeight *vwgt = graph.GetVertexWeights(), *adjwgt = graph.GetEdgeWeights();
+
+  // Current and largest allowed weight of every part
+  std::vector<double> partWeight(nParts, 0.0), maxWeight(nParts);
+  double total = 0.0, totalTarget = 0.0;
+  for(size_t v = 0; v < nVertices; v++)
+    {
+    partWeight[partition[v]] += vwgt[v];
+    total += vwgt[v];
+    }
+  for(unsigned int p = 0; p < nParts; p++)
+    totalTarget += targetWeights[p];
+  if(!(totalTarget > 0))
+    throw std::invalid_argument("The target weights of the parts must add up to a positive number");
+  for(unsigned int p = 0; p < nParts; p++)
+    maxWeight[p] = tolerance * total * targetWeights[p] / totalTarget;
+
+  // Start from the boundary vertices
+  std::vector<char> queued(nVertices, 0);
+  std::vector<size_t> queue, next;
+  for(size_t v = 0; v < nVertices; v++)
+    {
+    if(movable && !movable[v])
+      continue;
+    for(TVertex e = xadj[v]; e < xadj[v+1]; e++)
+      {
+      if(partition[adj[e]] != partition[v])
+        {
+        queue.push_back(v);
+        queued[v] = 1;
+        break;
+        }
+      }
+    }
+
+  // Weight of the edges from the current vertex to each adjacent part
+  std::vector<double> conn(nParts, 0.0);
+  std::vector<char> seen(nParts, 0);
+  std::vector<TVertex> adjParts;
+
+  size_t nMoves = 0;
+  for(unsigned int pass = 0; pass < nPasses && !queue.empty(); pass++)
+    {
+    next.clear();
+    for(size_t v : queue)
+      {
+      queued[v] = 0;
+      TVertex p = partition[v];
+      adjParts.clear();
+      for(TVertex e = xadj[v]; e < xadj[v+1]; e++)
+        {
+        TVertex q = partition[adj[e]];
+        if(!seen[q])
+          {
+          seen[q] = 1;
+          adjParts.push_back(q);
+          }
+        conn[q] += adjwgt[e];
+        }
+
+      // Pick the adjacent part with the largest gain that has room for v
+      bool overweight = partWeight[p] > maxWeight[p];
+      TVertex best = p;
+      double bestGain = 0.0;
+      for(TVertex q : adjParts)
+        {
+        if(q == p || partWeight[q] + vwgt[v] > maxWeight[q])
+          continue;
+        double gain = conn[q] - conn[p];
+        if(gain > bestGain || (gain == bestGain && best == p && overweight && gain >= 0))
+          {
+          best = q;
+          bestGain = gain;
+          }
+        }
+
+      for(TVertex q : adjParts)
+        {
+        seen[q] = 0;
+        conn[q] = 0.0;
+        }
+
+      if(best == p)
+        continue;
+
+      // Move the vertex and revisit its neighborhood in the next pass
+      partWeight[p] -= vwgt[v];
+      partWeight[best] += vwgt[v];
+      partition[v] = best;
+      nMoves++;
+      if(!queued[v])
+        {
+        queued[v] = 1;
+        next.push_back(v);
+        }
+      for(TVertex e = xadj[v]; e < xadj[v+1]; e++)
+        {
+        if(!queued[adj[e]] && (!movable || movable[adj[e]]))
+          {
+          queued[adj[e]] = 1;
+          next.push_back(adj[e]);
+          }
+        }
+      }
+    queue.swap(next);
+    }
+
+  return nMoves;
+}
+
+#endif // __MultiResolutionPartition_h_
@@ -0,0 +1,50 @@
+#include "ProcessUsage.h"
+#include <chrono>
+
+#ifdef _WIN32
+#define NOMINMAX
+#define PSAPI_VERSION 2
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#endif
+
+ProcessUsage GetProcessUsage()
+{
+  ProcessUsage usage;
+  usage.WallSeconds = std::chrono::duration<double>(
+    std::chrono::steady_clock::now().time_since_epoch()).count();
+
+#ifdef _WIN32
+  FILETIME t_create, t_exit, t_kernel, t_user;
+  if(GetProcessTimes(GetCurrentProcess(), &t_create, &t_exit, &t_kernel, &t_user))
+  {
+    // File times count units of 100 ns
+    auto seconds = [](const FILETIME &t) {
+      return (((unsigned long long) t.dwHighDateTime << 32) | t.dwLowDateTime) * 1e-7;
+    };
+    usage.CPUSeconds = seconds(t_kernel) + seconds(t_user);
+  }
+
+  PROCESS_MEMORY_COUNTERS counters;
+  if(GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)))
+    usage.PeakResidentBytes = counters.PeakWorkingSetSize;
+#else
+  struct rusage ru;
+  if(getrusage(RUSAGE_SELF, &ru) == 0)
+  {
+    usage.CPUSeconds = ru.ru_utime.tv_sec + ru.ru_stime.tv_sec
+                       + 1e-6 * (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec);
+
+    // The peak size is in bytes on macOS and in kilobytes elsewhere
+#ifdef __APPLE__
+    usage.PeakResidentBytes = ru.ru_maxrss;
+#else
+    usage.PeakResidentBytes = (size_t) ru.ru_maxrss * 1024;
+#endif
+  }
+#endif
+
+  return usage;
+}
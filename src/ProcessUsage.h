@@ -0,0 +1,22 @@
+#ifndef __ProcessUsage_h_
+#define __ProcessUsage_h_
+
+#include <cstddef>
+
+/**
+ * Resources used by the process so far: the wall time since an arbitrary
+ * fixed point, the CPU time of all threads, user and system, and the peak
+ * resident set size. Differences between two readings give the use of the
+ * code between them, except for the peak size, which never decreases.
+ */
+struct ProcessUsage
+{
+  double WallSeconds = 0.0;
+  double CPUSeconds = 0.0;
+  size_t PeakResidentBytes = 0;
+};
+
+/** Get the resources used by the process so far */
+ProcessUsage GetProcessUsage();
+
+#endif // __ProcessUsage_h_
@@ -0,0 +1,699 @@
+#ifndef __StreamingGraphBuilder_h_
+#define __StreamingGraphBuilder_h_
+
+#include <itkImageFileReader.h>
+#include "MemoryMappedFile.h"
+#include "VoxelGraph.h"
+#include <algorithm>
+#include <limits>
+#include <memory>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+/**
+ * \class StreamingGraphBuilder
+ * \brief Builds the voxel graphs of the components of an image file that
+ * does not need to fit into memory
+ *
+ * The image is read in slabs of whole slices with a streaming ImageFileReader,
+ * and at most two neighboring slabs are held at any time. Each sweep over the
+ * slices keeps a rolling window of vertex flags and numbers, as in
+ * ImageToGraphFilter, and the graph uses the same vertices, weights, edge
+ * order and runs as that filter.
+ *
+ * FindComponents() labels the connected components of the pixels accepted
+ * by the weight functor, in the neighborhood set by SetConnectivity(), with
+ * a union-find over the runs of such pixels in each scanline, so that memory scales with the number of runs rather than
+ * voxels. The components are numbered from 1 in the order of decreasing
+ * size, like the output of RelabelComponentImageFilter. BuildComponentGraphs()
+ * then writes the graphs of selected components into a memory-mapped scratch
+ * file, and GetComponentSlab() recovers the component of every pixel of a
+ * slab, e.g., to label the output.
+ *
+ * ImageIO classes that cannot stream, e.g., for compressed files, read the
+ * whole image, which the reader then keeps instead of rereading it.
+ */
+template <class TImage, class TVertex, class TWeight, class TWeightFunctor>
+class StreamingGraphBuilder
+{
+public:
+  typedef TImage ImageType;
+  typedef typename TImage::PixelType PixelType;
+  typedef typename TImage::IndexType IndexType;
+  typedef typename TImage::RegionType RegionType;
+  typedef VoxelGraph<TVertex, TWeight> GraphType;
+  typedef itk::ImageFileReader<TImage> ReaderType;
+
+  static_assert(TImage::ImageDimension == 3, "StreamingGraphBuilder supports 3D images");
+
+  /** Size of the components, and the offset of their first voxel */
+  struct ComponentInfo
+    {
+    size_t Voxels = 0, Vertices = 0, Edges = 0, Runs = 0;
+    size_t FirstVoxel = 0;
+    };
+
+  /** Set the image file */
+  void SetFileName(const std::string &fn) { m_FileName = fn; }
+
+  /** Set the number of slices read at a time, at least 3 */
+  void SetSlabThickness(unsigned int n) { m_SlabThickness = std::max(3u, n); }
+  unsigned int GetSlabThickness() const { return m_SlabThickness; }
+
+  /** Set the weight functor */
+  void SetWeightFunctor(TWeightFunctor *functor) { m_WeightFunctor = functor; }
+
+  /** Make cuts along a plane cheap, as in ImageToGraphFilter */
+  void SetCutPlane(const VoxelCutPlane &plane) { m_CutPlane = plane; }
+
+  /** Set the neighborhood of the components and graphs: 6, 18 or 26 */
+  void SetConnectivity(unsigned int connectivity)
+    { CheckVoxelConnectivity(connectivity); m_Connectivity = connectivity; }
+  unsigned int GetConnectivity() const { return m_Connectivity; }
+
+  /** Set the scratch file that holds the graphs, which is removed when done */
+  void SetScratchFileName(const std::string &fn) { m_ScratchFileName = fn; }
+
+  /** Read the image header. Called by FindComponents() if needed */
+  void UpdateOutputInformation()
+    {
+    m_Reader = ReaderType::New();
+    m_Reader->SetFileName(m_FileName.c_str());
+    m_Reader->UpdateOutputInformation();
+    m_Region = m_Reader->GetOutput()->GetLargestPossibleRegion();
+    for(unsigned int d = 0; d < 3; d++)
+      m_Size[d] = m_Region.GetSize(d);
+    m_SliceSize = m_Size[0] * m_Size[1];
+    m_PaddedRowStride = m_Size[0] + 2;
+    m_PaddedSliceSize = m_PaddedRowStride * (m_Size[1] + 2);
+    for(unsigned int k = 0; k < 26; k++)
+      m_PaddedOffset[k] = VoxelNeighborOffsets[k][0] + VoxelNeighborOffsets[k][1] * (long) m_PaddedRowStride;
+    m_Slabs[0].Number = m_Slabs[1].Number = -1;
+    }
+
+  /** The image whose information (origin, spacing, etc.) the file provides */
+  const TImage *GetInformation() const { return m_Reader->GetOutput(); }
+
+  /** The largest region of the image */
+  const RegionType &GetRegion() const { return m_Region; }
+
+  /** Label the connected components, in one sweep over the file */
+  void FindComponents()
+    {
+    if(!m_Reader)
+      UpdateOutputInformation();
+    const long nz = (long) m_Size[2];
+
+    std::vector<unsigned char> flags[3];
+    for(unsigned int k = 0; k < 3; k++)
+      flags[k].assign(m_PaddedSliceSize, 0);
+    SliceRuns runs[2];
+
+    m_SliceRunStart.assign(nz + 1, 0);
+    m_RunComponent.clear();
+    std::vector<unsigned int> runVoxels, runVertices, runEdges;
+    std::vector<size_t> runFirstVoxel;
+
+    // Slice z is labeled when its flags are known, and counted once the
+    // flags of slice z + 1 are known as well
+    for(long z = 0; z <= nz; z++)
+      {
+      ComputeVertexFlags(z, flags[Slot(z)].data());
+      if(z < nz)
+        {
+        SliceRuns &curr = runs[z & 1];
+        FindRuns(flags[Slot(z)].data(), curr);
+        m_SliceRunStart[z+1] = m_SliceRunStart[z] + curr.Spans.size();
+        for(size_t r = m_SliceRunStart[z]; r < m_SliceRunStart[z+1]; r++)
+          m_RunComponent.push_back(r);
+        for(size_t y = 0; y < m_Size[1]; y++)
+          for(size_t i = curr.RowStart[y]; i < curr.RowStart[y+1]; i++)
+            runFirstVoxel.push_back(z * m_SliceSize + y * m_Size[0] + curr.Spans[i].X0);
+
+        // Join the adjacent runs of the previous row and slice. Beyond the
+        // faces, runs of neighboring rows touch at the corners of their
+        // ends, and the rows y - 1 and y + 1 of the previous slice are
+        // adjacent to row y by the edges of its voxels.
+        const size_t ext = m_Connectivity > 6 ? 1 : 0;
+        for(size_t y = 1; y < m_Size[1]; y++)
+          JoinRows(curr, y - 1, m_SliceRunStart[z], curr, y, m_SliceRunStart[z], ext);
+        if(z > 0)
+          {
+          const SliceRuns &last = runs[(z-1) & 1];
+          for(size_t y = 0; y < m_Size[1]; y++)
+            {
+            JoinRows(last, y, m_SliceRunStart[z-1], curr, y, m_SliceRunStart[z], ext);
+            if(m_Connectivity > 6)
+              {
+              const size_t extRows = m_Connectivity == 26 ? 1 : 0;
+              if(y > 0)
+                JoinRows(last, y - 1, m_SliceRunStart[z-1], curr, y, m_SliceRunStart[z], extRows);
+              if(y + 1 < m_Size[1])
+                JoinRows(last, y + 1, m_SliceRunStart[z-1], curr, y, m_SliceRunStart[z], extRows);
+              }
+            }
+          }
+        }
+      if(z > 0)
+        {
+        CountRuns(flags[Slot(z-2)].data(), flags[Slot(z-1)].data(), flags[Slot(z)].data(),
+                  runs[(z-1) & 1], runVoxels, runVertices, runEdges);
+        }
+      }
+
+    // Every run's parent precedes it, and the root of every set is its first
+    // run, so one pass in raster order numbers the sets in the order of their
+    // first voxel, replacing the parent of each run by the number of its set
+    std::vector<size_t> &comp = m_RunComponent;
+    size_t nSets = 0;
+    for(size_t r = 0; r < comp.size(); r++)
+      comp[r] = (comp[r] == r) ? nSets++ : comp[comp[r]];
+
+    std::vector<ComponentInfo> sets(nSets);
+    for(size_t r = 0; r < comp.size(); r++)
+      {
+      ComponentInfo &c = sets[comp[r]];
+      if(c.Voxels == 0)
+        c.FirstVoxel = runFirstVoxel[r];
+      c.Voxels += runVoxels[r];
+      c.Vertices += runVertices[r];
+      c.Edges += runEdges[r];
+      c.Runs += runVertices[r] > 0 ? 1 : 0;
+      }
+
+    // Number the components by decreasing size, starting with 1
+    std::vector<size_t> order(nSets), label(nSets);
+    for(size_t i = 0; i < nSets; i++)
+      order[i] = i;
+    std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+      return sets[a].Voxels > sets[b].Voxels;
+    });
+    m_Components.assign(1, ComponentInfo());
+    for(size_t i = 0; i < nSets; i++)
+      {
+      label[order[i]] = i + 1;
+      m_Components.push_back(sets[order[i]]);
+      }
+    for(size_t r = 0; r < comp.size(); r++)
+      comp[r] = label[comp[r]];
+    }
+
+  /** Number of components found, not counting the background */
+  size_t GetNumberOfComponents() const
+    { return m_Components.empty() ? 0 : m_Components.size() - 1; }
+
+  /** Size of component c, starting with 1 */
+  const ComponentInfo &GetComponent(size_t c) const { return m_Components[c]; }
+
+  /**
+   * Build the graphs of the components in one sweep over the file. Component
+   * c goes into blocks[compBlock[c]], and is skipped if compBlock[c] is
+   * negative or c is past the end of compBlock. The vertices of every block
+   * are numbered in raster order, and its runs refer to offsets in the whole
+   * image. The arrays are stored in the scratch file, along with an array of
+   * one vertex index per vertex for each block, returned in partitions.
+   */
+  void BuildComponentGraphs(const std::vector<int> &compBlock,
+                            std::vector<GraphType> &blocks,
+                            std::vector<TVertex *> &partitions)
+    {
+    const long nz = (long) m_Size[2];
+    const size_t nBlocks = blocks.size();
+
+    // Lay out the arrays of the blocks in the scratch file, summing up the
+    // sizes of the components that share a block
+    std::vector<ComponentInfo> info(nBlocks);
+    for(size_t c = 1; c < m_Components.size() && c < compBlock.size(); c++)
+      if(compBlock[c] >= 0)
+        {
+        ComponentInfo &bi = info[compBlock[c]];
+        bi.Voxels += m_Components[c].Voxels;
+        bi.Vertices += m_Components[c].Vertices;
+        bi.Edges += m_Components[c].Edges;
+        bi.Runs += m_Components[c].Runs;
+        }
+
+    std::vector<size_t> offset(6 * nBlocks + 1, 0);
+    for(size_t b = 0; b < nBlocks; b++)
+      {
+      CheckGraphSize(info[b].Edges);
+      const size_t bytes[6] = {
+        (info[b].Vertices + 1) * sizeof(TVertex), info[b].Edges * sizeof(TVertex),
+        info[b].Vertices * sizeof(TWeight), info[b].Edges * sizeof(TWeight),
+        (info[b].Runs + 1) * sizeof(VoxelRun), info[b].Vertices * sizeof(TVertex) };
+      for(unsigned int k = 0; k < 6; k++)
+        offset[6*b+k+1] = Align(offset[6*b+k] + bytes[k]);
+      }
+
+    m_Scratch = std::make_shared<MemoryMappedFile>();
+    m_Scratch->Create(m_ScratchFileName, offset[6 * nBlocks], true);
+
+    char *base = m_Scratch->GetPointer();
+    partitions.resize(nBlocks);
+    for(size_t b = 0; b < nBlocks; b++)
+      {
+      blocks[b].SetArrays(
+        info[b].Vertices, info[b].Edges, info[b].Runs,
+        (TVertex *) (base + offset[6*b]), (TVertex *) (base + offset[6*b+1]),
+        (TWeight *) (base + offset[6*b+2]), (TWeight *) (base + offset[6*b+3]),
+        (VoxelRun *) (base + offset[6*b+4]), m_Scratch);
+      partitions[b] = (TVertex *) (base + offset[6*b+5]);
+      }
+
+    // Block of every run
+    auto runBlock = [&](size_t r) {
+      size_t c = m_RunComponent[r];
+      return c < compBlock.size() ? compBlock[c] : -1;
+    };
+
+    // Rolling window of vertex flags and numbers, as in ImageToGraphFilter
+    std::vector<unsigned char> flags[3];
+    std::vector<TVertex> ids[3];
+    for(unsigned int k = 0; k < 3; k++)
+      {
+      flags[k].assign(m_PaddedSliceSize, 0);
+      ids[k].assign(m_PaddedSliceSize, NoVertex);
+      }
+    SliceRuns runs[2];
+    std::vector<size_t> numbered(nBlocks, 0);
+    std::vector<Cursor> cursor(nBlocks);
+
+    // Number the vertices of the first slice
+    ComputeVertexFlags(0, flags[Slot(0)].data());
+    ComputeVertexFlags(1, flags[Slot(1)].data());
+    if(nz > 0)
+      {
+      FindRuns(flags[Slot(0)].data(), runs[0]);
+      NumberVertices(flags[Slot(-1)].data(), flags[Slot(0)].data(), flags[Slot(1)].data(),
+                     runs[0], 0, runBlock, numbered, ids[Slot(0)].data());
+      }
+
+    for(long z = 0; z < nz; z++)
+      {
+      // Number the vertices of the next slice, which needs the flags of the
+      // slice after it, then emit the vertices and edges of slice z
+      ComputeVertexFlags(z + 2, flags[Slot(z + 2)].data());
+      if(z + 1 < nz)
+        {
+        FindRuns(flags[Slot(z + 1)].data(), runs[(z + 1) & 1]);
+        NumberVertices(flags[Slot(z)].data(), flags[Slot(z + 1)].data(), flags[Slot(z + 2)].data(),
+                       runs[(z + 1) & 1], m_SliceRunStart[z + 1], runBlock, numbered,
+                       ids[Slot(z + 1)].data());
+        }
+      else
+        {
+        std::fill(ids[Slot(z + 1)].begin(), ids[Slot(z + 1)].end(), NoVertex);
+        }
+
+      FillSlice(z, ids[Slot(z - 1)].data(), ids[Slot(z)].data(), ids[Slot(z + 1)].data(),
+                runs[z & 1], m_SliceRunStart[z], runBlock, blocks, cursor);
+      }
+
+    // Close the adjacency index and run table of every block
+    for(size_t b = 0; b < nBlocks; b++)
+      {
+      blocks[b].GetAdjacencyIndex()[cursor[b].Vertices] = static_cast<TVertex>(cursor[b].Edges);
+      blocks[b].GetVertexRuns()[cursor[b].Runs] = VoxelRun { m_SliceSize * nz, cursor[b].Vertices };
+      }
+    }
+
+  /**
+   * Get the component of every pixel of the slices [z0, z1), or 0 for the
+   * background. Requires FindComponents().
+   */
+  void GetComponentSlab(long z0, long z1, size_t *comp)
+    {
+    std::vector<unsigned char> flags(m_PaddedSliceSize, 0);
+    SliceRuns runs;
+    for(long z = z0; z < z1; z++)
+      {
+      size_t *slice = comp + (z - z0) * m_SliceSize;
+      std::fill(slice, slice + m_SliceSize, 0);
+      ComputeVertexFlags(z, flags.data());
+      FindRuns(flags.data(), runs);
+      for(size_t y = 0; y < m_Size[1]; y++)
+        {
+        for(size_t i = runs.RowStart[y]; i < runs.RowStart[y+1]; i++)
+          {
+          const Span &s = runs.Spans[i];
+          std::fill(slice + y * m_Size[0] + s.X0, slice + y * m_Size[0] + s.X1,
+                    m_RunComponent[m_SliceRunStart[z] + i]);
+          }
+        }
+      }
+    }
+
+protected:
+
+  /** Vertex number assigned to pixels that are not in the graph */
+  static constexpr TVertex NoVertex = static_cast<TVertex>(-1);
+
+  /** A run of flagged pixels in a row, from X0 up to X1 */
+  struct Span
+    {
+    size_t X0, X1;
+    };
+
+  /** The runs of flagged pixels of a slice, in raster order */
+  struct SliceRuns
+    {
+    std::vector<Span> Spans;
+    std::vector<size_t> RowStart;
+    };
+
+  /** The vertex, edge and run of a block that are filled next */
+  struct Cursor
+    {
+    size_t Vertices = 0, Edges = 0, Runs = 0;
+    };
+
+  /** A slab of slices read from the file */
+  struct Slab
+    {
+    long Number = -1;
+    std::vector<PixelType> Pixels;
+    };
+
+  static unsigned int Slot(long z) { return (unsigned int) ((z + 3) % 3); }
+
+  static size_t Align(size_t bytes) { return (bytes + 63) & ~(size_t) 63; }
+
+  void CheckGraphSize(size_t nEdges)
+    {
+    if(nEdges > (size_t) std::numeric_limits<TVertex>::max())
+      {
+      std::ostringstream oss;
+      oss << "Graph has " << nEdges << " directed edges, which does not fit into the "
+          << 8 * sizeof(TVertex) << "-bit vertex index type";
+      throw std::runtime_error(oss.str());
+      }
+    }
+
+  /**
+   * Get the pixels of slice z. The slab holding it is read if necessary,
+   * keeping the slab before it, if held, since the sweeps move forward.
+   */
+  const PixelType *GetSlice(long z)
+    {
+    long k = z / m_SlabThickness;
+    for(unsigned int i = 0; i < 2; i++)
+      if(m_Slabs[i].Number == k)
+        return m_Slabs[i].Pixels.data() + (z - k * m_SlabThickness) * m_SliceSize;
+
+    Slab &slab = m_Slabs[m_Slabs[0].Number == k - 1 ? 1 : 0];
+    long z0 = k * m_SlabThickness;
+    long z1 = std::min<long>(z0 + m_SlabThickness, (long) m_Size[2]);
+    RegionType region = m_Region;
+    region.SetIndex(2, m_Region.GetIndex(2) + z0);
+    region.SetSize(2, z1 - z0);
+
+    TImage *output = m_Reader->GetOutput();
+    output->SetRequestedRegion(region);
+    m_Reader->Update();
+    const PixelType *src = output->GetBufferPointer() + output->ComputeOffset(region.GetIndex());
+    slab.Pixels.assign(src, src + region.GetNumberOfPixels());
+    slab.Number = k;
+
+    // A reader that streams holds a copy of this slab, which is not needed
+    // anymore, while one that cannot stream holds the whole image
+    if(output->GetBufferedRegion() != m_Region)
+      output->ReleaseData();
+
+    return slab.Pixels.data() + (z - z0) * m_SliceSize;
+    }
+
+  IndexType GetPixelIndex(size_t x, size_t y, long z)
+    {
+    IndexType idx = m_Region.GetIndex();
+    idx[0] += x;
+    idx[1] += y;
+    idx[2] += z;
+    return idx;
+    }
+
+  typename TWeightFunctor::Point GetPixelPoint(const IndexType &idx)
+    {
+    typename TWeightFunctor::Point x;
+    m_Reader->GetOutput()->TransformIndexToPhysicalPoint(idx, x);
+    return x;
+    }
+
+  /** Ask the weight functor which pixels of slice z may be vertices */
+  void ComputeVertexFlags(long z, unsigned char *flags)
+    {
+    if(z < 0 || z >= (long) m_Size[2])
+      {
+      std::fill(flags, flags + m_PaddedSliceSize, 0);
+      return;
+      }
+
+    const PixelType *slice = GetSlice(z);
+    for(size_t y = 0; y < m_Size[1]; y++)
+      {
+      const PixelType *row = slice + y * m_Size[0];
+      unsigned char *rowFlags = flags + (y + 1) * m_PaddedRowStride + 1;
+      for(size_t x = 0; x < m_Size[0]; x++)
+        {
+        if constexpr(TWeightFunctor::NeedsPhysicalPoint)
+          rowFlags[x] = m_WeightFunctor->IsPixelAVertex(row[x], GetPixelPoint(GetPixelIndex(x, y, z))) ? 1 : 0;
+        else
+          rowFlags[x] = m_WeightFunctor->IsPixelAVertex(row[x]) ? 1 : 0;
+        }
+      }
+    }
+
+  /** List the runs of flagged pixels of a slice */
+  void FindRuns(const unsigned char *flags, SliceRuns &runs)
+    {
+    runs.Spans.clear();
+    runs.RowStart.resize(m_Size[1] + 1);
+    for(size_t y = 0; y < m_Size[1]; y++)
+      {
+      runs.RowStart[y] = runs.Spans.size();
+      const unsigned char *row = flags + (y + 1) * m_PaddedRowStride + 1;
+      for(size_t x = 0; x < m_Size[0]; x++)
+        {
+        if(row[x] && (x == 0 || !row[x-1]))
+          runs.Spans.push_back(Span { x, x + 1 });
+        else if(row[x])
+          runs.Spans.back().X1 = x + 1;
+        }
+      }
+    runs.RowStart[m_Size[1]] = runs.Spans.size();
+    }
+
+  /** Find the set of a run, halving the paths on the way */
+  size_t Find(size_t r)
+    {
+    std::vector<size_t> &parent = m_RunComponent;
+    while(parent[r] != r)
+      {
+      parent[r] = parent[parent[r]];
+      r = parent[r];
+      }
+    return r;
+    }
+
+  /** Join the sets of two runs, keeping the earlier root */
+  void Join(size_t a, size_t b)
+    {
+    a = Find(a);
+    b = Find(b);
+    if(a < b)
+      m_RunComponent[b] = a;
+    else if(b < a)
+      m_RunComponent[a] = b;
+    }
+
+  /**
+   * Join the runs of two rows, whose runs are numbered from firstA and
+   * firstB, that overlap after extending them by ext pixels on each side.
+   * A run that ends first cannot reach the later runs of the other row.
+   */
+  void JoinRows(const SliceRuns &a, size_t ya, size_t firstA,
+                const SliceRuns &b, size_t yb, size_t firstB, size_t ext)
+    {
+    size_t i = a.RowStart[ya], j = b.RowStart[yb];
+    while(i < a.RowStart[ya+1] && j < b.RowStart[yb+1])
+      {
+      const Span &sa = a.Spans[i], &sb = b.Spans[j];
+      if(sa.X0 < sb.X1 + ext && sb.X0 < sa.X1 + ext)
+        Join(firstA + i, firstB + j);
+      if(sa.X1 < sb.X1)
+        i++;
+      else
+        j++;
+      }
+    }
+
+  /** Number of flagged neighbors of the pixel at p in a padded slice */
+  unsigned int GetDegree(const unsigned char *prev, const unsigned char *curr,
+                         const unsigned char *next, size_t p)
+    {
+    const unsigned char *slices[] = { prev, curr, next };
+    unsigned int degree = 0;
+    for(unsigned int k = 0; k < m_Connectivity; k++)
+      degree += slices[VoxelNeighborOffsets[k][2] + 1][p + m_PaddedOffset[k]];
+    return degree;
+    }
+
+  /** Count the voxels, vertices and directed edges of the runs of a slice */
+  void CountRuns(const unsigned char *prev, const unsigned char *curr, const unsigned char *next,
+                 const SliceRuns &runs, std::vector<unsigned int> &runVoxels,
+                 std::vector<unsigned int> &runVertices, std::vector<unsigned int> &runEdges)
+    {
+    const size_t s = m_PaddedRowStride;
+    for(size_t y = 0; y < m_Size[1]; y++)
+      {
+      for(size_t i = runs.RowStart[y]; i < runs.RowStart[y+1]; i++)
+        {
+        unsigned int nVertices = 0, nEdges = 0;
+        for(size_t p = (y + 1) * s + 1 + runs.Spans[i].X0; p < (y + 1) * s + 1 + runs.Spans[i].X1; p++)
+          {
+          unsigned int degree = GetDegree(prev, curr, next, p);
+          nVertices += degree ? 1 : 0;
+          nEdges += degree;
+          }
+        runVoxels.push_back((unsigned int) (runs.Spans[i].X1 - runs.Spans[i].X0));
+        runVertices.push_back(nVertices);
+        runEdges.push_back(nEdges);
+        }
+      }
+    }
+
+  /**
+   * Number the vertices of a slice within their blocks, continuing from the
+   * counts in numbered. A flagged pixel is a vertex if it has a flagged
+   * neighbor, which always belongs to the same component.
+   */
+  template <class TRunBlock>
+  void NumberVertices(const unsigned char *prev, const unsigned char *curr, const unsigned char *next,
+                      const SliceRuns &runs, size_t firstRun, TRunBlock runBlock,
+                      std::vector<size_t> &numbered, TVertex *ids)
+    {
+    const size_t s = m_PaddedRowStride;
+    std::fill(ids, ids + m_PaddedSliceSize, NoVertex);
+    for(size_t y = 0; y < m_Size[1]; y++)
+      {
+      for(size_t i = runs.RowStart[y]; i < runs.RowStart[y+1]; i++)
+        {
+        int b = runBlock(firstRun + i);
+        if(b < 0)
+          continue;
+        for(size_t p = (y + 1) * s + 1 + runs.Spans[i].X0; p < (y + 1) * s + 1 + runs.Spans[i].X1; p++)
+          if(GetDegree(prev, curr, next, p))
+            ids[p] = static_cast<TVertex>(numbered[b]++);
+        }
+      }
+    }
+
+  /**
+   * Write the adjacency lists, weights and runs of the vertices of slice z
+   * into their blocks. The neighbors of each vertex are listed in the order
+   * of VoxelNeighborOffsets, as in ImageToGraphFilter.
+   */
+  template <class TRunBlock>
+  void FillSlice(long z, const TVertex *prev, const TVertex *curr, const TVertex *next,
+                 const SliceRuns &runs, size_t firstRun, TRunBlock runBlock,
+                 std::vector<GraphType> &blocks, std::vector<Cursor> &cursor)
+    {
+    const long s = (long) m_PaddedRowStride;
+    const long nx = (long) m_Size[0];
+    const PixelType *slice = GetSlice(z);
+    const PixelType *slicePrev = z > 0 ? GetSlice(z - 1) : nullptr;
+    const PixelType *sliceNext = z + 1 < (long) m_Size[2] ? GetSlice(z + 1) : nullptr;
+    const PixelType *slices[] = { slicePrev, slice, sliceNext };
+    const TVertex *ids[] = { prev, curr, next };
+
+    for(size_t y = 0; y < m_Size[1]; y++)
+      {
+      for(size_t i = runs.RowStart[y]; i < runs.RowStart[y+1]; i++)
+        {
+        const Span &span = runs.Spans[i];
+        size_t p = (y + 1) * s + 1 + span.X0;
+        int b = runBlock(firstRun + i);
+        if(b < 0 || curr[p] == NoVertex)
+          continue;
+
+        // A run with a vertex consists of vertices only
+        GraphType &g = blocks[b];
+        Cursor &c = cursor[b];
+        size_t pix = y * m_Size[0] + span.X0;
+        g.GetVertexRuns()[c.Runs++] = VoxelRun { z * m_SliceSize + pix, c.Vertices };
+
+        for(size_t x = span.X0; x < span.X1; x++, p++, pix++)
+          {
+          g.GetAdjacencyIndex()[c.Vertices] = static_cast<TVertex>(c.Edges);
+          IndexType idx = GetPixelIndex(x, y, z);
+          typename TWeightFunctor::Point pt;
+          if constexpr(TWeightFunctor::NeedsPhysicalPoint)
+            {
+            pt = GetPixelPoint(idx);
+            g.GetVertexWeights()[c.Vertices++] = m_WeightFunctor->GetVertexWeight(slice[pix], pt);
+            }
+          else
+            {
+            g.GetVertexWeights()[c.Vertices++] = m_WeightFunctor->GetVertexWeight(slice[pix]);
+            }
+
+          for(unsigned int k = 0; k < m_Connectivity; k++)
+            {
+            const int *o = VoxelNeighborOffsets[k];
+            TVertex nbr = ids[o[2] + 1][(long) p + m_PaddedOffset[k]];
+            if(nbr == NoVertex)
+              continue;
+
+            PixelType iNbr = slices[o[2] + 1][(long) pix + o[0] + o[1] * nx];
+            TWeight weight;
+            if constexpr(TWeightFunctor::NeedsPhysicalPoint)
+              {
+              IndexType idxNbr = idx;
+              for(unsigned int d = 0; d < 3; d++)
+                idxNbr[d] += o[d];
+              weight = m_WeightFunctor->GetEdgeWeight(slice[pix], pt, iNbr, GetPixelPoint(idxNbr));
+              }
+            else
+              {
+              weight = m_WeightFunctor->GetEdgeWeight(slice[pix], iNbr);
+              }
+
+            // Scale by the distance to the neighbor, and the edges that do
+            // not cross the cut plane by its strength
+            weight *= static_cast<TWeight>(GetVoxelNeighborWeight(m_Connectivity, k));
+            if(m_CutPlane.IsEnabled())
+              weight *= static_cast<TWeight>(m_CutPlane.GetEdgeFactor(idx, o));
+            g.GetAdjacency()[c.Edges] = nbr;
+            g.GetEdgeWeights()[c.Edges++] = weight;
+            }
+          }
+        }
+      }
+    }
+
+  std::string m_FileName, m_ScratchFileName;
+  unsigned int m_SlabThickness = 16;
+  TWeightFunctor *m_WeightFunctor = nullptr;
+  VoxelCutPlane m_CutPlane;
+  unsigned int m_Connectivity = 6;
+
+  typename ReaderType::Pointer m_Reader;
+  RegionType m_Region;
+  size_t m_Size[3] = { 0, 0, 0 };
+  size_t m_SliceSize = 0, m_PaddedRowStride = 0, m_PaddedSliceSize = 0;
+  long m_PaddedOffset[26] = {};
+  Slab m_Slabs[2];
+
+  /** First run of every slice, and the component (or, while labeling, the
+   * parent in the union-find) of every run */
+  std::vector<size_t> m_SliceRunStart, m_RunComponent;
+
+  /** Sizes of the components, starting with the background */
+  std::vector<ComponentInfo> m_Components;
+
+  /** Scratch file holding the graphs, shared with them */
+  std::shared_ptr<MemoryMappedFile> m_Scratch;
+};
+
+#endif // __StreamingGraphBuilder_h_
@@ -0,0 +1,425 @@
+#ifndef __VoxelGraph_h_
+#define __VoxelGraph_h_
+
+#include <cstddef>
+#include <limits>
+#include <memory>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+/**
+ * A run of vertices that occupy consecutive pixels of an image scanline.
+ * Vertices of voxel graphs are numbered in raster order, so the pixels of
+ * the vertices are fully described by the runs, which take much less memory
+ * than an image index per vertex. A table of runs ends with a sentinel whose
+ * FirstVertex is the number of vertices, so run r holds the vertices from
+ * runs[r].FirstVertex up to runs[r+1].FirstVertex.
+ */
+struct VoxelRun
+{
+  /** Offset of the pixel of the first vertex in the image buffer */
+  size_t BufferOffset;
+
+  /** Number of the first vertex in the run */
+  size_t FirstVertex;
+};
+
+/**
+ * Offsets (x, y, z) of the neighbors of a voxel. The 6 face neighbors come
+ * first, in the order -x, +x, -y, +y, -z, +z, followed by the 12 edge
+ * neighbors and the 8 corner neighbors, each in raster order, so that the
+ * neighborhoods of 6, 18 and 26 voxels are the first 6, 18 or 26 entries.
+ */
+constexpr int VoxelNeighborOffsets[26][3] = {
+  {-1, 0, 0}, { 1, 0, 0}, { 0,-1, 0}, { 0, 1, 0}, { 0, 0,-1}, { 0, 0, 1},
+  { 0,-1,-1}, {-1, 0,-1}, { 1, 0,-1}, { 0, 1,-1}, {-1,-1, 0}, { 1,-1, 0},
+  {-1, 1, 0}, { 1, 1, 0}, { 0,-1, 1}, {-1, 0, 1}, { 1, 0, 1}, { 0, 1, 1},
+  {-1,-1,-1}, { 1,-1,-1}, {-1, 1,-1}, { 1, 1,-1}, {-1,-1, 1}, { 1,-1, 1},
+  {-1, 1, 1}, { 1, 1, 1} };
+
+/** Throw unless a voxel graph can have this connectivity */
+inline void CheckVoxelConnectivity(unsigned int connectivity)
+{
+  if(connectivity != 6 && connectivity != 18 && connectivity != 26)
+    throw std::invalid_argument("The connectivity must be 6, 18 or 26");
+}
+
+/**
+ * Factor of the weights of the edges to neighbor k, which is inversely
+ * proportional to the distance in voxels and rounded: 10, 7 and 6 for face,
+ * edge and corner neighbors, or 1 for all edges in the 6-neighborhood, so
+ * that its graphs keep their unit weights.
+ */
+inline long GetVoxelNeighborWeight(unsigned int connectivity, unsigned int k)
+{
+  if(connectivity == 6)
+    return 1;
+  return k < 6 ? 10 : k < 18 ? 7 : 6;
+}
+
+/**
+ * Label the 18-connected components of the nonzero pixels of an image buffer
+ * of the given size in the order of their first voxel, like ITK's
+ * ConnectedComponentImageFilter, which only handles 6 and 26 neighbors. This
+ * is a union-find over the voxels, whose root is always the first voxel of
+ * the set. Returns the number of components, and throws if they do not fit
+ * into the label type.
+ */
+template <class TPixel, class TLabel>
+size_t LabelVoxelComponents18(const TPixel *mask, const size_t size[3], TLabel *label)
+{
+  const long nx = size[0], ny = size[1], nz = size[2];
+  const size_t n = size[0] * size[1] * size[2];
+
+  std::vector<size_t> comp(n);
+  auto find = [&comp](size_t r) {
+    while(comp[r] != r)
+      r = comp[r] = comp[comp[r]];
+    return r;
+  };
+
+  // Join every voxel with its neighbors that precede it in raster order
+  for(long z = 0, i = 0; z < nz; z++)
+    for(long y = 0; y < ny; y++)
+      for(long x = 0; x < nx; x++, i++)
+        {
+        comp[i] = i;
+        if(!mask[i])
+          continue;
+        for(unsigned int k = 0; k < 18; k++)
+          {
+          const int *o = VoxelNeighborOffsets[k];
+          if(o[2] > 0 || (o[2] == 0 && (o[1] > 0 || (o[1] == 0 && o[0] > 0))))
+            continue;
+          if(x + o[0] < 0 || x + o[0] >= nx || y + o[1] < 0 || y + o[1] >= ny || z + o[2] < 0)
+            continue;
+          long j = i + o[0] + nx * (o[1] + ny * o[2]);
+          if(!mask[j])
+            continue;
+          size_t a = find(i), b = find(j);
+          if(a < b)
+            comp[b] = a;
+          else if(b < a)
+            comp[a] = b;
+          }
+        }
+
+  // The parent of every voxel precedes it, so one pass numbers the sets
+  size_t nSets = 0;
+  for(size_t i = 0; i < n; i++)
+    {
+    if(!mask[i])
+      {
+      label[i] = 0;
+      continue;
+      }
+    comp[i] = (comp[i] == i) ? ++nSets : comp[comp[i]];
+    if(nSets > (size_t) std::numeric_limits<TLabel>::max())
+      throw std::runtime_error("Too many connected components for the label image");
+    label[i] = static_cast<TLabel>(comp[i]);
+    }
+  return nSets;
+}
+
+/**
+ * A plane along which the builders of voxel graphs make cuts cheap. The
+ * plane lies between slices Slice - 1 and Slice of dimension Dimension (in
+ * image index coordinates), and is off if Dimension is negative. The edges
+ * that cross it keep their weights, and the weights of all the other edges
+ * are multiplied by Strength, so that the weights stay integers.
+ */
+struct VoxelCutPlane
+{
+  int Dimension = -1;
+  long Slice = 0;
+  long Strength = 1;
+
+  /** Whether there is a plane */
+  bool IsEnabled() const { return Dimension >= 0; }
+
+  /**
+   * Factor of the weight of the edge from the pixel at index idx to its
+   * neighbor at an offset, e.g., one of VoxelNeighborOffsets
+   */
+  template <class TIndex>
+  long GetEdgeFactor(const TIndex &idx, const int *offset) const
+    {
+    int o = offset[Dimension];
+    bool crosses = (o > 0 && idx[Dimension] + 1 == Slice) || (o < 0 && idx[Dimension] == Slice);
+    return crosses ? 1 : Strength;
+    }
+};
+
+/**
+ * \class VoxelGraph
+ * \brief A graph of image voxels in compressed sparse row format
+ *
+ * The graph is stored in the compressed sparse row format used by METIS,
+ * along with the vertex runs that map it back to an image buffer. It has
+ * the same accessors as ImageToGraphFilter, so the functions in METISTools
+ * accept either one.
+ *
+ * The arrays are either allocated by the graph itself, or live elsewhere,
+ * e.g., in a memory-mapped file, in which case a shared owner keeps them
+ * alive. Copies of a graph share its arrays.
+ */
+template <class TVertex, class TWeight = TVertex>
+class VoxelGraph
+{
+public:
+  typedef TVertex VertexType;
+  typedef TWeight WeightType;
+  typedef VoxelRun VertexRun;
+
+  /** Allocate the arrays for a graph of a given size */
+  void Allocate(size_t nVertices, size_t nEdges, size_t nRuns)
+    {
+    auto storage = std::make_shared<Storage>();
+    storage->AdjacencyIndex.resize(nVertices + 1);
+    storage->VertexWeights.resize(nVertices);
+    storage->Adjacency.resize(nEdges);
+    storage->EdgeWeights.resize(nEdges);
+    storage->VertexRuns.resize(nRuns + 1);
+    SetStorage(storage);
+    }
+
+  /** Take over the arrays of a graph built elsewhere, without copying */
+  void Assign(std::vector<TVertex> &&xadj, std::vector<TVertex> &&adjncy,
+              std::vector<TWeight> &&vwgt, std::vector<TWeight> &&adjwgt,
+              std::vector<VertexRun> &&runs)
+    {
+    auto storage = std::make_shared<Storage>();
+    storage->AdjacencyIndex = std::move(xadj);
+    storage->Adjacency = std::move(adjncy);
+    storage->VertexWeights = std::move(vwgt);
+    storage->EdgeWeights = std::move(adjwgt);
+    storage->VertexRuns = std::move(runs);
+    SetStorage(storage);
+    }
+
+  /**
+   * Use arrays that are not allocated by the graph. The arrays hold nVertices
+   * + 1 adjacency indices, nEdges edges and nRuns runs plus the sentinel, and
+   * stay valid for as long as owner is held.
+   */
+  void SetArrays(size_t nVertices, size_t nEdges, size_t nRuns,
+                 TVertex *xadj, TVertex *adjncy, TWeight *vwgt, TWeight *adjwgt,
+                 VertexRun *runs, std::shared_ptr<void> owner)
+    {
+    m_NumberOfVertices = nVertices;
+    m_NumberOfEdges = nEdges;
+    m_NumberOfVertexRuns = nRuns;
+    m_AdjacencyIndex = xadj;
+    m_Adjacency = adjncy;
+    m_VertexWeights = vwgt;
+    m_EdgeWeights = adjwgt;
+    m_VertexRuns = runs;
+    m_Owner = std::move(owner);
+    }
+
+  /** Release the arrays held by the graph */
+  void Clear()
+    {
+    SetArrays(0, 0, 0, nullptr, nullptr, nullptr, nullptr, nullptr, nullptr);
+    }
+
+  /** Get the number of vertices */
+  size_t GetNumberOfVertices() const { return m_NumberOfVertices; }
+
+  /** Get the number of directional edges (2x symmetric edges) */
+  size_t GetNumberOfEdges() const { return m_NumberOfEdges; }
+
+  /** Get the number of vertex runs, not counting the sentinel */
+  size_t GetNumberOfVertexRuns() const { return m_NumberOfVertexRuns; }
+
+  /** Get the adjacency index */
+  TVertex *GetAdjacencyIndex() { return m_AdjacencyIndex; }
+
+  /** Get the adjacency list */
+  TVertex *GetAdjacency() { return m_Adjacency; }
+
+  /** Get the array of vertex weights */
+  TWeight *GetVertexWeights() { return m_VertexWeights; }
+
+  /** Get the array of edge weights */
+  TWeight *GetEdgeWeights() { return m_EdgeWeights; }
+
+  /** Get the table of vertex runs, followed by the sentinel */
+  VertexRun *GetVertexRuns() { return m_VertexRuns; }
+
+  /** Approximate memory used by the graph, in bytes */
+  size_t GetMemorySize() const
+    {
+    if(!m_AdjacencyIndex)
+      return 0;
+    return (m_NumberOfVertices + 1 + m_NumberOfEdges) * sizeof(TVertex)
+      + (m_NumberOfVertices + m_NumberOfEdges) * sizeof(TWeight)
+      + (m_NumberOfVertexRuns + 1) * sizeof(VertexRun);
+    }
+
+protected:
+  /** Arrays allocated by the graph itself */
+  struct Storage
+    {
+    std::vector<TVertex> AdjacencyIndex, Adjacency;
+    std::vector<TWeight> VertexWeights, EdgeWeights;
+    std::vector<VertexRun> VertexRuns;
+    };
+
+  void SetStorage(const std::shared_ptr<Storage> &s)
+    {
+    SetArrays(s->VertexWeights.size(), s->Adjacency.size(),
+              s->VertexRuns.empty() ? 0 : s->VertexRuns.size() - 1,
+              s->AdjacencyIndex.data(), s->Adjacency.data(),
+              s->VertexWeights.data(), s->EdgeWeights.data(),
+              s->VertexRuns.data(), s);
+    }
+
+  size_t m_NumberOfVertices = 0, m_NumberOfEdges = 0, m_NumberOfVertexRuns = 0;
+  TVertex *m_AdjacencyIndex = nullptr;
+  TVertex *m_Adjacency = nullptr;
+  TWeight *m_VertexWeights = nullptr;
+  TWeight *m_EdgeWeights = nullptr;
+  VertexRun *m_VertexRuns = nullptr;
+  std::shared_ptr<void> m_Owner;
+};
+
+/**
+ * Split a voxel graph into subgraphs, one per block, in a single pass over
+ * its vertices. Every run of vertices is assigned to a block by runBlock, or
+ * dropped if its block is negative. Vertices keep their raster order within
+ * each block, so the runs of the subgraphs still map them to the image.
+ * Vertices of different blocks must not be adjacent, which holds when the
+ * blocks are connected components computed with the graph's connectivity;
+ * edges to dropped vertices are removed.
+ */
+template <class TGraph, class TVertex, class TWeight>
+void SplitVoxelGraph(TGraph *graph, const std::vector<int> &runBlock,
+                     std::vector<VoxelGraph<TVertex, TWeight> > &blocks)
+{
+  const TVertex noVertex = static_cast<TVertex>(-1);
+  const size_t nRuns = graph->GetNumberOfVertexRuns();
+  const VoxelRun *runs = graph->GetVertexRuns();
+  const TVertex *xadj = graph->GetAdjacencyIndex();
+  const TVertex *adj = graph->GetAdjacency();
+
+  // Number the vertices within their blocks and count the runs
+  std::vector<TVertex> local(graph->GetNumberOfVertices(), noVertex);
+  std::vector<size_t> nVertices(blocks.size(), 0), nEdges(blocks.size(), 0);
+  std::vector<size_t> nBlockRuns(blocks.size(), 0);
+  for(size_t r = 0; r < nRuns; r++)
+    {
+    int b = runBlock[r];
+    if(b < 0)
+      continue;
+    for(size_t v = runs[r].FirstVertex; v < runs[r+1].FirstVertex; v++)
+      local[v] = static_cast<TVertex>(nVertices[b]++);
+    nBlockRuns[b]++;
+    }
+
+  // Count the edges that remain in each block
+  for(size_t r = 0; r < nRuns; r++)
+    {
+    int b = runBlock[r];
+    if(b < 0)
+      continue;
+    for(size_t v = runs[r].FirstVertex; v < runs[r+1].FirstVertex; v++)
+      for(TVertex k = xadj[v]; k < xadj[v+1]; k++)
+        if(local[adj[k]] != noVertex)
+          nEdges[b]++;
+    }
+
+  // Fill the blocks
+  for(size_t b = 0; b < blocks.size(); b++)
+    {
+    blocks[b].Allocate(nVertices[b], nEdges[b], nBlockRuns[b]);
+    nVertices[b] = nEdges[b] = nBlockRuns[b] = 0;
+    }
+  for(size_t r = 0; r < nRuns; r++)
+    {
+    int b = runBlock[r];
+    if(b < 0)
+      continue;
+
+    VoxelGraph<TVertex, TWeight> &block = blocks[b];
+    block.GetVertexRuns()[nBlockRuns[b]++] = VoxelRun { runs[r].BufferOffset, nVertices[b] };
+    for(size_t v = runs[r].FirstVertex; v < runs[r+1].FirstVertex; v++)
+      {
+      size_t iv = nVertices[b]++;
+      block.GetAdjacencyIndex()[iv] = static_cast<TVertex>(nEdges[b]);
+      block.GetVertexWeights()[iv] = graph->GetVertexWeights()[v];
+      for(TVertex k = xadj[v]; k < xadj[v+1]; k++)
+        {
+        if(local[adj[k]] == noVertex)
+          continue;
+        size_t ie = nEdges[b]++;
+        block.GetAdjacency()[ie] = local[adj[k]];
+        block.GetEdgeWeights()[ie] = graph->GetEdgeWeights()[k];
+        }
+      }
+    }
+
+  // Close the adjacency index and run table of every block
+  for(size_t b = 0; b < blocks.size(); b++)
+    {
+    blocks[b].GetAdjacencyIndex()[nVertices[b]] = static_cast<TVertex>(nEdges[b]);
+    blocks[b].GetVertexRuns()[nBlockRuns[b]] = VoxelRun { runs[nRuns].BufferOffset, nVertices[b] };
+    }
+}
+
+/**
+ * Split a graph into the subgraphs induced by the parts of a partition, in a
+ * single pass over its vertices. The vertices keep their order within each
+ * part, and vertexMaps[p] receives the vertex of the graph for every vertex
+ * of part p. Edges between parts are removed. Since the vertices of a part
+ * are generally not contiguous voxels, the subgraphs have no vertex runs.
+ */
+template <class TGraph, class TVertex, class TWeight>
+void SplitVoxelGraphByPartition(TGraph *graph, const TVertex *partition,
+                                std::vector<VoxelGraph<TVertex, TWeight> > &parts,
+                                std::vector<std::vector<TVertex> > &vertexMaps)
+{
+  const size_t nVertices = graph->GetNumberOfVertices();
+  const TVertex *xadj = graph->GetAdjacencyIndex();
+  const TVertex *adj = graph->GetAdjacency();
+
+  // Number the vertices within their parts and count the remaining edges
+  std::vector<TVertex> local(nVertices);
+  std::vector<size_t> nEdges(parts.size(), 0);
+  vertexMaps.assign(parts.size(), std::vector<TVertex>());
+  for(size_t v = 0; v < nVertices; v++)
+    {
+    TVertex p = partition[v];
+    local[v] = static_cast<TVertex>(vertexMaps[p].size());
+    vertexMaps[p].push_back(static_cast<TVertex>(v));
+    for(TVertex k = xadj[v]; k < xadj[v+1]; k++)
+      if(partition[adj[k]] == p)
+        nEdges[p]++;
+    }
+
+  // Fill the parts
+  for(size_t p = 0; p < parts.size(); p++)
+    {
+    VoxelGraph<TVertex, TWeight> &part = parts[p];
+    part.Allocate(vertexMaps[p].size(), nEdges[p], 0);
+    size_t ie = 0;
+    for(size_t iv = 0; iv < vertexMaps[p].size(); iv++)
+      {
+      TVertex v = vertexMaps[p][iv];
+      part.GetAdjacencyIndex()[iv] = static_cast<TVertex>(ie);
+      part.GetVertexWeights()[iv] = graph->GetVertexWeights()[v];
+      for(TVertex k = xadj[v]; k < xadj[v+1]; k++)
+        {
+        if(partition[adj[k]] != static_cast<TVertex>(p))
+          continue;
+        part.GetAdjacency()[ie] = local[adj[k]];
+        part.GetEdgeWeights()[ie++] = graph->GetEdgeWeights()[k];
+        }
+      }
+    part.GetAdjacencyIndex()[vertexMaps[p].size()] = static_cast<TVertex>(ie);
+    part.GetVertexRuns()[0] = VoxelRun { 0, vertexMaps[p].size() };
+    }
+}
+
+#endif // __VoxelGraph_h_
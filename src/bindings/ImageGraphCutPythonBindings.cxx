@@ -1,22 +1,30 @@
 #include <pybind11/pybind11.h>
 #include <pybind11/stl.h>
+#include <pybind11/numpy.h>
+#include <algorithm>
+#include <optional>
+#include <stdexcept>
 #include "ImageGraphCut.h"
 
 namespace py = pybind11;
 
-void py_image_graph_cut(std::string fn_input,
-                   std::string fn_output,
-                   int n_parts,
-                   const std::vector<double> weights,
-                   bool optimize_weights,
-                   float tolerance,
-                   int n_iter,
-                   int max_comp,
-                   double min_comp_frac)
+/** Fill the partitioning parameters shared by all entry points */
+ImageGraphCutParameters make_parameters(int n_parts,
+                                        const std::vector<double> &weights,
+                                        bool optimize_weights,
+                                        int optimize_population,
+                                        int optimize_max_evals,
+                                        double optimize_max_seconds,
+                                        float tolerance,
+                                        int n_iter,
+                                        int max_comp,
+                                        double min_comp_frac,
+                                        int n_threads,
+                                        double mem_budget_gb,
+                                        int coarsen_factor,
+                                        int incremental_radius)
 {
   ImageGraphCutParameters pd;
-  pd.fnInput = fn_input;
-  pd.fnOutput = fn_output;
   pd.nParts = n_parts;
   if(weights.size() == 0)
   {
@@ -31,17 +39,295 @@ void py_image_graph_cut(std::string fn_input,
   }
   else
   {
-    throw std::string("Incorrect number of weights");
+    throw std::invalid_argument("Incorrect number of weights");
   }
   pd.flagOptimize = optimize_weights;
+  pd.opt_population = optimize_population;
+  pd.opt_max_evals = optimize_max_evals;
+  pd.opt_max_seconds = optimize_max_seconds;
   pd.tolerance = tolerance;
   pd.nMetisIter = n_iter;
   pd.max_comp = max_comp;
   pd.min_comp_frac = min_comp_frac;
+  pd.n_threads = n_threads;
+  pd.mem_budget_gb = mem_budget_gb;
+  pd.coarsen_factor = coarsen_factor;
+  pd.incremental_radius = incremental_radius;
+  return pd;
+}
+
+/** Set the cut plane from a list of its dimension, slice and strength, if not empty */
+void set_cut_plane(ImageGraphCutParameters &pd, const std::vector<int> &cut_plane)
+{
+  if(cut_plane.empty())
+    return;
+  if(cut_plane.size() != 3)
+    throw std::invalid_argument("The cut plane must be given as [dimension, slice, strength]");
+  pd.iPlaneDim = cut_plane[0];
+  pd.iPlaneSlice = cut_plane[1];
+  pd.iPlaneStrength = cut_plane[2];
+}
+
+/** Convert the profile of a run to a dict */
+py::dict profile_to_dict(const ImageGraphCutProfile &profile)
+{
+  auto stage_dict = [](const ImageGraphCutStageProfile &stage) {
+    py::dict d;
+    d["name"] = stage.name;
+    d["wall_seconds"] = stage.wall_seconds;
+    d["cpu_seconds"] = stage.cpu_seconds;
+    d["peak_rss_bytes"] = stage.peak_rss_bytes;
+    return d;
+  };
+
+  py::list stages, components;
+  for(const ImageGraphCutStageProfile &stage : profile.stages)
+    stages.append(stage_dict(stage));
+  for(const ImageGraphCutComponentProfile &c : profile.components)
+  {
+    py::dict d;
+    d["label"] = c.label;
+    d["n_parts"] = c.n_parts;
+    d["voxels"] = c.voxels;
+    d["vertices"] = c.vertices;
+    d["edges"] = c.edges;
+    d["runs"] = c.runs;
+    d["graph_bytes"] = c.graph_bytes;
+    d["edge_cut"] = c.edge_cut;
+    d["partition_seconds"] = c.partition_seconds;
+    d["optimize_seconds"] = c.optimize_seconds;
+    d["metis_seconds"] = c.metis_seconds;
+    d["write_seconds"] = c.write_seconds;
+    components.append(d);
+  }
+
+  py::dict result;
+  result["total"] = stage_dict(profile.total);
+  result["stages"] = stages;
+  result["components"] = components;
+  return result;
+}
+
+py::object py_image_graph_cut(std::string fn_input,
+                   std::string fn_output,
+                   int n_parts,
+                   const std::vector<double> weights,
+                   bool optimize_weights,
+                   int optimize_population,
+                   int optimize_max_evals,
+                   double optimize_max_seconds,
+                   float tolerance,
+                   int n_iter,
+                   int max_comp,
+                   double min_comp_frac,
+                   int n_threads,
+                   double mem_budget_gb,
+                   int coarsen_factor,
+                   std::string fn_previous,
+                   int incremental_radius,
+                   int stream_slab,
+                   std::string fn_scratch,
+                   std::string fn_save_graph,
+                   int tree_depth,
+                   std::string fn_tree,
+                   bool profile,
+                   std::string fn_profile,
+                   std::string fn_hint,
+                   std::string fn_edge_image,
+                   std::string edge_function,
+                   double edge_sigma,
+                   double edge_scale,
+                   const std::vector<int> cut_plane,
+                   int connectivity)
+{
+  ImageGraphCutParameters pd = make_parameters(
+    n_parts, weights, optimize_weights, optimize_population, optimize_max_evals,
+    optimize_max_seconds, tolerance, n_iter,
+    max_comp, min_comp_frac, n_threads, mem_budget_gb, coarsen_factor, incremental_radius);
+  pd.fnInput = fn_input;
+  pd.fnOutput = fn_output;
+  pd.fnPrevious = fn_previous;
+  pd.stream_slab = stream_slab;
+  pd.fnScratch = fn_scratch;
+  pd.fnSaveGraph = fn_save_graph;
+  pd.tree_depth = tree_depth;
+  pd.fnTree = fn_tree;
+  pd.fnProfile = fn_profile;
+  pd.fnHint = fn_hint;
+  pd.fnEdgeImage = fn_edge_image;
+  pd.edge_function = edge_function;
+  pd.edge_sigma = edge_sigma;
+  pd.edge_scale = edge_scale;
+  set_cut_plane(pd, cut_plane);
+  pd.connectivity = connectivity;
+
+  if(!profile)
+  {
+    image_graph_cut(pd);
+    return py::none();
+  }
 
-  image_graph_cut(pd);
+  ImageGraphCutProfile run_profile;
+  image_graph_cut(pd, run_profile);
+  return profile_to_dict(run_profile);
 }
 
+/** Sweep part counts, returning a dict with the edge cut and balance of each */
+py::list py_image_graph_cut_sweep(std::string fn_input,
+                                  std::string fn_output,
+                                  const std::vector<int> part_counts,
+                                  bool stack,
+                                  bool optimize_weights,
+                                  int optimize_population,
+                                  int optimize_max_evals,
+                                  double optimize_max_seconds,
+                                  float tolerance,
+                                  int n_iter,
+                                  int max_comp,
+                                  double min_comp_frac,
+                                  int n_threads,
+                                  double mem_budget_gb,
+                                  int coarsen_factor,
+                                  std::string fn_save_graph,
+                                  int connectivity)
+{
+  if(part_counts.empty())
+    throw std::invalid_argument("No part counts to sweep");
+
+  ImageGraphCutParameters pd = make_parameters(
+    part_counts[0], std::vector<double>(), optimize_weights, optimize_population, optimize_max_evals,
+    optimize_max_seconds, tolerance, n_iter,
+    max_comp, min_comp_frac, n_threads, mem_budget_gb, coarsen_factor,
+    ImageGraphCutParameters().incremental_radius);
+  pd.fnInput = fn_input;
+  pd.fnOutput = fn_output;
+  pd.sweep_parts = part_counts;
+  pd.sweep_stack = stack;
+  pd.fnSaveGraph = fn_save_graph;
+  pd.connectivity = connectivity;
+
+  py::list result;
+  for(const ImageGraphCutSweepResult &r : image_graph_cut_sweep(pd))
+  {
+    py::dict d;
+    d["n_parts"] = r.n_parts;
+    d["edge_cut"] = r.edge_cut;
+    d["imbalance"] = r.imbalance;
+    d["fn_output"] = r.fn_output;
+    result.append(d);
+  }
+  return result;
+}
+
+/** 
+ * Partition an image passed as a NumPy array of shape (z, y, x), the layout
+ * used by SimpleITK. A C-contiguous int16 array is used in place; any other
+ * array is converted to one first.
+ */
+py::array_t<short> py_image_graph_cut_array(
+  py::array_t<short, py::array::c_style | py::array::forcecast> image,
+  int n_parts,
+  const std::vector<double> spacing,
+  const std::vector<double> origin,
+  const std::vector<double> weights,
+  bool optimize_weights,
+  int optimize_population,
+  int optimize_max_evals,
+  double optimize_max_seconds,
+  float tolerance,
+  int n_iter,
+  int max_comp,
+  double min_comp_frac,
+  int n_threads,
+  double mem_budget_gb,
+  int coarsen_factor,
+  std::optional< py::array_t<short, py::array::c_style | py::array::forcecast> > previous,
+  int incremental_radius,
+  const std::vector<int> cut_plane,
+  int connectivity)
+{
+  if(image.ndim() != 3)
+    throw std::invalid_argument("Image must be a 3D array");
+  if(spacing.size() != 3 || origin.size() != 3)
+    throw std::invalid_argument("Spacing and origin must have three elements");
+
+  ImageGraphCutParameters pd = make_parameters(
+    n_parts, weights, optimize_weights, optimize_population, optimize_max_evals,
+    optimize_max_seconds, tolerance, n_iter,
+    max_comp, min_comp_frac, n_threads, mem_budget_gb, coarsen_factor, incremental_radius);
+  set_cut_plane(pd, cut_plane);
+  pd.connectivity = connectivity;
+
+  // NumPy shapes are in (z, y, x) order, the pipeline uses (x, y, z)
+  size_t size[3] = { (size_t) image.shape(2), (size_t) image.shape(1), (size_t) image.shape(0) };
+  py::array_t<short> result({ image.shape(0), image.shape(1), image.shape(2) });
+  const short *input = image.data();
+  short *output = result.mutable_data();
+  const short *prev = nullptr;
+  if(previous)
+  {
+    if(previous->ndim() != 3 || previous->shape(0) != image.shape(0) ||
+       previous->shape(1) != image.shape(1) || previous->shape(2) != image.shape(2))
+      throw std::invalid_argument("Previous labels must have the shape of the image");
+    prev = previous->data();
+  }
+  {
+    py::gil_scoped_release release;
+    image_graph_cut(pd, input, output, size, spacing.data(), origin.data(), prev);
+  }
+  return result;
+}
+
+/** A voxel graph owned by Python, with the shape of the image it came from */
+struct PyImageGraph
+{
+  ImageGraph graph;
+  std::vector<py::ssize_t> shape;
+};
+
+/** NumPy view of an array of the graph, which keeps the graph object alive */
+template <class T>
+py::array_t<T> graph_array_view(py::object owner, T *data, size_t n)
+{
+  return py::array_t<T>({ (py::ssize_t) n }, { (py::ssize_t) sizeof(T) }, data, owner);
+}
+
+PyImageGraph py_build_graph(py::array_t<short, py::array::c_style | py::array::forcecast> image,
+                            int connectivity)
+{
+  if(image.ndim() != 3)
+    throw std::invalid_argument("Image must be a 3D array");
+
+  PyImageGraph g;
+  g.shape = { image.shape(0), image.shape(1), image.shape(2) };
+  size_t size[3] = { (size_t) image.shape(2), (size_t) image.shape(1), (size_t) image.shape(0) };
+  const short *input = image.data();
+  {
+    py::gil_scoped_release release;
+    image_graph_build(input, size, g.graph, connectivity);
+  }
+  return g;
+}
+
+py::tuple py_partition_graph(PyImageGraph &g,
+                             int n_parts,
+                             const std::vector<float> weights,
+                             float tolerance,
+                             int n_iter)
+{
+  if(weights.size() != 0 && weights.size() != (size_t) n_parts)
+    throw std::invalid_argument("Incorrect number of weights");
+
+  py::array_t<idx_t> partition((py::ssize_t) g.graph.GetNumberOfVertices());
+  idx_t *out = partition.mutable_data();
+  idx_t cut;
+  {
+    py::gil_scoped_release release;
+    cut = image_graph_partition(g.graph, n_parts, weights.size() ? weights.data() : nullptr,
+                                tolerance, n_iter, out);
+  }
+  return py::make_tuple(partition, cut);
+}
 
 PYBIND11_MODULE(picsl_image_graph_cut, m) {
   // Default parameters
@@ -53,19 +339,48 @@ PYBIND11_MODULE(picsl_image_graph_cut, m) {
         py::arg("n_parts"),
         py::arg("weights") = std::vector<double>(),
         py::arg("optimize_weights") = pd.flagOptimize,
+        py::arg("optimize_population") = pd.opt_population,
+        py::arg("optimize_max_evals") = pd.opt_max_evals,
+        py::arg("optimize_max_seconds") = pd.opt_max_seconds,
         py::arg("tolerance") = pd.tolerance,
         py::arg("n_metis_iter") = pd.nMetisIter,
         py::arg("max_comp") = pd.max_comp,
         py::arg("min_comp_frac") = pd.min_comp_frac,
+        py::arg("n_threads") = pd.n_threads,
+        py::arg("mem_budget_gb") = pd.mem_budget_gb,
+        py::arg("coarsen_factor") = pd.coarsen_factor,
+        py::arg("fn_previous") = std::string(),
+        py::arg("incremental_radius") = pd.incremental_radius,
+        py::arg("stream_slab") = pd.stream_slab,
+        py::arg("fn_scratch") = std::string(),
+        py::arg("fn_save_graph") = std::string(),
+        py::arg("tree_depth") = pd.tree_depth,
+        py::arg("fn_tree") = std::string(),
+        py::arg("profile") = false,
+        py::arg("fn_profile") = std::string(),
+        py::arg("fn_hint") = std::string(),
+        py::arg("fn_edge_image") = std::string(),
+        py::arg("edge_function") = pd.edge_function,
+        py::arg("edge_sigma") = pd.edge_sigma,
+        py::arg("edge_scale") = pd.edge_scale,
+        py::arg("cut_plane") = std::vector<int>(),
+        py::arg("connectivity") = pd.connectivity,
         R"pbdoc(
             Cut a binary 3D image into a fixed number of partitions.
 
             Parameters:
-                fn_input (str): Input image filename
+                fn_input (str): Input image filename, or a graph file saved with fn_save_graph
                 fn_output (str): Output image filename
                 n_parts (int): Number of parts to partition the image into
                 weights (List[float], optional): Weights of the individual partitions
                 optimize_weights (bool, optional): Optimize the weigths, defaults to false
+                optimize_population (int, optional):
+                    When greater than one, optimize the weights with a parallel evolution
+                    strategy that runs METIS on this many candidate weights at once
+                optimize_max_evals (int, optional):
+                    Maximum number of METIS runs of the parallel weight optimization
+                optimize_max_seconds (float, optional):
+                    Wall-clock limit of the parallel weight optimization, zero for none
                 tolerance (float, optional):
                     Load imbalance tolerance (ubvec in METIS.
                     Must be >= 1. Larger values means more flexibility for non-equal partitions
@@ -75,6 +390,287 @@ PYBIND11_MODULE(picsl_image_graph_cut, m) {
                 min_comp_frac (float, optional):
                     Remove connected components in the input image that are larger than
                     this fraction of total volume.
+                n_threads (int, optional):
+                    Number of connected components partitioned concurrently, largest first
+                mem_budget_gb (float, optional):
+                    Only start a component when the estimated memory of all running
+                    components stays below this many gigabytes. Zero means no limit.
+                coarsen_factor (int, optional):
+                    When greater than one, partition the graph of blocks of k x k x k
+                    voxels and then refine the part boundaries on the voxel graph
+                fn_previous (str, optional):
+                    Output of an earlier run on a slightly different mask. Voxels keep
+                    their previous labels, and only the region around the edits is refined
+                incremental_radius (int, optional):
+                    With fn_previous, refine the voxels up to this many edges from an edit
+                stream_slab (int, optional):
+                    When positive, read and write the image in slabs of this many slices
+                    and keep the graph in a memory-mapped scratch file, for images that
+                    do not fit into memory
+                fn_scratch (str, optional):
+                    Scratch file used with stream_slab, by default next to the output
+                fn_save_graph (str, optional):
+                    Save the graphs of the largest max_comp components to this file, which
+                    can be passed as fn_input to partition them again without rebuilding
+                tree_depth (int, optional):
+                    When positive, split every component into n_parts parts recursively,
+                    this many levels deep, and label the voxels with the leaves
+                fn_tree (str, optional):
+                    With tree_depth, the text file describing the nodes of the trees.
+                    The label of the level L node holding a voxel with leaf label c is
+                    c - (c - f) % n_parts**(tree_depth - L), with f the first label of
+                    its component
+                profile (bool, optional):
+                    Return a dict with the wall time, CPU time and peak memory of every
+                    stage ('total', 'stages') and the graph size and timings of every
+                    component ('components')
+                fn_profile (str, optional):
+                    Save the same profile to this file in JSON format
+                fn_hint (str, optional):
+                    Hint file assigning weights to the vertices and edges of the graph by
+                    the intensities of the input (see the help of the command line tool)
+                fn_edge_image (str, optional):
+                    Grayscale image of the size of the input. The weight of every edge
+                    is multiplied by edge_scale * f(d / edge_sigma), rounded and at
+                    least one, where d is the intensity difference of its voxels
+                edge_function (str, optional):
+                    f(x): 'gauss' for exp(-x^2), 'exp' for exp(-|x|) or 'inv' for
+                    1 / (1 + |x|)
+                edge_sigma (float, optional):
+                    Scale of the differences, by default the root mean square
+                    difference over the edges
+                edge_scale (float, optional): Weight of edges with no difference
+                cut_plane (List[int], optional):
+                    [dimension, slice, strength] of a plane along which cuts are
+                    preferred: the edges between slices slice - 1 and slice are
+                    strength times cheaper to cut than the others
+                connectivity (int, optional):
+                    Link every voxel to its 6 face neighbors (default), or to 18 or
+                    26 neighbors, including those across edges and corners, in the
+                    connected components and the graph. The edge weights are then
+                    10, 7 and 6 for face, edge and corner neighbors
+
+            Returns:
+                The profile if profile is set, otherwise None
         )pbdoc");
-}
+  m.def("image_graph_cut_sweep", &py_image_graph_cut_sweep,
+        py::arg("fn_input"),
+        py::arg("fn_output"),
+        py::arg("part_counts"),
+        py::arg("stack") = pd.sweep_stack,
+        py::arg("optimize_weights") = pd.flagOptimize,
+        py::arg("optimize_population") = pd.opt_population,
+        py::arg("optimize_max_evals") = pd.opt_max_evals,
+        py::arg("optimize_max_seconds") = pd.opt_max_seconds,
+        py::arg("tolerance") = pd.tolerance,
+        py::arg("n_metis_iter") = pd.nMetisIter,
+        py::arg("max_comp") = pd.max_comp,
+        py::arg("min_comp_frac") = pd.min_comp_frac,
+        py::arg("n_threads") = pd.n_threads,
+        py::arg("mem_budget_gb") = pd.mem_budget_gb,
+        py::arg("coarsen_factor") = pd.coarsen_factor,
+        py::arg("fn_save_graph") = std::string(),
+        py::arg("connectivity") = pd.connectivity,
+        R"pbdoc(
+            Cut a binary 3D image into each of several numbers of equal parts,
+            building the graph only once.
+
+            The components of all the part counts are partitioned concurrently on
+            n_threads threads. The labels for n parts are saved to fn_output with _n
+            inserted before the extension, e.g., parts_100.nii.gz, or as the volumes
+            of a 4D image in fn_output if stack is set.
 
+            Parameters:
+                fn_input (str): Input image filename, or a graph file saved with fn_save_graph
+                fn_output (str): Output image filename
+                part_counts (List[int]): Numbers of parts to partition the image into
+                stack (bool, optional): Save a single 4D image with one volume per count
+                Other parameters: As in image_graph_cut
+
+            Returns:
+                List[dict]: For each count, the n_parts, the total edge_cut over the
+                components, the largest imbalance of a component and the fn_output
+        )pbdoc");
+  m.def("image_graph_cut_array", &py_image_graph_cut_array,
+        py::arg("image"),
+        py::arg("n_parts"),
+        py::arg("spacing") = std::vector<double>(3, 1.0),
+        py::arg("origin") = std::vector<double>(3, 0.0),
+        py::arg("weights") = std::vector<double>(),
+        py::arg("optimize_weights") = pd.flagOptimize,
+        py::arg("optimize_population") = pd.opt_population,
+        py::arg("optimize_max_evals") = pd.opt_max_evals,
+        py::arg("optimize_max_seconds") = pd.opt_max_seconds,
+        py::arg("tolerance") = pd.tolerance,
+        py::arg("n_metis_iter") = pd.nMetisIter,
+        py::arg("max_comp") = pd.max_comp,
+        py::arg("min_comp_frac") = pd.min_comp_frac,
+        py::arg("n_threads") = pd.n_threads,
+        py::arg("mem_budget_gb") = pd.mem_budget_gb,
+        py::arg("coarsen_factor") = pd.coarsen_factor,
+        py::arg("previous") = py::none(),
+        py::arg("incremental_radius") = pd.incremental_radius,
+        py::arg("cut_plane") = std::vector<int>(),
+        py::arg("connectivity") = pd.connectivity,
+        R"pbdoc(
+            Cut a binary 3D image held in memory into a fixed number of partitions.
+
+            The image is read in place, without copying, when it is a C-contiguous
+            int16 array, such as the one returned by SimpleITK.GetArrayViewFromImage.
+            Other arrays are converted to int16 first.
+
+            Parameters:
+                image (numpy.ndarray): Input image, indexed as [z, y, x]
+                n_parts (int): Number of parts to partition the image into
+                spacing (List[float], optional): Voxel spacing in (x, y, z) order
+                origin (List[float], optional): Image origin in (x, y, z) order
+                weights (List[float], optional): Weights of the individual partitions
+                optimize_weights (bool, optional): Optimize the weigths, defaults to false
+                optimize_population (int, optional):
+                    When greater than one, optimize the weights with a parallel evolution
+                    strategy that runs METIS on this many candidate weights at once
+                optimize_max_evals (int, optional):
+                    Maximum number of METIS runs of the parallel weight optimization
+                optimize_max_seconds (float, optional):
+                    Wall-clock limit of the parallel weight optimization, zero for none
+                tolerance (float, optional):
+                    Load imbalance tolerance (ubvec in METIS.
+                    Must be >= 1. Larger values means more flexibility for non-equal partitions
+                n_metis_iter (int, optional): Number of iterations of internal METIS optimization
+                max_comp (int, optional):
+                    Keep only the N largest connected components in the input image
+                min_comp_frac (float, optional):
+                    Remove connected components in the input image that are larger than
+                    this fraction of total volume.
+                n_threads (int, optional):
+                    Number of connected components partitioned concurrently, largest first
+                mem_budget_gb (float, optional):
+                    Only start a component when the estimated memory of all running
+                    components stays below this many gigabytes. Zero means no limit.
+                coarsen_factor (int, optional):
+                    When greater than one, partition the graph of blocks of k x k x k
+                    voxels and then refine the part boundaries on the voxel graph
+                previous (numpy.ndarray, optional):
+                    Labels returned by an earlier call on a slightly different mask. Voxels
+                    keep their previous labels, and only the region around the edits is refined
+                incremental_radius (int, optional):
+                    With previous, refine the voxels up to this many edges from an edit
+                cut_plane (List[int], optional):
+                    [dimension, slice, strength] of a plane along which cuts are
+                    preferred, with the dimension in (x, y, z) order, so that 2 is
+                    the first axis of the array
+                connectivity (int, optional):
+                    Number of neighbors of every voxel: 6 (default), 18 or 26
+
+            Returns:
+                numpy.ndarray: int16 array of part labels with the shape of the input
+        )pbdoc");
+
+  static_assert(sizeof(VoxelRun) == 2 * sizeof(size_t), "Vertex runs must be two packed offsets");
+  py::class_<PyImageGraph>(m, "ImageGraph", R"pbdoc(
+            Voxel graph of a 3D image in the compressed sparse row format used by METIS.
+
+            The arrays are NumPy views of the graph's own memory, which stays valid
+            for as long as any view or the graph itself is alive.
+        )pbdoc")
+    .def_property_readonly("shape", [](const PyImageGraph &g) {
+        return py::make_tuple(g.shape[0], g.shape[1], g.shape[2]); },
+        "Shape of the image the graph was built from, as (z, y, x)")
+    .def_property_readonly("n_vertices", [](const PyImageGraph &g) {
+        return g.graph.GetNumberOfVertices(); }, "Number of vertices")
+    .def_property_readonly("n_edges", [](const PyImageGraph &g) {
+        return g.graph.GetNumberOfEdges(); }, "Number of directional edges (2x symmetric edges)")
+    .def_property_readonly("xadj", [](py::object self) {
+        PyImageGraph &g = self.cast<PyImageGraph &>();
+        return graph_array_view(self, g.graph.GetAdjacencyIndex(), g.graph.GetNumberOfVertices() + 1); },
+        "Index of the first neighbor of every vertex in adjncy, followed by n_edges")
+    .def_property_readonly("adjncy", [](py::object self) {
+        PyImageGraph &g = self.cast<PyImageGraph &>();
+        return graph_array_view(self, g.graph.GetAdjacency(), g.graph.GetNumberOfEdges()); },
+        "Neighbors of all the vertices")
+    .def_property_readonly("vwgt", [](py::object self) {
+        PyImageGraph &g = self.cast<PyImageGraph &>();
+        return graph_array_view(self, g.graph.GetVertexWeights(), g.graph.GetNumberOfVertices()); },
+        "Vertex weights")
+    .def_property_readonly("adjwgt", [](py::object self) {
+        PyImageGraph &g = self.cast<PyImageGraph &>();
+        return graph_array_view(self, g.graph.GetEdgeWeights(), g.graph.GetNumberOfEdges()); },
+        "Edge weights, parallel to adjncy")
+    .def_property_readonly("runs", [](py::object self) {
+        PyImageGraph &g = self.cast<PyImageGraph &>();
+        py::ssize_t n = g.graph.GetNumberOfVertexRuns() + 1;
+        return py::array_t<size_t>(
+          { n, (py::ssize_t) 2 }, { (py::ssize_t) sizeof(VoxelRun), (py::ssize_t) sizeof(size_t) },
+          &g.graph.GetVertexRuns()->BufferOffset, self); },
+        R"pbdoc(
+            Vertex-to-voxel mapping as an (n_runs + 1, 2) array of runs. Row r holds
+            the flat voxel offset of the first vertex of run r and the number of that
+            vertex; the run covers the vertices up to the one in row r + 1. The last
+            row is a sentinel.
+        )pbdoc")
+    .def("voxel_offsets", [](PyImageGraph &g) {
+        py::array_t<size_t> offsets((py::ssize_t) g.graph.GetNumberOfVertices());
+        size_t *out = offsets.mutable_data();
+        const VoxelRun *runs = g.graph.GetVertexRuns();
+        for(size_t r = 0; r < g.graph.GetNumberOfVertexRuns(); r++)
+          for(size_t v = runs[r].FirstVertex; v < runs[r+1].FirstVertex; v++)
+            out[v] = runs[r].BufferOffset + (v - runs[r].FirstVertex);
+        return offsets; },
+        "Flat voxel offset of every vertex, expanded from the runs")
+    .def("partition_to_image", [](PyImageGraph &g, py::array_t<idx_t, py::array::c_style | py::array::forcecast> partition) {
+        if(partition.ndim() != 1 || (size_t) partition.shape(0) != g.graph.GetNumberOfVertices())
+          throw std::invalid_argument("Partition must have one entry per vertex");
+        py::array_t<short> image(g.shape);
+        short *out = image.mutable_data();
+        std::fill(out, out + image.size(), 0);
+        const idx_t *part = partition.data();
+        const VoxelRun *runs = g.graph.GetVertexRuns();
+        for(size_t r = 0; r < g.graph.GetNumberOfVertexRuns(); r++)
+          for(size_t v = runs[r].FirstVertex; v < runs[r+1].FirstVertex; v++)
+            out[runs[r].BufferOffset + (v - runs[r].FirstVertex)] = part[v] + 1;
+        return image; },
+        py::arg("partition"),
+        "Image with the one-based part of every vertex and zero elsewhere");
+
+  m.def("build_graph", &py_build_graph,
+        py::arg("image"),
+        py::arg("connectivity") = pd.connectivity,
+        R"pbdoc(
+            Build the voxel graph of a binary 3D image, indexed as [z, y, x].
+
+            The graph has the same vertices and weights as the one partitioned by
+            image_graph_cut, but covers all the connected components of the image.
+
+            Parameters:
+                image (numpy.ndarray): Input image, indexed as [z, y, x]
+                connectivity (int, optional):
+                    Number of neighbors of every voxel: 6 (default), 18 or 26
+
+            Returns:
+                ImageGraph: the graph of the nonzero voxels
+        )pbdoc");
+
+  m.def("partition_graph", &py_partition_graph,
+        py::arg("graph"),
+        py::arg("n_parts"),
+        py::arg("weights") = std::vector<float>(),
+        py::arg("tolerance") = pd.tolerance,
+        py::arg("n_metis_iter") = pd.nMetisIter,
+        R"pbdoc(
+            Partition an ImageGraph with METIS. The graph may have several
+            components, so the parts are not required to be connected.
+
+            Parameters:
+                graph (ImageGraph): Graph returned by build_graph
+                n_parts (int): Number of parts to partition the graph into
+                weights (List[float], optional): Weights of the individual partitions
+                tolerance (float, optional): Load imbalance tolerance (ubvec in METIS)
+                n_metis_iter (int, optional): Number of iterations of internal METIS optimization
+
+            Returns:
+                Tuple[numpy.ndarray, int]: zero-based part of every vertex, and the edge cut
+
+            Raises:
+                RuntimeError: if METIS fails to partition the graph
+        )pbdoc");
+}